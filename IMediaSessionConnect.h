@@ -20,7 +20,17 @@
 namespace CDMi {
 
     struct IMediaSessionConnect {
+        struct Statistics {
+            uint32_t ECMDeliveries;
+            uint32_t PlatformDeliveries;
+            uint32_t EMMDeliveries;
+        };
+
         virtual void OnKeyMessage(const uint8_t *f_pbKeyMessage, const uint32_t f_cbKeyMessage, const char *f_pszUrl) = 0;
+        // status is one of the OCDM key status strings ("KeyUsable", "KeyStatusPending", ...), length is 0 if the status is for all keys of the session
+        virtual void OnKeyStatusUpdate(const char* status, const uint8_t keyid[], const uint8_t length) = 0;
+        virtual void OnKeyStatusesUpdated() = 0;
+        virtual void GetStatistics(Statistics& statistics) const = 0;
     };
 
 } // namespace CDMi
@@ -25,16 +25,32 @@ struct IMediaSessionConnect;
 
 struct IMediaSessionSystem {
 
-    virtual TNvSession OpenDescramblingSession(IMediaSessionConnect* session, const uint32_t TSID, const uint16_t Emi) = 0; //returns Descramlbingsession ID
+    // keyids: keyidcount KIDs of 16 bytes from the init data, the key status of these is reported to the session
+    virtual TNvSession OpenDescramblingSession(IMediaSessionConnect* session, const uint32_t TSID, const uint16_t Emi, const uint8_t keyids[], const uint32_t keyidcount) = 0; //returns Descramlbingsession ID
     virtual void CloseDescramblingSession(TNvSession session, const uint32_t TSID) = 0;
 
     virtual void SetPrmContentMetadata(TNvSession descamblingsession, TNvBuffer* data, TNvStreamType streamtype) = 0;
     virtual void SetPlatformMetadata(TNvSession descamblingsession, const uint32_t TSID, uint8_t *data, size_t size) = 0;
 
+    // EMM delivered on a connect session, handled by the inband session of the system as if it came in on the system session
+    virtual void DeliverEMM(const uint8_t section[], const uint16_t length) = 0;
+
+    // sections written into the ring are ingested for descramblingsession (0: the system itself, EMMs only), an empty ring name detaches it
+    virtual void AttachSectionRing(TNvSession descramblingsession, const char ring[], const char doorbell[]) = 0;
+
     virtual void Addref() const = 0;
     virtual uint32_t Release() const = 0;
 
 };
+
+// result of IngestMediaSessionSystemSection
+enum SectionResult : int32_t {
+    SECTION_ACCEPTED = 0,
+    SECTION_UNCHANGED = 1, // same ECM as the last one for the descrambling session, or an EMM that was decrypted recently
+    SECTION_INVALID = -1, // too short, or not an ECM or EMM
+    SECTION_CRC_ERROR = -2,
+    SECTION_NOT_ROUTED = -3 // no such system or descrambling session
+};
   
 #ifdef __cplusplus
 extern "C" {
@@ -42,6 +58,13 @@ extern "C" {
 
     CDMi::IMediaSessionSystem* GetMediaSessionSystemInterface(const char* systemsessionid);
 
+    // writes the runtime statistics as a JSON object into buffer (truncated if it does not fit), returns the length of the complete JSON text
+    uint32_t GetMediaSessionSystemStatistics(char buffer[], const uint32_t length);
+
+    // raw private section from the demux (table_id up to and including the CRC32 if it has one), ECMs go to descramblingsession,
+    // EMMs to the inband session of the system (descramblingsession not used). Returns a CDMi::SectionResult.
+    int32_t IngestMediaSessionSystemSection(const char* systemsessionid, const TNvSession descramblingsession, const uint8_t section[], const uint32_t length);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,223 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Logger.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <chrono>
+
+namespace {
+
+    constexpr uint32_t Slots = 256; // must be a power of 2
+    constexpr uint32_t SlotTextSize = 248; // must be a multiple of 4
+    constexpr uint32_t FlushInterval = 100; // ms
+
+    constexpr uint32_t RateWindow = 1000; // ms
+    constexpr uint32_t ReportsPerRateWindow = 5;
+
+    // a slot is being written while its sequence is 0, when complete the sequence holds the ring index + 1.
+    // The text is kept in relaxed atomic words, Flush copies it while a writer of the next lap may be overwriting it
+    // (it checks the sequence again afterwards) and with plain chars that copy would be a data race.
+    struct Slot {
+        std::atomic<uint32_t> Sequence;
+        std::atomic<uint32_t> Text[SlotTextSize / sizeof(uint32_t)];
+    };
+
+    // note: all of these are constant initialized so they can be used safely from other static constructors/destructors
+    Slot g_slots[Slots];
+    std::atomic<uint32_t> g_head(0);
+    std::atomic<uint32_t> g_tail(0);
+    std::atomic<bool> g_direct(false);
+    std::atomic_flag g_flushing = ATOMIC_FLAG_INIT;
+    std::atomic<const CDMi::Log::CallSite*> g_callsites(nullptr);
+
+    class Flusher : public Thunder::Core::Thread {
+    public:
+        Flusher(const Flusher&) = delete;
+        Flusher& operator=(const Flusher&) = delete;
+
+        Flusher()
+            : Thunder::Core::Thread(Thunder::Core::Thread::DefaultStackSize(), "Nagra DRM Log Flusher") {
+            Run();
+        }
+        ~Flusher() {
+            Stop();
+            Wait(Thread::STOPPED, Thunder::Core::infinite);
+
+            // from here on there is no one left to flush in the background
+            g_direct.store(true, std::memory_order_relaxed);
+            CDMi::Log::Flush();
+        }
+
+    protected:
+        uint32_t Worker() override {
+            CDMi::Log::Flush();
+            return FlushInterval;
+        }
+    };
+
+    void Store(Slot& slot, const char text[], const uint32_t length) {
+        const uint32_t words = ( length + sizeof(uint32_t) ) / sizeof(uint32_t); // including the terminator
+
+        for( uint32_t index = 0; index < words; ++index ) {
+            uint32_t word;
+            memcpy(&word, &text[index * sizeof(uint32_t)], sizeof(word));
+            slot.Text[index].store(word, std::memory_order_relaxed);
+        }
+    }
+
+    void Load(const Slot& slot, char text[]) {
+        for( uint32_t index = 0; index < ( SlotTextSize / sizeof(uint32_t) ); ++index ) {
+            const uint32_t word = slot.Text[index].load(std::memory_order_relaxed);
+            memcpy(&text[index * sizeof(uint32_t)], &word, sizeof(word));
+        }
+    }
+
+    void StartFlusher() { // make sure the thread is only started when something is actually logged
+        static Flusher flusher;
+    }
+
+    uint64_t Milliseconds() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+}
+
+namespace CDMi {
+namespace Log {
+
+void Write(const Level level, const char* format, ...) {
+    const uint32_t index = g_head.fetch_add(1, std::memory_order_relaxed);
+    Slot& slot = g_slots[index & (Slots - 1)];
+
+    slot.Sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    char text[SlotTextSize];
+
+    va_list arguments;
+    va_start(arguments, format);
+    const int length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+
+    if( length < 0 ) {
+        text[0] = '\0';
+    }
+    Store(slot, text, ( length < 0 ? 0 : std::min(static_cast<uint32_t>(length), SlotTextSize - 1) ));
+
+    slot.Sequence.store(index + 1, std::memory_order_release);
+
+    if( ( level <= LEVEL_WARNING ) || ( g_direct.load(std::memory_order_relaxed) == true ) || ( ( index - g_tail.load(std::memory_order_relaxed) ) >= ( Slots / 2 ) ) ) {
+        Flush();
+    }
+    else {
+        StartFlusher();
+    }
+}
+
+void Flush() {
+    if( g_flushing.test_and_set(std::memory_order_acquire) == false ) {
+
+        const uint32_t head = g_head.load(std::memory_order_acquire);
+        uint32_t tail = g_tail.load(std::memory_order_relaxed);
+        uint32_t dropped = 0;
+
+        if( ( head - tail ) > Slots ) { // writers lapped us, the oldest lines are gone
+            dropped += ( head - tail - Slots );
+            tail = head - Slots;
+        }
+
+        char text[SlotTextSize];
+
+        while( tail != head ) {
+            const Slot& slot = g_slots[tail & (Slots - 1)];
+            const uint32_t sequence = slot.Sequence.load(std::memory_order_acquire);
+
+            // 0 or the index of a previous lap: a writer claimed this slot but has not finished (or even started) it yet
+            if( ( sequence == 0 ) || ( static_cast<int32_t>(sequence - ( tail + 1 )) < 0 ) ) {
+                break; // pick it up next time
+            }
+
+            if( sequence == ( tail + 1 ) ) {
+                Load(slot, text);
+                std::atomic_thread_fence(std::memory_order_acquire);
+
+                if( slot.Sequence.load(std::memory_order_relaxed) == sequence ) {
+                    text[sizeof(text) - 1] = '\0';
+                    fputs(text, stderr);
+                    fputc('\n', stderr);
+                }
+                else {
+                    ++dropped; // overwritten while we were copying it
+                }
+            }
+            else {
+                ++dropped; // overwritten by a writer of a later lap
+            }
+            ++tail;
+        }
+
+        g_tail.store(tail, std::memory_order_relaxed);
+
+        if( dropped != 0 ) {
+            fprintf(stderr, "%u log lines dropped\n", dropped);
+        }
+        fflush(stderr);
+
+        g_flushing.clear(std::memory_order_release);
+    }
+}
+
+CallSite::CallSite(const char* name)
+    : _name(name)
+    , _next(g_callsites.load(std::memory_order_relaxed))
+    , _failures(0)
+    , _window(0)
+    , _reported(0)
+    , _suppressed(0) {
+
+    while( g_callsites.compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed) == false ) {
+    }
+}
+
+/* static */ const CallSite* CallSite::First() {
+    return g_callsites.load(std::memory_order_acquire);
+}
+
+int32_t CallSite::Failed() {
+    int32_t result = -1;
+
+    _failures.fetch_add(1, std::memory_order_relaxed);
+
+    const uint64_t now = Milliseconds();
+    uint64_t window = _window.load(std::memory_order_relaxed);
+
+    if( ( ( now - window ) >= RateWindow ) && ( _window.compare_exchange_strong(window, now, std::memory_order_relaxed) == true ) ) {
+        _reported.store(0, std::memory_order_relaxed);
+    }
+
+    if( _reported.fetch_add(1, std::memory_order_relaxed) < ReportsPerRateWindow ) {
+        result = static_cast<int32_t>(_suppressed.exchange(0, std::memory_order_relaxed));
+    }
+    else {
+        _suppressed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return result;
+}
+
+} // namespace Log
+} // namespace CDMi
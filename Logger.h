@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <atomic>
+
+namespace CDMi {
+namespace Log {
+
+    enum Level : uint8_t {
+        LEVEL_ERROR   = 0,
+        LEVEL_WARNING = 1,
+        LEVEL_INFO    = 2,
+        LEVEL_TRACE   = 3
+    };
+
+    // Formats the line into a slot of a lock free in memory ring. Writing it to stderr is done by a background flusher,
+    // errors and warnings (or a ring that is filling up) are flushed on the calling thread right away.
+    void Write(const Level level, const char* format, ...) __attribute__ ((format (printf, 2, 3)));
+
+    // Writes all completed lines in the ring to stderr. Safe to call from any thread, if another thread is already flushing this returns immediately.
+    void Flush();
+
+    // One instance per REPORT_PRM* macro site (a function static), used to rate limit failures that keep repeating
+    class CallSite {
+    public:
+        CallSite(const CallSite&) = delete;
+        CallSite& operator=(const CallSite&) = delete;
+
+        explicit CallSite(const char* name);
+        ~CallSite() = default;
+
+        const char* Name() const {
+            return _name;
+        }
+
+        uint32_t Failures() const {
+            return _failures.load(std::memory_order_relaxed);
+        }
+
+        // Registers a failure, returns the number of failures that were suppressed since the last one reported or -1 in case this one should be suppressed as well
+        int32_t Failed();
+
+        // all call sites that failed at least once, note there can be more than one site for the same call name
+        static const CallSite* First();
+
+        const CallSite* Next() const {
+            return _next;
+        }
+
+    private:
+        const char* _name;
+        const CallSite* _next;
+        std::atomic<uint32_t> _failures;
+        std::atomic<uint64_t> _window;
+        std::atomic<uint32_t> _reported;
+        std::atomic<uint32_t> _suppressed;
+    };
+
+} // namespace Log
+} // namespace CDMi
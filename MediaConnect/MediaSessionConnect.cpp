@@ -65,7 +65,11 @@ MediaSessionConnect::MediaSessionConnect(const uint8_t *data, uint32_t length)
     , _descramblingSession(0)
     , _TSID(0)
     , _systemsession(nullptr)
-    , _lock() {
+    , _lock()
+    , _ecmDeliveries(0)
+    , _platformDeliveries(0)
+    , _emmDeliveries(0)
+    , _pendingKeyStatuses() {
 
     REPORT("enter MediaSessionConnect::MediaSessionConnect"); 
 
@@ -77,8 +81,9 @@ MediaSessionConnect::MediaSessionConnect(const uint8_t *data, uint32_t length)
 
     // parse pssh header
     std::string systemsessionid;
-    const uint8_t *privatedata = data;
-    int32_t result = FindPSSHHeaderPrivateData(privatedata, length);
+    PSSHHeader header;
+    int32_t result = ParsePSSHHeader(data, length, header);
+    const uint8_t *privatedata = header.PrivateData;
 
     if( result > 0 ) {
         Thunder::Core::FrameType<0> frame(const_cast<uint8_t *>(privatedata), result, result);
@@ -107,8 +112,9 @@ MediaSessionConnect::MediaSessionConnect(const uint8_t *data, uint32_t length)
 
         REPORT_EXT("ConnectSession TSID used; %u", _TSID);
         REPORT_EXT("ConnectSession Emi used; %u", Emi);
+        REPORT_EXT("ConnectSession KIDs used; %u", header.KeyIdCount);
 
-        _descramblingSession = _systemsession->OpenDescramblingSession(this, _TSID, Emi);
+        _descramblingSession = _systemsession->OpenDescramblingSession(this, _TSID, Emi, header.KeyIds, header.KeyIdCount);
 
         _sessionId += std::to_string(_descramblingSession);
 
@@ -158,29 +164,53 @@ void MediaSessionConnect::Run(const IMediaKeySessionCallback* callback) {
 
     _callback = const_cast<IMediaKeySessionCallback*>(callback);  
 
+    if( _callback != nullptr ) {
+        // the system session posts the status of KIDs it already knows while our constructor is still running
+        ReplayKeyStatuses();
+    }
+
    _lock.Unlock();
 }
 
+void MediaSessionConnect::ReplayKeyStatuses() {
+    // already in lock
+
+    if( _pendingKeyStatuses.empty() == false ) {
+        for( const PendingKeyStatus& pending : _pendingKeyStatuses ) {
+            _callback->OnKeyStatusUpdate(pending.Status.c_str(), ( pending.KeyId.empty() == false ? pending.KeyId.data() : nullptr ), static_cast<uint8_t>(pending.KeyId.size()));
+        }
+        _pendingKeyStatuses.clear();
+
+        _callback->OnKeyStatusesUpdated();
+    }
+}
+
 void MediaSessionConnect::Update(const uint8_t *data, uint32_t length) {
-    REPORT("enter MediaSessionConnect::Update");
+    REPORT_TRACE("enter MediaSessionConnect::Update");
 
     Thunder::Core::FrameType<0> frame(const_cast<uint8_t *>(data), length, length);
     Thunder::Core::FrameType<0>::Reader reader(frame, 0);
 
-    REPORT("NagraSytem update triggered");
+    REPORT_TRACE("NagraSytem update triggered");
 
  
    if( reader.HasData() == true ) {
 
-        Request value = static_cast<Request>(reader.Number<requestsSize>());
+        const requestsSize request = reader.Number<requestsSize>();
+        Request value = static_cast<Request>(request & ~RequestIdPresent);
+
+        if( ( request & RequestIdPresent ) != 0 ) {
+            reader.Number<uint32_t>(); // request IDs are only used for the system messages
+        }
 
-        REPORT_EXT("NagraSytem update triggered with %d", value);
+        REPORT_TRACE_EXT("NagraSytem update triggered with %u", static_cast<requestsSize>(value));
 
         switch (value) {
         case Request::ECMDELIVERY:
         {
-            REPORT("NagraSytem importing ECM response");
+            REPORT_TRACE("NagraSytem importing ECM response");
             ASSERT( reader.HasData() == true );
+            _ecmDeliveries.fetch_add(1, std::memory_order_relaxed);
             TNvBuffer buf = { nullptr, 0 }; 
             const uint8_t* pbuffer;
             buf.size = reader.LockBuffer<uint16_t>(pbuffer);
@@ -197,8 +227,9 @@ void MediaSessionConnect::Update(const uint8_t *data, uint32_t length) {
         }
         case Request::PLATFORMDELIVERY:
         {
-            REPORT("NagraSytem importing PLATFORM Delivery");
+            REPORT_TRACE("NagraSytem importing PLATFORM Delivery");
             ASSERT( reader.HasData() == true );
+            _platformDeliveries.fetch_add(1, std::memory_order_relaxed);
             const uint8_t * pbuffer;
             size_t size = reader.LockBuffer<uint16_t>(pbuffer);
             uint8_t *data = const_cast<uint8_t *>(pbuffer);
@@ -214,6 +245,37 @@ void MediaSessionConnect::Update(const uint8_t *data, uint32_t length) {
             reader.UnlockBuffer(size);
             break;
         }
+        case Request::EMMDELIVERY:
+        {
+            // same as on the system session (see MediaRequest.h), so a player does not need the system session for the EMMs of the service TS
+            REPORT_TRACE("NagraSytem forwarding EMM delivery");
+            ASSERT( reader.HasData() == true );
+            while( reader.HasData() == true ) {
+                _emmDeliveries.fetch_add(1, std::memory_order_relaxed);
+                const uint8_t* pbuffer;
+                const uint16_t size = reader.LockBuffer<uint16_t>(pbuffer);
+                if( _systemsession != nullptr ) {
+                    _systemsession->DeliverEMM(pbuffer, size);
+                }
+                else {
+                  REPORT("could not handle EMMDELIVERY, no system available");
+                }
+                reader.UnlockBuffer(size);
+            }
+            break;
+        }
+        case Request::SECTIONRING:
+        {
+            const string ring = reader.Text();
+            const string doorbell = ( reader.HasData() == true ? reader.Text() : string() );
+            if( _systemsession != nullptr ) {
+                _systemsession->AttachSectionRing(_descramblingSession, ring.c_str(), doorbell.c_str());
+            }
+            else {
+              REPORT("could not handle SECTIONRING, no system available");
+            }
+            break;
+        }
         default: /* WTF */
             break;
         }
@@ -221,7 +283,7 @@ void MediaSessionConnect::Update(const uint8_t *data, uint32_t length) {
     else {
        REPORT("MediaSessionConnect::Update: expected more data");
     }
-        REPORT("leave MediaSessionConnect::Update");
+        REPORT_TRACE("leave MediaSessionConnect::Update");
 }
 
 CDMi_RESULT MediaSessionConnect::Load() {
@@ -276,5 +338,49 @@ void MediaSessionConnect::OnKeyMessage(const uint8_t *f_pbKeyMessage, const uint
 
 }
 
+void MediaSessionConnect::OnKeyStatusUpdate(const char* status, const uint8_t keyid[], const uint8_t length) {
+    REPORT_EXT("MediaSessionConnect::OnKeyStatusUpdate %s", status);
+
+    _lock.Lock();
+
+    if( _callback != nullptr ) {
+        _callback->OnKeyStatusUpdate(status, keyid, length);
+    }
+    else {
+        // a status without KID (sessions that have none, e.g. the delivery result) is kept like that of one more KID
+        const uint8_t size = ( keyid != nullptr ? length : 0 );
+
+        auto pending = _pendingKeyStatuses.begin();
+        while( ( pending != _pendingKeyStatuses.end() ) && ( ( pending->KeyId.size() != size ) || ( std::equal(pending->KeyId.begin(), pending->KeyId.end(), keyid) == false ) ) ) {
+            ++pending;
+        }
+
+        if( pending != _pendingKeyStatuses.end() ) {
+            pending->Status = status;
+        }
+        else {
+            _pendingKeyStatuses.emplace_back(status, keyid, size);
+        }
+    }
+
+    _lock.Unlock();
+}
+
+void MediaSessionConnect::OnKeyStatusesUpdated() {
+    _lock.Lock();
+
+    // without a callback the statuses are pending, Run() sends this after replaying them
+    if( _callback != nullptr ) {
+        _callback->OnKeyStatusesUpdated();
+    }
+
+    _lock.Unlock();
+}
+
+void MediaSessionConnect::GetStatistics(Statistics& statistics) const {
+    statistics.ECMDeliveries = _ecmDeliveries.load(std::memory_order_relaxed);
+    statistics.PlatformDeliveries = _platformDeliveries.load(std::memory_order_relaxed);
+    statistics.EMMDeliveries = _emmDeliveries.load(std::memory_order_relaxed);
+}
 
 }  // namespace CDMi
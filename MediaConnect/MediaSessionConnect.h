@@ -20,6 +20,9 @@
 
 #include <interfaces/IDRM.h> 
 
+#include <atomic>
+#include <vector>
+
 #include "../IMediaSessionConnect.h"
 #include "../IMediaSessionSystem.h"
 
@@ -68,16 +71,26 @@ public:
         const uint32_t  f_cbClearContentOpaque,
         uint8_t  *f_pbClearContentOpaque );
 
-    // Note: the KeyUsable (and other) events are currently not (yet) triggered as it is not required by the current nagra client. 
-    //       In the future (e.g. before connect it to the WPEWebkit) this should be connected to the appicable Nagra callback (we are not sure
-    //       at this moment which one) to make this work with Clients that expect this callback
-    // virtual void OnKeyStatusUpdate(const char* keyMessage, const uint8_t* buffer, const uint8_t length) = 0;
-
-
     // IMediaSessionConnect overrides
     void OnKeyMessage(const uint8_t *f_pbKeyMessage, const uint32_t f_cbKeyMessage, const char *f_pszUrl) override;
+    void OnKeyStatusUpdate(const char* status, const uint8_t keyid[], const uint8_t length) override;
+    void OnKeyStatusesUpdated() override;
+    void GetStatistics(Statistics& statistics) const override;
 
 private:
+    // a key status that came in before Run() handed us the callback, replayed from Run()
+    struct PendingKeyStatus {
+        PendingKeyStatus(const char* status, const uint8_t keyid[], const uint8_t length)
+            : Status(status)
+            , KeyId(keyid, keyid + length) {
+        }
+
+        std::string Status;
+        std::vector<uint8_t> KeyId;
+    };
+
+    void ReplayKeyStatuses();
+
     constexpr static  const char* const g_NAGRASessionIDPrefix = { "NSCID:" };
     
     std::string _sessionId;
@@ -86,6 +99,10 @@ private:
     uint32_t _TSID;
     IMediaSessionSystem* _systemsession;
     Thunder::Core::CriticalSection _lock;
+    std::atomic<uint32_t> _ecmDeliveries;
+    std::atomic<uint32_t> _platformDeliveries;
+    std::atomic<uint32_t> _emmDeliveries;
+    std::vector<PendingKeyStatus> _pendingKeyStatuses; // the last one per KID (and without KID), in lock
 };
 
 } // namespace CDMi
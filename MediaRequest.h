@@ -28,10 +28,17 @@ namespace CDMi {
         KEYREADY         = 0x0002,
         KEYNEEDED        = 0x0004,
         RENEWAL          = 0x0008,
-        EMMDELIVERY      = 0x0010,
+        EMMDELIVERY      = 0x0010, // system or connect session, followed by one or more EMM sections, each a uint16_t length and the section
         PROVISION        = 0x0020,
         ECMDELIVERY      = 0x0040,
         PLATFORMDELIVERY = 0x0080,
+        SECTIONRING      = 0x0100, // followed by the name of a CyclicBuffer and of its doorbell (see SectionRing), an empty name detaches
+        SUBSCRIBE        = 0x0200, // system session only, followed by a requestsSize mask of the key message types (FILTERS, KEYNEEDED, RENEWAL, PROVISION) it wants
+        BATCH            = 0x0400, // system session only, followed by a uint16_t window (ms) in which its key messages are merged into one "BATCH" message (see KeyMessageBatch), 0 (default) sends them one by one
     };
 
+    // set in the request value of an Update when a uint32_t request ID follows it, the ID is the one the key message was exported with
+    // (as "<type>:<id>", only when correlation is enabled in the config)
+    constexpr requestsSize RequestIdPresent = 0x80000000;
+
 } // namespace CDMi
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <deque>
+#include <unordered_map>
+
+namespace CDMi {
+
+    // EMM sections handed to the PRM recently, by hash. A carousel repeats the same sections over and over, a section seen within
+    // the window does not have to be decrypted again. At most capacity sections are remembered, the oldest one goes first.
+    // Not thread safe, the owner locks.
+    class EmmHistory {
+    public:
+        using Hash = uint64_t;
+
+        EmmHistory(const EmmHistory&) = delete;
+        EmmHistory& operator=(const EmmHistory&) = delete;
+
+        // window: us
+        EmmHistory(const uint32_t capacity, const uint64_t window)
+            : _capacity(capacity)
+            , _window(window)
+            , _order()
+            , _seen() {
+            ASSERT( capacity != 0 );
+        }
+        ~EmmHistory() = default;
+
+        // FNV-1a, the length is included so a section that is a prefix of another one does not match it
+        static Hash Calculate(const uint8_t section[], const uint32_t length) {
+            Hash hash = 14695981039346656037ULL;
+            for( uint32_t index = 0; index < length; ++index ) {
+                hash = ( hash ^ section[index] ) * 1099511628211ULL;
+            }
+            return ( ( hash ^ length ) * 1099511628211ULL );
+        }
+
+        bool Contains(const Hash hash, const uint64_t now) {
+            Expire(now);
+            return ( _seen.find(hash) != _seen.end() );
+        }
+
+        // the window of a section already in there is not extended, so the PRM gets it again once the window has passed
+        void Add(const Hash hash, const uint64_t now) {
+            Expire(now);
+            if( _seen.emplace(hash, now).second == true ) {
+                _order.push_back(hash);
+                if( _order.size() > _capacity ) {
+                    _seen.erase(_order.front());
+                    _order.pop_front();
+                }
+            }
+        }
+
+        void Clear() {
+            _order.clear();
+            _seen.clear();
+        }
+
+        uint32_t Size() const {
+            return static_cast<uint32_t>(_order.size());
+        }
+
+    private:
+        void Expire(const uint64_t now) {
+            while( _order.empty() == false ) {
+                auto oldest = _seen.find(_order.front());
+                ASSERT( oldest != _seen.end() );
+                if( ( oldest != _seen.end() ) && ( ( oldest->second + _window ) > now ) ) {
+                    break;
+                }
+                if( oldest != _seen.end() ) {
+                    _seen.erase(oldest);
+                }
+                _order.pop_front();
+            }
+        }
+
+    private:
+        const uint32_t _capacity;
+        const uint64_t _window;
+        std::deque<Hash> _order; // oldest first
+        std::unordered_map<Hash, uint64_t> _seen; // hash, time added (us)
+    };
+
+} // namespace CDMi
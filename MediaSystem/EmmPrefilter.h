@@ -0,0 +1,110 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <vector>
+
+namespace CDMi {
+
+    // The section filters the PRM hands out for the demux (nvImsmGetFilters), compiled into value/mask words. An EMM section that
+    // matches none of them is not meant for this device, so it does not have to be queued for the PRM at all.
+    // The PRM headers do not document TNvFilter, this assumes the layout of a Linux DVB section filter: the first half holds the
+    // filter bytes and the second half the mask bytes, both starting at the table_id and continuing at section byte 3 (the
+    // section length is skipped). Only the first Depth of those bytes are used, enough for the table_id and an EMM address.
+    // Not thread safe, the owner locks.
+    class EmmPrefilter {
+    public:
+        static constexpr uint8_t Depth = sizeof(uint64_t);
+
+        EmmPrefilter(const EmmPrefilter&) = delete;
+        EmmPrefilter& operator=(const EmmPrefilter&) = delete;
+
+        EmmPrefilter()
+            : _values()
+            , _masks() {
+        }
+        ~EmmPrefilter() = default;
+
+        // filters: count filters of filtersize bytes each, as returned by the PRM
+        void Compile(const uint8_t filters[], const uint32_t count, const uint32_t filtersize) {
+            const uint32_t half = filtersize / 2;
+            const uint32_t depth = std::min(half, static_cast<uint32_t>(Depth));
+
+            _values.clear();
+            _masks.clear();
+
+            for( uint32_t index = 0; ( half != 0 ) && ( index < count ); ++index ) {
+                const uint8_t* filter = &filters[index * filtersize];
+                uint8_t value[Depth] = {};
+                uint8_t mask[Depth] = {};
+
+                for( uint32_t position = 0; position < depth; ++position ) {
+                    mask[position] = filter[half + position];
+                    value[position] = filter[position] & mask[position];
+                }
+
+                // both loaded the same way as the section, so the byte order of the platform does not matter
+                uint64_t word;
+                memcpy(&word, value, Depth);
+                _values.push_back(word);
+                memcpy(&word, mask, Depth);
+                _masks.push_back(word);
+            }
+        }
+
+        uint32_t Patterns() const {
+            return static_cast<uint32_t>(_values.size());
+        }
+
+        // without filters everything passes, the PRM decides
+        bool Matches(const uint8_t section[], const uint32_t length) const {
+            bool result = _values.empty();
+
+            if( result == false ) {
+                uint8_t bytes[Depth] = {}; // a short section is padded with zeroes
+                if( length > 0 ) {
+                    bytes[0] = section[0];
+                }
+                if( length > 3 ) {
+                    memcpy(&bytes[1], &section[3], std::min(length - 3, static_cast<uint32_t>(Depth - 1)));
+                }
+                uint64_t word;
+                memcpy(&word, bytes, Depth);
+
+                // no early out, a handful of filters is checked faster as one (vectorisable) pass than with a branch per filter
+                const uint64_t* values = _values.data();
+                const uint64_t* masks = _masks.data();
+                const size_t count = _values.size();
+                uint32_t hits = 0;
+                for( size_t index = 0; index < count; ++index ) {
+                    hits |= static_cast<uint32_t>( ( word & masks[index] ) == values[index] );
+                }
+
+                result = ( hits != 0 );
+            }
+
+            return result;
+        }
+
+    private:
+        std::vector<uint64_t> _values; // already masked
+        std::vector<uint64_t> _masks;
+    };
+
+} // namespace CDMi
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace CDMi {
+
+    // Key messages for one callback merged into a single OnKeyMessage of type "BATCH", so a client gets one IPC for what was
+    // queued back to back. The envelope is a uint8_t count followed by the parts in the order they were added, a part is
+    // a uint8_t type length, the type (no terminator), a big endian uint32_t payload length and the payload.
+    // Not thread safe, the owner locks.
+    class KeyMessageBatch {
+    public:
+        static constexpr const char* Type = "BATCH";
+        static constexpr uint8_t MaxParts = 32;
+
+        KeyMessageBatch(const KeyMessageBatch&) = delete;
+        KeyMessageBatch& operator=(const KeyMessageBatch&) = delete;
+
+        KeyMessageBatch()
+            : _envelope()
+            , _started(0) {
+        }
+        ~KeyMessageBatch() = default;
+
+        // now: us, remembered for the first part only, false when full (send it first)
+        bool Add(const char type[], const uint8_t data[], const uint32_t length, const uint64_t now) {
+            const size_t typelength = strlen(type);
+            const bool added = ( ( Parts() < MaxParts ) && ( typelength <= 0xFF ) );
+
+            if( added == true ) {
+                if( _envelope.empty() == true ) {
+                    _envelope.push_back(0);
+                    _started = now;
+                }
+                _envelope.push_back(static_cast<uint8_t>(typelength));
+                _envelope.insert(_envelope.end(), type, type + typelength);
+                _envelope.push_back(static_cast<uint8_t>(length >> 24));
+                _envelope.push_back(static_cast<uint8_t>(length >> 16));
+                _envelope.push_back(static_cast<uint8_t>(length >> 8));
+                _envelope.push_back(static_cast<uint8_t>(length));
+                _envelope.insert(_envelope.end(), data, data + length);
+                ++_envelope[0];
+            }
+
+            return added;
+        }
+
+        void Clear() {
+            _envelope.clear();
+            _started = 0;
+        }
+
+        uint8_t Parts() const {
+            return ( _envelope.empty() == true ? 0 : _envelope[0] );
+        }
+        // when the first part was added (us), 0 when empty
+        uint64_t Started() const {
+            return _started;
+        }
+
+        const uint8_t* Data() const {
+            return _envelope.data();
+        }
+        uint32_t Length() const {
+            return static_cast<uint32_t>(_envelope.size());
+        }
+
+        // the single part as it was added, only when there is one
+        bool Single(std::string& type, const uint8_t*& data, uint32_t& length) const {
+            const bool result = ( Parts() == 1 );
+            if( result == true ) {
+                const uint8_t typelength = _envelope[1];
+                type.assign(reinterpret_cast<const char*>(&_envelope[2]), typelength);
+                const uint8_t* size = &_envelope[2 + typelength];
+                length = ( ( static_cast<uint32_t>(size[0]) << 24 ) | ( size[1] << 16 ) | ( size[2] << 8 ) | size[3] );
+                data = size + 4;
+            }
+            return result;
+        }
+
+    private:
+        std::vector<uint8_t> _envelope;
+        uint64_t _started;
+    };
+
+} // namespace CDMi
@@ -16,12 +16,15 @@
 
 #include "MediaSessionSystem.h"
 #include "OperatorVault.h"
+#include "Statistics.h"
+#include "TimerWheel.h"
+#include "Section.h"
 
 #include <core/core.h>
 #include "../ParsePSSHHeader.h"
 
 #include <memory>
-#include <queue>
+#include <deque>
 #include <functional>
 #include <utility>
 #include <algorithm>
@@ -31,13 +34,75 @@
 
 namespace {
 
-    Thunder::Core::CriticalSection g_lock;
-/*
-    Noit needed for now as we do not send a OnKeyReady message
+    // g_lock is taken on every path (OCDM IPC threads, Nagra callbacks and the CommandHandler), when profiling we keep track of how long it takes to get it
+    class SystemLock {
+    public:
+        SystemLock(const SystemLock&) = delete;
+        SystemLock& operator=(const SystemLock&) = delete;
+
+        SystemLock()
+            : _lock()
+            , _wait() {
+        }
+        ~SystemLock() = default;
+
+        void Lock() {
+            if( CDMi::Profiler::IsEnabled() == true ) {
+                const uint64_t start = CDMi::Profiler::Now();
+                _lock.Lock();
+                _wait.Record(CDMi::Profiler::Now() - start);
+            }
+            else {
+                _lock.Lock();
+            }
+        }
+
+        void Unlock() {
+            _lock.Unlock();
+        }
+
+        const CDMi::Profiler::Histogram& Wait() const {
+            return _wait;
+        }
+
+    private:
+        Thunder::Core::CriticalSection _lock;
+        CDMi::Profiler::Histogram _wait;
+    };
+
+    SystemLock g_lock;
 
+    // key status strings as understood by OCDM
+    constexpr const char* const KeyStatusPending = "KeyStatusPending";
+    constexpr const char* const KeyStatusUsable = "KeyUsable";
+    constexpr const char* const KeyStatusInternalError = "KeyInternalError";
+
+    // the Nagra delivery completed callback only gives us the delivery session, this is how we find the system it belongs to
     using DeliverySessionLookupMap = std::map<TNvSession, CDMi::MediaSessionSystem*>;
     DeliverySessionLookupMap g_DeliverySessionMap;
-*/
+
+    // if the result of a license exchange does not come in within this time (us) a new needkey will request the key again
+    constexpr uint64_t KeyRequestTimeout = 10 * 1000 * 1000;
+
+    const char* const KeyStateNames[] = { "absent", "requested", "present", "expiring" };
+
+    // delivery sessions used for needkey license exchanges (the renewal session not included), completed ones are reused.
+    // Only with correlation on, without request IDs a response cannot be matched to the exchange it answers.
+    constexpr uint8_t MaxDeliverySessions = 4;
+    constexpr uint8_t MaxIdleDeliverySessions = 2;
+
+    std::atomic<bool> g_correlation(false);
+    std::atomic<bool> g_emmprefilter(false);
+
+    std::string MessageLabel(const char type[], const uint32_t requestid) {
+        std::string label(type);
+        if( ( requestid != 0 ) && ( g_correlation.load(std::memory_order_relaxed) == true ) ) {
+            label += ':';
+            label += std::to_string(requestid);
+        }
+        return label;
+    }
+
     //note: first element is reserved for default system, CDMi::MediaSessionSystem* is nullptr if not created (so element is always there)
     using MediaSessionSystemStorageElement = std::pair<std::string, CDMi::MediaSessionSystem* >;
     using MediaSessionSystemStorage = std::forward_list< MediaSessionSystemStorageElement >;
@@ -56,6 +121,70 @@ namespace {
         }
     };
 
+    // jobs of a higher class (lower value) are executed first, a class that was passed over StarvationLimit times in a row gets the next turn
+    enum class JobPriority : uint8_t {
+        NEEDKEY = 0, // key messages and key status for connect sessions, someone is waiting for these to start playback
+        PROVISION,
+        BACKGROUND, // renewals and filters
+        EMM, // batches from the EMM queue
+    };
+    constexpr uint8_t JobPriorities = 4;
+    constexpr uint32_t StarvationLimit = 8;
+    const char* const JobPriorityNames[] = { "needkey", "provision", "background", "emm" };
+
+    // a job of a kind other than UNIQUE replaces a pending job of the same kind for the same system and owner, only the newest one matters
+    enum class JobKind : uint8_t {
+        UNIQUE = 0,
+        FILTERS,
+        RENEWAL,
+        EMM,
+    };
+
+    // when a client callback stalls the queue stops growing here, the oldest job of the lowest class (not higher than the new one) is dropped
+    constexpr uint32_t MaxQueueDepth = 128;
+
+    constexpr uint32_t TimerResolution = 10; // ms
+
+    // proxies that already have the previous filter snapshot get the difference as a FILTERSDELTA message:
+    // generation (uint32), number of added filters (uint8), the added TNvFilters, number of removed filters (uint8), the removed TNvFilters
+    constexpr const char* const FiltersDeltaType = "FILTERSDELTA";
+
+    // appends the filters of filters that are not in other to difference, returns how many
+    uint8_t FilterDifference(const std::vector<uint8_t>& filters, const std::vector<uint8_t>& other, std::vector<uint8_t>& difference) {
+        uint8_t count = 0;
+        for( size_t offset = 0; ( offset + sizeof(TNvFilter) ) <= filters.size(); offset += sizeof(TNvFilter) ) {
+            bool found = false;
+            for( size_t position = 0; ( found == false ) && ( ( position + sizeof(TNvFilter) ) <= other.size() ); position += sizeof(TNvFilter) ) {
+                found = ( memcmp(&(filters[offset]), &(other[position]), sizeof(TNvFilter)) == 0 );
+            }
+            if( found == false ) {
+                difference.insert(difference.end(), filters.begin() + offset, filters.begin() + offset + sizeof(TNvFilter));
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    // repeated EMMs within this time (us) are not decrypted again, the carousel repeats them every few seconds
+    constexpr uint32_t EmmHistorySize = 512;
+    constexpr uint64_t EmmHistoryWindow = 30 * 1000 * 1000;
+
+    // EMMs are decrypted on the CommandHandler, EmmBatchSize per job so other jobs get their turn in between.
+    // While a zap is going on (a descrambling session opened or a key exchange started less than ZapSettleTime (us) ago) the queue is
+    // held back and looked at again every EmmThrottleDelay (ms), but never longer than MaxEmmThrottle (us) in a row. After such a
+    // long hold the backlog is worked off completely before the queue is held back again.
+    constexpr uint32_t MaxQueuedEMMs = 256;
+    constexpr uint8_t EmmBatchSize = 16;
+    constexpr uint64_t ZapSettleTime = 500 * 1000;
+    constexpr uint32_t EmmThrottleDelay = 100;
+    constexpr uint64_t MaxEmmThrottle = 3 * 1000 * 1000;
+
+    // a renewal is done within this time (ms) after the PRM asks for it, so systems do not all renew at the same moment
+    constexpr uint32_t RenewalSpread = 2000;
+    // when it is due while there are at least RenewalBusyDepth jobs waiting it is pushed back another RenewalSpread, at most MaxRenewalDeferrals times
+    constexpr uint32_t RenewalBusyDepth = 8;
+    constexpr uint8_t MaxRenewalDeferrals = 5;
+
     // we of course don't want to create a thread per system so we only have one...
 
     class CommandHandler : virtual public Thunder::Core::Thread {
@@ -97,28 +226,174 @@ namespace {
 
         using Command = std::function<void(const CDMi::MediaSessionSystem::DataBuffer&)>;
         
-        void PostCommand(Command&& command, Data&& data);
+        using TimerHandle = CDMi::TimerHandle;
+
+        // the handler holds a reference on the system (taken by the poster) until the job has run or is dropped, owner is used to purge jobs
+        struct Job {
+            Job(const CDMi::MediaSessionSystem* system, const void* owner, const JobKind kind = JobKind::UNIQUE)
+                : _system(system)
+                , _owner(owner)
+                , _kind(kind) {
+            }
+
+            bool Supersedes(const Job& other) const {
+                return ( ( _kind != JobKind::UNIQUE ) && ( _kind == other._kind ) && ( _system == other._system ) && ( _owner == other._owner ) );
+            }
+
+            const CDMi::MediaSessionSystem* _system;
+            const void* _owner;
+            JobKind _kind;
+        };
+
+        void PostCommand(const JobPriority priority, const Job& job, Command&& command, Data&& data);
+        // the job is queued in its class after delay ms, unless cancelled before that
+        TimerHandle PostCommand(const JobPriority priority, const uint32_t delay, const Job& job, Command&& command, Data&& data);
+        bool CancelCommand(const TimerHandle handle);
+        // jobs waiting to be executed (scheduled ones not included)
+        uint32_t Load();
+        // drops all queued and scheduled jobs of owner, e.g. when a proxy or connect session goes away
+        void Purge(const void* owner);
+
+        void GetStatistics(CDMi::Statistics::CommandQueue& statistics);
         
     protected:
         uint32_t Worker() override;
 
         bool CommandVailable() const {
-            return ( _commands.empty() == false );
+            return ( Depth() != 0 );
         }
 
     private:
-        using CommandPair = std::pair<Command, Data>;
-        using CommandsContainer = std::queue< CommandPair >;
-        CommandsContainer _commands;
+        struct CommandEntry {
+            CommandEntry(const Job& job, Command&& command, Data&& data, const uint64_t posted)
+                : _job(job)
+                , _command(std::move(command))
+                , _data(std::move(data))
+                , _posted(posted) {
+            }
+
+            Job _job;
+            Command _command;
+            Data _data;
+            uint64_t _posted; // 0 when not profiling
+        };
+
+        using CommandsContainer = std::deque< CommandEntry >;
+
+        struct TimedCommand {
+            TimedCommand(const JobPriority priority, const Job& job, Command&& command, Data&& data)
+                : _priority(priority)
+                , _job(job)
+                , _command(std::move(command))
+                , _data(std::move(data)) {
+            }
+
+            JobPriority _priority;
+            Job _job;
+            Command _command;
+            Data _data;
+        };
+
+        struct JobClass {
+            JobClass()
+                : _commands()
+                , _posted(0)
+                , _executed(0)
+                , _skipped(0)
+                , _promoted(0)
+                , _waiting() {
+            }
+
+            CommandsContainer _commands;
+            uint32_t _posted;
+            uint32_t _executed;
+            uint32_t _skipped; // times in a row a job of another class was picked while this one had jobs waiting
+            uint32_t _promoted; // times this class was picked because of the starvation limit
+            CDMi::Profiler::Histogram _waiting;
+        };
+
+        uint32_t Depth() const {
+            uint32_t depth = 0;
+            for( const JobClass& jobclass : _classes ) {
+                depth += static_cast<uint32_t>(jobclass._commands.size());
+            }
+            return depth;
+        }
+
+        using Systems = std::vector<const CDMi::MediaSessionSystem*>;
+
+        uint8_t NextClass();
+        // the references of superseded and dropped jobs are added to released, to be released outside the lock
+        void Enqueue(const JobPriority priority, const Job& job, Command&& command, Data&& data, Systems& released);
+        static void Release(const Systems& systems);
+
+        static uint64_t Milliseconds() {
+            return CDMi::Profiler::Now() / 1000;
+        }
+
+        JobClass _classes[JobPriorities];
+        CDMi::TimerWheel<TimedCommand> _timers;
+        Thunder::Core::Event _wakeup; // waiting for the next timer, the thread is not blocked then
         Thunder::Core::CriticalSection _lock;
+        uint32_t _maxDepth;
+        uint32_t _posted;
+        uint32_t _executed;
+        uint32_t _purged;
+        uint32_t _replaced;
+        uint32_t _dropped;
+        CDMi::Profiler::Histogram _waiting;
+        CDMi::Profiler::Histogram _execution;
     };
 
-    void PostCommandJob(CommandHandler::Command&& command, CDMi::MediaSessionSystem::DataBuffer&& data) { // this makes sure we do not start the thread before it is actually needed, not just when the drm is loaded
+    CommandHandler& Commands() { // this makes sure we do not start the thread before it is actually needed, not just when the drm is loaded
         static CommandHandler commandhandler;
+        return commandhandler;
+    }
 
+    // the system is kept alive until the job has run or is purged, owner is what the job is for (the system itself, a proxy callback or a connect session)
+    void PostCommandJob(const JobPriority priority, const CDMi::MediaSessionSystem& system, const void* owner, CommandHandler::Command&& command, CDMi::MediaSessionSystem::DataBuffer&& data, const JobKind kind = JobKind::UNIQUE) {
         TRACE_L1("Posting a command job, native buffer %p", data.data());
 
-        commandhandler.PostCommand(std::move(command), CommandHandler::Data(std::move(data)));
+        system.Addref();
+        Commands().PostCommand(priority, CommandHandler::Job(&system, owner, kind), std::move(command), CommandHandler::Data(std::move(data)));
+    }
+
+    CommandHandler::TimerHandle PostDelayedCommandJob(const JobPriority priority, const uint32_t delay, const CDMi::MediaSessionSystem& system, const void* owner, CommandHandler::Command&& command, CDMi::MediaSessionSystem::DataBuffer&& data, const JobKind kind = JobKind::UNIQUE) {
+        TRACE_L1("Posting a delayed command job (%u ms), native buffer %p", delay, data.data());
+
+        system.Addref();
+        return Commands().PostCommand(priority, delay, CommandHandler::Job(&system, owner, kind), std::move(command), CommandHandler::Data(std::move(data)));
+    }
+
+    // false when it is no longer scheduled (it is queued, has run or was cancelled before)
+    bool CancelCommandJob(const CommandHandler::TimerHandle handle) {
+        return ( ( handle != 0 ) && ( Commands().CancelCommand(handle) == true ) );
+    }
+
+    // drops all queued and scheduled jobs for owner
+    void PurgeCommandJobs(const void* owner) {
+        if( owner != nullptr ) {
+            Commands().Purge(owner);
+        }
+    }
+
+    void FillLatency(CDMi::Statistics::Latency& latency, const uint32_t count, const uint64_t total, const uint32_t max, const uint32_t buckets[]) {
+        if( count != 0 ) {
+            latency.Count = count;
+            latency.Total = total;
+            latency.Max = max;
+            for( uint8_t index = 0; index < CDMi::Profiler::Buckets; ++index ) {
+                latency.Histogram.Add() = buckets[index];
+            }
+        }
+    }
+
+    void FillLatency(CDMi::Statistics::Latency& latency, const CDMi::Profiler::Histogram& histogram) {
+        uint32_t buckets[CDMi::Profiler::Buckets];
+        for( uint8_t index = 0; index < CDMi::Profiler::Buckets; ++index ) {
+            buckets[index] = histogram.Bucket(index);
+        }
+        FillLatency(latency, histogram.Count(), histogram.Total(), histogram.Max(), buckets);
     }
 }
 
@@ -166,12 +441,131 @@ CDMi::IMediaSessionSystem* GetMediaSessionSystemInterface(const char* systemsess
     return result;
 }
 
+int32_t IngestMediaSessionSystemSection(const char* systemsessionid, const TNvSession descramblingsession, const uint8_t section[], const uint32_t length) {
+    int32_t result = CDMi::SECTION_NOT_ROUTED;
+
+    CDMi::IMediaSessionSystem* system = GetMediaSessionSystemInterface(systemsessionid);
+
+    if( system != nullptr ) {
+        result = static_cast<CDMi::MediaSessionSystem*>(system)->IngestSection(descramblingsession, section, length);
+        system->Release();
+    }
+
+    return result;
+}
+
+uint32_t GetMediaSessionSystemStatistics(char buffer[], const uint32_t length) {
+
+    CDMi::Statistics::Data statistics;
+    uint32_t systems = 0;
+    uint32_t proxies = 0;
+    uint32_t connectsessions = 0;
+
+    g_lock.Lock();
+
+    for( const MediaSessionSystemStorageElement& element : g_MediaSessionSystems ) {
+        const CDMi::MediaSessionSystem* system = element.second;
+        if( system != nullptr ) { // system == nullptr is valid for default system
+            CDMi::Statistics::System& entry(statistics.SystemDetails.Add());
+            system->GetStatistics(entry);
+            ++systems;
+            proxies += entry.Proxies.Value();
+            connectsessions += system->ConnectSessionCount();
+        }
+    }
+
+    g_lock.Unlock();
+
+    statistics.Systems = systems;
+    statistics.Proxies = proxies;
+    statistics.ConnectSessions = connectsessions;
+
+    // more than one call site can report the same call, merge them per call name
+    struct CallTotals {
+        uint32_t Errors;
+        uint32_t Slow;
+        uint32_t Count;
+        uint64_t Total;
+        uint32_t Max;
+        uint32_t Histogram[CDMi::Profiler::Buckets];
+    };
+    std::map<std::string, CallTotals> calls;
+
+    for( const CDMi::Log::CallSite* site = CDMi::Log::CallSite::First(); site != nullptr; site = site->Next() ) {
+        CallTotals& totals(calls.insert(std::make_pair(std::string(site->Name()), CallTotals())).first->second);
+        totals.Errors += site->Failures();
+    }
+    for( const CDMi::Profiler::CallLatency* site = CDMi::Profiler::CallLatency::First(); site != nullptr; site = site->Next() ) {
+        CallTotals& totals(calls.insert(std::make_pair(std::string(site->Name()), CallTotals())).first->second);
+        totals.Count += site->Count();
+        totals.Total += site->Total();
+        totals.Max = std::max(totals.Max, site->Max());
+        totals.Slow += site->Slow();
+        for( uint8_t index = 0; index < CDMi::Profiler::Buckets; ++index ) {
+            totals.Histogram[index] += site->Bucket(index);
+        }
+    }
+
+    for( const std::pair<const std::string, CallTotals>& call : calls ) {
+        CDMi::Statistics::Call& entry(statistics.Calls.Add());
+        entry.Name = call.first;
+        entry.Errors = call.second.Errors;
+        entry.Slow = call.second.Slow;
+        FillLatency(entry.Duration, call.second.Count, call.second.Total, call.second.Max, call.second.Histogram);
+    }
+
+    FillLatency(statistics.LockWait, g_lock.Wait());
+    Commands().GetStatistics(statistics.Commands);
+
+    string text;
+    statistics.ToString(text);
+
+    if( length > 0 ) {
+        const uint32_t size = std::min(static_cast<uint32_t>(text.length()), length - 1);
+        memcpy(buffer, text.c_str(), size);
+        buffer[size] = '\0';
+    }
+
+    return static_cast<uint32_t>(text.length());
+}
+
 #ifdef __cplusplus
 }
 #endif
 
 namespace CDMi {
 
+void MediaSessionSystem::MediaSessionSystemProxy::Update(const uint8_t *f_pbKeyMessageResponse, uint32_t f_cbKeyMessageResponse) {
+    Thunder::Core::FrameType<0> frame(const_cast<uint8_t *>(f_pbKeyMessageResponse), f_cbKeyMessageResponse, f_cbKeyMessageResponse);
+    Thunder::Core::FrameType<0>::Reader reader(frame, 0);
+
+    // the subscription and batching are per client, the rest is for the system
+    const Request request = ( f_cbKeyMessageResponse >= sizeof(requestsSize) ? static_cast<Request>(reader.Number<requestsSize>()) : Request::NONE );
+
+    if( ( request == Request::SUBSCRIBE ) && ( f_cbKeyMessageResponse >= ( 2 * sizeof(requestsSize) ) ) ) {
+        g_lock.Lock();
+        _subscriptions = reader.Number<requestsSize>();
+        if( IsSubscribed(Request::PROVISION) == false ) {
+            _system.ResponderGone(this); // in case it was asked to answer the provisioning
+        }
+        g_lock.Unlock();
+        TRACE_L1("system proxy %s subscribed to %x", _sessionid.c_str(), _subscriptions);
+    }
+    else if( ( request == Request::BATCH ) && ( f_cbKeyMessageResponse >= ( sizeof(requestsSize) + sizeof(uint16_t) ) ) ) {
+        g_lock.Lock();
+        _batchWindow = reader.Number<uint16_t>();
+        if( ( _batchWindow == 0 ) && ( _batch.Parts() != 0 ) && ( _callback != nullptr ) ) {
+            // not on this IPC thread, the client callback runs on the CommandHandler like for every other key message
+            _system.PostFlushJob(_callback, 0); // the pending delayed flush job finds nothing then
+        }
+        g_lock.Unlock();
+        TRACE_L1("system proxy %s batches key messages within %u ms", _sessionid.c_str(), _batchWindow);
+    }
+    else {
+        _system.Update(f_pbKeyMessageResponse, f_cbKeyMessageResponse);
+    }
+}
+
 void MediaSessionSystem::MediaSessionSystemProxy::Run(const IMediaKeySessionCallback* f_piMediaKeySessionCallback) {
     ASSERT ((f_piMediaKeySessionCallback == nullptr) ^ (_callback == nullptr));
     g_lock.Lock(); // note changing the callback needs to be protected (certainly for setting it to nullptr as it can be called from a different thread
@@ -180,7 +574,12 @@ void MediaSessionSystem::MediaSessionSystemProxy::Run(const IMediaKeySessionCall
         _system.Run(*_callback);
     }
     else {
+        PurgeCommandJobs(_callback);
         _callback = nullptr;
+        _filterGeneration = 0; // a new callback starts from the full set again
+        _batch.Clear(); // its flush job was purged above
+        _system.ResponderGone(this);
+        _system.CancelRenewalJob();
     }
     g_lock.Unlock();
 } 
@@ -198,6 +597,14 @@ void MediaSessionSystem::MediaSessionSystemProxy::Run(const IMediaKeySessionCall
     delete systemsession;
 }
 
+/* static */ void MediaSessionSystem::EnableCorrelation(const bool enabled) {
+    g_correlation.store(enabled, std::memory_order_relaxed);
+}
+
+/* static */ void MediaSessionSystem::EnableEmmPrefilter(const bool enabled) {
+    g_emmprefilter.store(enabled, std::memory_order_relaxed);
+}
+
 /* static */ MediaSessionSystem& MediaSessionSystem::AddMediaSessionInstance(const uint8_t *f_pbInitData, const uint32_t f_cbInitData, const std::string& defaultoperatorvault, const std::string& licensepath) {
     static CreateDefaultMediaSystemSession createdefaultmediasession(defaultoperatorvault);
 
@@ -291,8 +698,10 @@ void MediaSessionSystem::MediaSessionSystemProxy::Run(const IMediaKeySessionCall
 void MediaSessionSystem::OnRenewal() {
     REPORT("NagraSystem::OnRenewal triggered");
 
+    _counters.RenewalEvents.fetch_add(1, std::memory_order_relaxed);
+
     if ( AnyCallBackSet() == true ) {
-        PostRenewalJob();
+        ScheduleRenewalJob();
     }
     else {
        RequestReceived(Request::RENEWAL);
@@ -317,25 +726,30 @@ void MediaSessionSystem::OnRenewal() {
 
 void MediaSessionSystem::OnNeedKey(const TNvSession descramblingSession, const TNvKeyStatus keyStatus, const TNvBuffer* content, const TNvStreamType streamtype) {
 
-    REPORT_EXT("NagraSystem::OnNeedkey triggered for descrambling session %u", descramblingSession);
+    REPORT_EXT("NagraSystem::OnNeedkey triggered for descrambling session %u, key status %i", descramblingSession, static_cast<int>(keyStatus));
+
+    _counters.NeedKeyEvents.fetch_add(1, std::memory_order_relaxed);
 
 //    if(content != nullptr) {
 //        DumpData("NagraSystem::OnNeedKey", (const uint8_t*)(content->data), content->size);
 //    }
 
-    if ( AnyCallBackSet() == true || descramblingSession != 0 ) {
+    if ( ( AnyCallBackSet() == true || descramblingSession != 0 ) && ( KeyRequestNeeded(descramblingSession, keyStatus) == true ) ) {
 
-        // TNvSession deliverysession = OpenKeyNeedSession();
-      
-        TNvSession deliverysession = _renewalSession;
+        bool exported = false;
 
-        uint32_t result = nvLdsUsePrmContentMetadata(deliverysession, content, streamtype);
+        // an exchange still in flight for this session (the reason changed or it timed out) is superseded by this one
+        ReleaseDeliveryRequests(descramblingSession);
+
+        TNvSession deliverysession = AcquireDeliverySession();
+
+        uint32_t result = PRM_CALL("nvLdsUsePrmContentMetadata", nvLdsUsePrmContentMetadata(deliverysession, content, streamtype));
         REPORT_LDS(result,"nvLdsUsePrmContentMetadata");
         REPORT("NagraSystem::OnNeedkey ContextMetadata set");
 
         TNvBuffer buf = { NULL, 0 };
 
-        result = nvLdsExportMessage(deliverysession, &buf);
+        result = PRM_CALL("nvLdsExportMessage", nvLdsExportMessage(deliverysession, &buf));
         REPORT_LDS(result, "nvLdsExportMessage");
 
         if( result == NV_LDS_SUCCESS ) {
@@ -343,101 +757,165 @@ void MediaSessionSystem::OnNeedKey(const TNvSession descramblingSession, const T
             DataBuffer buffer(buf.size);
             buf.data = static_cast<void*>(buffer.data());
             buf.size = buffer.size(); // just too make sure...
-            result = nvLdsExportMessage(deliverysession, &buf);
+            result = PRM_CALL("nvLdsExportMessage", nvLdsExportMessage(deliverysession, &buf));
             REPORT_LDS(result, "nvLdsExportMessage");
 
             if( result == NV_LDS_SUCCESS ) {
                 // DumpData("NagraSystem::OnNeedKey export message", buffer.data(), buffer.size());
 
+                exported = true;
+
+                // the result of the license exchange will come in via OnDeliveryCompleted for this delivery session
+                _deliveryrequests[deliverysession].insert(descramblingSession);
+                if( std::find(_pendingresponses.begin(), _pendingresponses.end(), deliverysession) == _pendingresponses.end() ) {
+                    _pendingresponses.push_back(deliverysession);
+                }
+
+                const std::string label(MessageLabel("KEYNEEDED", AssignRequestId(deliverysession)));
+
                 if( descramblingSession == 0 ) {
                     REPORT("NagraSystem::OnNeedkey triggered for system session");
 
-                    Addref(); // make sure we keep this alive for the lambda
-                    PostCommandJob([=](const DataBuffer& data){
+                    _counters.KeyMessagesPosted.fetch_add(1, std::memory_order_relaxed);
+                    PostCommandJob(JobPriority::NEEDKEY, *this, this, [=](const DataBuffer& data){
                         g_lock.Lock(); // could now better be lock per system
-                        for( auto proxy : _systemproxies ) {
-                            IMediaKeySessionCallback* callback( proxy->IMediaKeyCallback() );
-                            if( callback != nullptr ) {
-                                    callback->OnKeyMessage(reinterpret_cast<const uint8_t*>(data.data()), data.size(), const_cast<char*>("KEYNEEDED"));
-                            }
-                        }
+                        NotifyProxies(data, label.c_str(), Request::KEYNEEDED);
                         g_lock.Unlock();
-                        Release();
                     }
                     , std::move(buffer));
                 }
                 else {
                     REPORT("NagraSystem::OnNeedkey triggered for connect session");
 
-                    Addref(); // make sure we keep this alive for the lambda
-                    PostCommandJob([=](const DataBuffer& data){
+                    _counters.KeyMessagesPosted.fetch_add(1, std::memory_order_relaxed);
+                    auto target = _connectsessions.find(descramblingSession);
+                    const void* owner = ( target != _connectsessions.end() ? static_cast<const void*>(target->second.Session) : static_cast<const void*>(this) );
+
+                    PostCommandJob(JobPriority::NEEDKEY, *this, owner, [=](const DataBuffer& data){
                         g_lock.Lock(); // could now better be lock per system
                         auto it = _connectsessions.find(descramblingSession); 
                         if( it != _connectsessions.end() ) {
-                            it->second->OnKeyMessage(reinterpret_cast<const uint8_t*>(data.data()), data.size(), const_cast<char*>("KEYNEEDED"));
+                            _counters.KeyMessagesDispatched.fetch_add(1, std::memory_order_relaxed);
+                            it->second.Session->OnKeyMessage(reinterpret_cast<const uint8_t*>(data.data()), data.size(), label.c_str());
                         }
                         g_lock.Unlock();
-                        Release();
                     }
                     , std::move(buffer));
+
+                    KeyStatusChanged(descramblingSession, KeyStatusPending);
                 }
             }
         }
+
+        if( exported == false ) {
+            ChangeKeyState(descramblingSession, KeyState::ABSENT); // so the next needkey tries again
+            if( _deliveryrequests.find(deliverysession) == _deliveryrequests.end() ) {
+                RecycleDeliverySession(deliverysession);
+            }
+        }
     }
 }
 
-/* static */ bool MediaSessionSystem::OnDeliveryCompleted(TNvSession deliverySession) {
+bool MediaSessionSystem::KeyRequestNeeded(const TNvSession descramblingSession, const TNvKeyStatus keyStatus) {
+    // already in lock
+    bool needed = true;
+
+    const uint64_t now = Profiler::Now();
+    KeyTracking& tracking(_keystates[descramblingSession]);
+
+    switch( tracking.State ) {
+    case KeyState::ABSENT:
+        ChangeKeyState(descramblingSession, KeyState::REQUESTED);
+        break;
+    case KeyState::PRESENT:
+        // the PRM needs the key again while we have it, so it is about to expire
+        ChangeKeyState(descramblingSession, KeyState::EXPIRING);
+        break;
+    case KeyState::REQUESTED: // fallthrough on purpose
+    case KeyState::EXPIRING:
+        // an exchange for the same reason is still in flight, unless it has been for too long
+        needed = ( tracking.Reason != keyStatus ) || ( ( now - tracking.Requested ) >= KeyRequestTimeout );
+        break;
+    }
+
+    if( needed == true ) {
+        tracking.Reason = keyStatus;
+        tracking.Requested = now;
+    }
+    else {
+        _counters.KeyRequestsSuppressed.fetch_add(1, std::memory_order_relaxed);
+        REPORT_TRACE_EXT("NagraSystem::OnNeedkey key request suppressed, descrambling session %u is %s", descramblingSession, KeyStateNames[static_cast<uint8_t>(tracking.State)]);
+    }
+
+    return needed;
+}
 
-// we'll leave this in right now for logging, if we are not going to respond with KeyReady or KeyError we'll remove it
-// See if this is the right callback for that
+void MediaSessionSystem::ChangeKeyState(const TNvSession descramblingSession, const KeyState state) {
+    // already in lock
+    KeyTracking& tracking(_keystates[descramblingSession]);
 
-    g_lock.Lock(); // lock not really needed anymore as we are not doing something usefull with the system
+    if( tracking.State != state ) {
+        _counters.KeyTransitions[static_cast<uint8_t>(tracking.State)][static_cast<uint8_t>(state)].fetch_add(1, std::memory_order_relaxed);
+        tracking.State = state;
+    }
+}
+
+/* static */ bool MediaSessionSystem::OnDeliveryCompleted(TNvSession deliverySession) {
+
+    g_lock.Lock();
 
     REPORT("MediaSessionSystem::OnDeliveryCompleted");
 
     TNvLdsStatus status;
-    uint32_t result = nvLdsGetResults(deliverySession, &status);
+    uint32_t result = PRM_CALL("nvLdsGetResults", nvLdsGetResults(deliverySession, &status));
     REPORT_LDS(result,"nvLdsGetResults");
 
     REPORT_EXT("OnDeliveryCompleted result %i", status.status);
 
-//    DeliverySessionLookupMap::iterator index (g_DeliverySessionMap.find(deliverySession));
+    DeliverySessionLookupMap::iterator index (g_DeliverySessionMap.find(deliverySession));
 
-//    if ( index != g_DeliverySessionMap.end() ) {
-//        index->second->OnDeliverySessionCompleted(deliverySession); 
-//    }
+    if ( index != g_DeliverySessionMap.end() ) {
+        // note: a status of 0 means the keys were delivered
+        index->second->OnDeliverySessionCompleted(deliverySession, ( ( result == NV_LDS_SUCCESS ) && ( status.status == 0 ) ));
+    }
 
     g_lock.Unlock();
 
     return true;
 }
 
-/*
+void MediaSessionSystem::OnDeliverySessionCompleted(const TNvSession deliverySession, const bool succeeded) {
+    // already in lock
 
-// this should be rerouted to the connectsession and also guess also OnKeyError added I guess. Note that the code below does not use the separation by the CommandHanlder, change that before uncommenting
-void MediaSessionSystem::OnDeliverySessionCompleted(const TNvSession deliverySession) {
+    ForgetRequestIds(deliverySession); // any response still coming in for this exchange is stale now
 
-    for( auto proxy : _systemproxies ) {
-        IMediaKeySessionCallback* callback( proxy->IMediaKeyCallback() );
-        if( callback != nullptr ) {
-                callback->OnKeyReady();
+    auto it = _deliveryrequests.find(deliverySession);
+
+    if( it != _deliveryrequests.end() ) {
+        for( const TNvSession descramblingSession : it->second ) {
+            ChangeKeyState(descramblingSession, ( succeeded == true ? KeyState::PRESENT : KeyState::ABSENT ));
+            KeyStatusChanged(descramblingSession, ( succeeded == true ? KeyStatusUsable : KeyStatusInternalError ));
         }
-    }
+        _deliveryrequests.erase(it);
 
-//   CloseDeliverySession(deliverySession);
-}
+        auto pending = std::find(_pendingresponses.begin(), _pendingresponses.end(), deliverySession);
+        if( pending != _pendingresponses.end() ) {
+            _pendingresponses.erase(pending);
+        }
 
-*/
+        RecycleDeliverySession(deliverySession);
+    }
+}
 
 void MediaSessionSystem::GetFilters(FilterStorage& filters) {
     filters.clear();
     if( _applicationSession != 0 ) {
         uint8_t numberOfFilters = 0;
-        uint32_t result = nvImsmGetFilters(_applicationSession, nullptr, &numberOfFilters);
+        uint32_t result = PRM_CALL("nvImsmGetFilters", nvImsmGetFilters(_applicationSession, nullptr, &numberOfFilters));
         REPORT_IMSM(result, "nvImsmGetFilters");
         if( result == NV_IMSM_SUCCESS ) {
             filters.resize(numberOfFilters * sizeof(TNvFilter));
-            result = nvImsmGetFilters(_applicationSession, reinterpret_cast<TNvFilter*>(filters.data()), &numberOfFilters); 
+            result = PRM_CALL("nvImsmGetFilters", nvImsmGetFilters(_applicationSession, reinterpret_cast<TNvFilter*>(filters.data()), &numberOfFilters)); 
             REPORT_IMSM(result, "nvImsmGetFilters");
 
 //            DumpData("NagraSystem::GetFilters", (const uint8_t*)(filters.data()), filters.size());
@@ -450,11 +928,78 @@ void MediaSessionSystem::GetFilters(FilterStorage& filters) {
     }
 }
 
+bool MediaSessionSystem::RefreshFilters() {
+    // already in lock
+    FilterStorage filters;
+    GetFilters(filters);
+
+    const bool changed = ( ( _filterGeneration == 0 ) || ( filters != _filters ) );
+
+    if( changed == true ) {
+        _filterDelta.clear();
+
+        if( _filterGeneration != 0 ) {
+            const uint32_t generation = _filterGeneration + 1;
+            _filterDelta.push_back(static_cast<uint8_t>(generation >> 24));
+            _filterDelta.push_back(static_cast<uint8_t>(generation >> 16));
+            _filterDelta.push_back(static_cast<uint8_t>(generation >> 8));
+            _filterDelta.push_back(static_cast<uint8_t>(generation));
+
+            const size_t addedcount = _filterDelta.size();
+            _filterDelta.push_back(0);
+            _filterDelta[addedcount] = FilterDifference(filters, _filters, _filterDelta);
+            const size_t removedcount = _filterDelta.size();
+            _filterDelta.push_back(0);
+            _filterDelta[removedcount] = FilterDifference(_filters, filters, _filterDelta);
+
+            REPORT_EXT("NagraSystem filters changed, %u added %u removed", _filterDelta[addedcount], _filterDelta[removedcount]);
+        }
+
+        _filters = std::move(filters);
+        ++_filterGeneration;
+
+        _emmprefilter.Compile(_filters.data(), static_cast<uint32_t>(_filters.size() / sizeof(TNvFilter)), sizeof(TNvFilter));
+    }
+
+    return changed;
+}
+
+void MediaSessionSystem::NotifyFilters(MediaSessionSystemProxy& proxy, const DataBuffer& snapshot, const DataBuffer& delta, const uint32_t generation) {
+    // already in lock
+    IMediaKeySessionCallback* callback( proxy.IMediaKeyCallback() );
+    const uint32_t known = proxy.FilterGeneration();
+
+    // a proxy that is not subscribed keeps its generation, so it catches up once it subscribes.
+    // Jobs do not necessarily run in the order of their generation (a superseding job keeps the place of the one it replaces),
+    // a proxy that already has a newer one is not sent back to an older snapshot.
+    if( ( callback != nullptr ) && ( known < generation ) && ( proxy.IsSubscribed(Request::FILTERS) == true ) ) {
+        if( ( known != 0 ) && ( ( known + 1 ) == generation ) && ( delta.empty() == false ) ) {
+            _counters.KeyMessagesDispatched.fetch_add(1, std::memory_order_relaxed);
+            _counters.FilterDeltas.fetch_add(1, std::memory_order_relaxed);
+            SendKeyMessage(proxy, delta.data(), delta.size(), FiltersDeltaType);
+        }
+        else if( snapshot.empty() == false ) {
+            _counters.KeyMessagesDispatched.fetch_add(1, std::memory_order_relaxed);
+            SendKeyMessage(proxy, snapshot.data(), snapshot.size(), "FILTERS");
+        }
+        proxy.FilterGeneration(generation);
+    }
+}
+
 void MediaSessionSystem::GetProvisionChallenge(DataBuffer& buffer) {
     buffer.clear();
 
+    if( _provioningSession != 0 ) {
+        if( _provisionChallenge.empty() == false ) {
+            // still waiting for the answer, a new export would invalidate the challenge that might be answered already
+            buffer = _provisionChallenge;
+            return;
+        }
+        CloseProvisioningSession(); // the export failed, start over
+    }
+
     TNvBuffer buf = { NULL, 0 }; 
-    uint32_t result = nvAsmGetProvisioningParameters(_applicationSession, &buf);
+    uint32_t result = PRM_CALL("nvAsmGetProvisioningParameters", nvAsmGetProvisioningParameters(_applicationSession, &buf));
     REPORT_ASM(result, "nvAsmGetProvisioningParameters");
 
     if( result == NV_ASM_SUCCESS ) {
@@ -462,34 +1007,35 @@ void MediaSessionSystem::GetProvisionChallenge(DataBuffer& buffer) {
         buf.data = static_cast<void*>(buffer.data());
         buf.size = buffer.size(); // just too make sure...
 
-        uint32_t result = nvAsmGetProvisioningParameters(_applicationSession, &buf);
+        uint32_t result = PRM_CALL("nvAsmGetProvisioningParameters", nvAsmGetProvisioningParameters(_applicationSession, &buf));
         REPORT_ASM(result, "nvAsmGetProvisioningParameters");
 
         // DumpData("System::ProvisioningParameters", buffer.data(), buffer.size());
 
 
         if( result == NV_ASM_SUCCESS ) {
-            result = nvDpscOpen(&_provioningSession);
+            result = PRM_CALL("nvDpscOpen", nvDpscOpen(&_provioningSession));
             REPORT_DPSC(result, "nvDpscOpen");
 
             if( result == NV_DPSC_SUCCESS ) {
-              result = nvDpscSetClientData(_provioningSession, &buf);
+              result = PRM_CALL("nvDpscSetClientData", nvDpscSetClientData(_provioningSession, &buf));
               REPORT_DPSC(result, "nvDpscSetClientData");
 
               buf.data = nullptr;
               buf.size = 0;
 
-              result = nvDpscExportMessage(_provioningSession, &buf);
+              result = PRM_CALL("nvDpscExportMessage", nvDpscExportMessage(_provioningSession, &buf));
               REPORT_DPSC(result, "nvDpscExportMessage");
 
               if( result == NV_DPSC_SUCCESS ) {
                   buffer.resize(buf.size);
                   buf.data = static_cast<void*>(buffer.data());
                   ASSERT(buffer.size() == buf.size); //just to make sure
-                  result = nvDpscExportMessage(_provioningSession, &buf);
+                  result = PRM_CALL("nvDpscExportMessage", nvDpscExportMessage(_provioningSession, &buf));
                   REPORT_DPSC(result, "nvDpscExportMessage");
                   if( result == NV_DPSC_SUCCESS ) {
                       // DumpData("NagraSystem::ProvisioningExportMessage", buffer.data(), buffer.size());
+                      _provisionChallenge = buffer;
                   }
                   else {
                       buffer.clear();
@@ -500,17 +1046,95 @@ void MediaSessionSystem::GetProvisionChallenge(DataBuffer& buffer) {
     }
 }
 
-/*
+TNvSession MediaSessionSystem::AcquireDeliverySession() {
+    // already in lock
+    TNvSession session = 0;
+
+    if( g_correlation.load(std::memory_order_relaxed) == false ) {
+        session = _renewalSession;
+    }
+    else if( _idledeliverysessions.empty() == false ) {
+        session = *_idledeliverysessions.begin();
+        _idledeliverysessions.erase(_idledeliverysessions.begin());
+    }
+    else if( _deliveryrequests.size() < MaxDeliverySessions ) {
+        session = OpenDeliverySession();
+    }
 
-TNvSession MediaSessionSystem::OpenKeyNeedSession() {
-    TNvSession session = OpenDeliverySession();
-    if( session != 0 ) {
-        _needKeySessions.insert(session);
+    if( session == 0 ) {
+        // all in use, share the renewal session like we used to, the exported message might then overwrite one that is still in flight
+        REPORT_LOG(CDMi::Log::LEVEL_WARNING, "No delivery session available, %u in use", static_cast<uint32_t>(_deliveryrequests.size()));
+        _counters.DeliveryPoolExhausted.fetch_add(1, std::memory_order_relaxed);
+        session = _renewalSession;
     }
+
     return session;
 }
 
-*/
+uint32_t MediaSessionSystem::AssignRequestId(const TNvSession deliverysession) {
+    // already in lock
+
+    // a new message exported from the delivery session supersedes the previous one
+    ForgetRequestIds(deliverysession);
+
+    if( _nextRequestId == 0 ) {
+        _nextRequestId = 1;
+    }
+    const uint32_t requestid = _nextRequestId++;
+    _requestids[requestid] = deliverysession;
+    return requestid;
+}
+
+void MediaSessionSystem::ForgetRequestIds(const TNvSession deliverysession) {
+    // already in lock
+    auto it = _requestids.begin();
+    while( it != _requestids.end() ) {
+        if( it->second == deliverysession ) {
+            it = _requestids.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void MediaSessionSystem::ReleaseDeliveryRequests(const TNvSession descramblingSession) {
+    // already in lock
+    std::vector<TNvSession> abandoned;
+
+    auto it = _deliveryrequests.begin();
+    while( it != _deliveryrequests.end() ) {
+        if( ( it->second.erase(descramblingSession) != 0 ) && ( it->second.empty() == true ) ) {
+            abandoned.push_back(it->first);
+            it = _deliveryrequests.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    // nobody waits for the result anymore, a late response or completion for them must not end up in a new exchange
+    for( const TNvSession deliverysession : abandoned ) {
+        ForgetRequestIds(deliverysession);
+        _pendingresponses.erase(std::remove(_pendingresponses.begin(), _pendingresponses.end(), deliverysession), _pendingresponses.end());
+        if( deliverysession != _renewalSession ) {
+            CloseDeliverySession(deliverysession);
+        }
+    }
+}
+
+void MediaSessionSystem::RecycleDeliverySession(const TNvSession session) {
+    // already in lock
+    if( ( session != 0 ) && ( session != _renewalSession ) ) {
+        if( _idledeliverysessions.size() < MaxIdleDeliverySessions ) {
+            _idledeliverysessions.insert(session);
+        }
+        else {
+            CloseDeliverySession(session);
+        }
+    }
+}
+
 void MediaSessionSystem::OpenRenewalSession() {
     ASSERT( _renewalSession == 0 );
     _renewalSession = OpenDeliverySession();
@@ -518,43 +1142,46 @@ void MediaSessionSystem::OpenRenewalSession() {
 
 TNvSession MediaSessionSystem::OpenDeliverySession() {   
     TNvSession session(0);
-    uint32_t result = nvLdsOpen(&session, _applicationSession);
+    uint32_t result = PRM_CALL("nvLdsOpen", nvLdsOpen(&session, _applicationSession));
     REPORT_LDS(result,"nvLdsOpen");
     if( result == NV_LDS_SUCCESS ) {
-  //      g_DeliverySessionMap[session] = this;
-        nvLdsSetOnCompleteListener(session, OnDeliveryCompleted);
+        g_lock.Lock();
+        g_DeliverySessionMap[session] = this;
+        g_lock.Unlock();
+        PRM_CALL("nvLdsSetOnCompleteListener", nvLdsSetOnCompleteListener(session, OnDeliveryCompleted));
     }
     return session;
 }
 
-/*
 void MediaSessionSystem::CloseDeliverySession(const TNvSession session) {
 
+    g_lock.Lock();
+
     DeliverySessionLookupMap::iterator index (g_DeliverySessionMap.find(session));
 
     if (index != g_DeliverySessionMap.end()) {
         g_DeliverySessionMap.erase(index);
     }
 
+    _deliveryrequests.erase(session);
+    _idledeliverysessions.erase(session);
+    ForgetRequestIds(session);
+    _pendingresponses.erase(std::remove(_pendingresponses.begin(), _pendingresponses.end(), session), _pendingresponses.end());
+
+    g_lock.Unlock();
+
     if( _renewalSession == session ) {
         _renewalSession = 0;
     }
-    else {
-        auto it = _needKeySessions.find(session);
-        ASSERT( it != _needKeySessions.end() );
-        if( it != _needKeySessions.end() ) {
-            _needKeySessions.erase(it);
-        }
-    }
 
-    nvLdsClose(session);
+    PRM_CALL("nvLdsClose", nvLdsClose(session));
 }
-*/
 
 void MediaSessionSystem::CloseProvisioningSession() {
       if(_provioningSession != 0) {
-          nvDpscClose(_provioningSession);
+          PRM_CALL("nvDpscClose", nvDpscClose(_provioningSession));
           _provioningSession = 0;
+          _provisionChallenge.clear();
       }
 }
 
@@ -569,7 +1196,7 @@ void MediaSessionSystem::CreateRenewalExchange(DataBuffer& buffer) {
 
     TNvBuffer buf = { NULL, 0 };
 
-    uint32_t result = nvLdsExportMessage(_renewalSession, &buf);
+    uint32_t result = PRM_CALL("nvLdsExportMessage", nvLdsExportMessage(_renewalSession, &buf));
     REPORT_LDS(result, "nvLdsExportMessage");
 
     if( result == NV_LDS_SUCCESS ) {
@@ -577,7 +1204,7 @@ void MediaSessionSystem::CreateRenewalExchange(DataBuffer& buffer) {
         buffer.resize(buf.size);
         buf.data = static_cast<void*>(buffer.data());
         buf.size = buffer.size(); // just too make sure...
-        result = nvLdsExportMessage(_renewalSession, &buf);
+        result = PRM_CALL("nvLdsExportMessage", nvLdsExportMessage(_renewalSession, &buf));
         REPORT_LDS(result, "nvLdsExportMessage");
 
         if( result == NV_LDS_SUCCESS ) {
@@ -594,22 +1221,22 @@ void MediaSessionSystem::InitializeWhenProvisoned() {
 
     //protect as much as possible to an unexpected update(provioning) call ;)
 
-    uint32_t result = nvAsmSetContext(_applicationSession, this);
+    uint32_t result = PRM_CALL("nvAsmSetContext", nvAsmSetContext(_applicationSession, this));
     REPORT_ASM(result, "nvAsmSetContext");
 
     if( _renewalSession == 0 ) {
         OpenRenewalSession(); //do before callbacks are set, so no need to do this insside the lock
     }
-    result = nvAsmSetOnRenewalListener(_applicationSession, OnRenewal);
+    result = PRM_CALL("nvAsmSetOnRenewalListener", nvAsmSetOnRenewalListener(_applicationSession, OnRenewal));
     REPORT_ASM(result, "nvAsmSetOnRenewalListener");
-    result = nvAsmSetOnNeedKeyListener(_applicationSession, OnNeedKey);
+    result = PRM_CALL("nvAsmSetOnNeedKeyListener", nvAsmSetOnNeedKeyListener(_applicationSession, OnNeedKey));
     REPORT_ASM(result, "nvAsmSetOnNeedKeyListener");
     if( _inbandSession == 0 ) {
-        result = nvImsmOpen(&_inbandSession, _applicationSession);
+        result = PRM_CALL("nvImsmOpen", nvImsmOpen(&_inbandSession, _applicationSession));
         REPORT_IMSM(result, "nvImsmOpen");
     }
 
-    result = nvAsmUseStorage(_applicationSession, const_cast<char *>(_licensepath.c_str()));
+    result = PRM_CALL("nvAsmUseStorage", nvAsmUseStorage(_applicationSession, const_cast<char *>(_licensepath.c_str())));
     REPORT_ASM(result, "nvAsmUseStorage");
 
     REPORT("enter MediaSessionSystem::MediaSessionSystem");
@@ -617,38 +1244,39 @@ void MediaSessionSystem::InitializeWhenProvisoned() {
 
 void MediaSessionSystem::HandleFilters(IMediaKeySessionCallback* callback) {
     REPORT("MediaSessionSystem::Run checking filters");
-    FilterStorage filters;
-    GetFilters(filters);
 
-    REPORT_EXT("MediaSessionSystem::Run %i filter found", filters.size());
-    if( filters.size() > 0 ) {
+    // a new callback gets the cached snapshot, the PRM is only asked again when the filters might have changed (nullptr, e.g. after provisioning)
+    if( ( callback == nullptr ) || ( _filterGeneration == 0 ) ) {
+        RefreshFilters();
+    }
+
+    PostFiltersJob(callback);
+}
+
+void MediaSessionSystem::PostFiltersJob(IMediaKeySessionCallback* callback) {
+    // already in lock
+    REPORT_EXT("MediaSessionSystem::Run %u filter found", static_cast<uint32_t>(_filters.size() / sizeof(TNvFilter)));
+    if( ( _filters.empty() == false ) || ( ( callback == nullptr ) && ( _filterDelta.empty() == false ) ) ) {
         REPORT("MediaSessionSystem::Run firing filters ");
-        Addref(); // keep session alive for callback
-        PostCommandJob([=](const DataBuffer& data){
+        _counters.KeyMessagesPosted.fetch_add(1, std::memory_order_relaxed);
+        const DataBuffer delta(_filterDelta);
+        const uint32_t generation = _filterGeneration;
+        // a filters job for a single callback goes when that callback is unregistered
+        PostCommandJob(JobPriority::BACKGROUND, *this, ( callback != nullptr ? static_cast<const void*>(callback) : static_cast<const void*>(this) ), [=](const DataBuffer& data){
             g_lock.Lock(); // could now better be lock per system
 
             TRACE_L1("Handle filters: in filter callback job, native buffer ptr %p:", data.data());
 
-            if( callback == nullptr ) { //triggered only after Provisioing complete, so now we will sent out the first filter results to all registered callbacks
-                ASSERT( AnyCallBackSet() == true ); //at least one should be set as the Run was already triggered
-                for( auto proxy : _systemproxies ) {
-                    IMediaKeySessionCallback* proxycallback( proxy->IMediaKeyCallback() );
-                    if( proxycallback != nullptr ) {
-                        proxycallback->OnKeyMessage(data.data(), data.size(), const_cast<char*>("FILTERS"));
-                    }
-                }
-            }
-            else { // in this case we already sent the filters to the previous registering callbacks, now only update the new one
-                //as we are doing this on another thread at a later moment let's check if the callback is still registered
-                auto it = std::find_if(_systemproxies.begin(), _systemproxies.end(), [=](const MediaSessionSystemProxy* proxy){ return (proxy == nullptr ? false : proxy->IMediaKeyCallback() == callback); } );
-                if( it != _systemproxies.end()) {
-                    callback->OnKeyMessage(data.data(), data.size(), const_cast<char*>("FILTERS"));
+            // nullptr: triggered after provisioning or a filter change, all subscribed callbacks that do not have this generation yet get it,
+            // otherwise only the new callback (if it is still registered, we are on another thread at a later moment)
+            for( MediaSessionSystemProxy* proxy : _systemproxies ) {
+                if( ( proxy != nullptr ) && ( ( callback == nullptr ) || ( proxy->IMediaKeyCallback() == callback ) ) ) {
+                    NotifyFilters(*proxy, data, delta, generation);
                 }
             }
             g_lock.Unlock();
-            Release();
         }
-        , std::move(filters));
+        , DataBuffer(_filters), JobKind::FILTERS);
     }
  }
 
@@ -657,13 +1285,33 @@ MediaSessionSystem::MediaSessionSystem(const uint8_t *data, const uint32_t lengt
     , _requests(Request::NONE)
     , _applicationSession(0)
     , _inbandSession(0) 
- //   , _needKeySessions()
+    , _idledeliverysessions()
+    , _pendingresponses()
+    , _requestids()
+    , _nextRequestId(1)
     , _renewalSession(0)
     , _provioningSession(0)
+    , _provisionChallenge()
     , _connectsessions()
+    , _keyids()
+    , _deliveryrequests()
+    , _keystates()
     , _licensepath(licensepath)
     , _systemproxies()
-    , _referenceCount(1) {
+    , _filters()
+    , _filterDelta()
+    , _filterGeneration(0)
+    , _emmprefilter()
+    , _emmhistory(EmmHistorySize, EmmHistoryWindow)
+    , _emmqueue()
+    , _emmThrottled(0)
+    , _emmHeld(0)
+    , _renewalTimer(0)
+    , _lastDescramblingOpen(0)
+    , _sectionrings()
+    , _provisionResponder(nullptr)
+    , _referenceCount(1)
+    , _counters() {
 
     REPORT_EXT("operator vault location %s", operatorvault.c_str());
    REPORT_EXT("license path location %s", _licensepath.c_str());
@@ -671,7 +1319,7 @@ MediaSessionSystem::MediaSessionSystem(const uint8_t *data, const uint32_t lengt
     REPORT("enter MediaSessionSystem::MediaSessionSystem");
 
     ::ThreadId tid =  Thunder::Core::Thread::ThreadId();
-    REPORT_EXT("MediaSessionSystem threadid = %u", tid);
+    REPORT_EXT("MediaSessionSystem threadid = %lu", static_cast<unsigned long>(tid));
 
 
     REPORT_EXT("going to test data access %u", length);
@@ -682,7 +1330,7 @@ MediaSessionSystem::MediaSessionSystem(const uint8_t *data, const uint32_t lengt
     string vaultcontent = vault.LoadOperatorVault();
 
     TNvBuffer tmp = { const_cast<char*>(vaultcontent.c_str()), vaultcontent.length() + 1 };
-    uint32_t result = nvAsmOpen(&_applicationSession, &tmp);
+    uint32_t result = PRM_CALL("nvAsmOpen", nvAsmOpen(&_applicationSession, &tmp));
 
     REPORT_EXT("SystenmSession appsession created; %u", _applicationSession);
 
@@ -709,25 +1357,31 @@ MediaSessionSystem::~MediaSessionSystem() {
 
     REPORT("enter MediaSessionSystem::~MediaSessionSystem");
 
+    ASSERT( _sectionrings.empty() == true ); // they go with their connect session or the last proxy
+
     // note will correctly handle if InitializeWhenProvisoned() was never called
 
     if( _inbandSession != 0 ) {
-        nvImsmClose(_inbandSession);
+        PRM_CALL("nvImsmClose", nvImsmClose(_inbandSession));
     }
 
     CloseProvisioningSession();
 
-    nvLdsClose(_renewalSession);
-    _renewalSession = 0;
-
-
-  //  CloseDeliverySession(_renewalSession);
+    std::vector<TNvSession> deliverysessions(_idledeliverysessions.begin(), _idledeliverysessions.end());
+    for( const std::pair<const TNvSession, std::set<TNvSession>>& request : _deliveryrequests ) {
+        if( request.first != _renewalSession ) {
+            deliverysessions.push_back(request.first);
+        }
+    }
+    for( const TNvSession session : deliverysessions ) {
+        CloseDeliverySession(session);
+    }
 
- //   for(TNvSession session : _needKeySessions) {
- //       CloseDeliverySession(session);
- //   }  
+    if( _renewalSession != 0 ) {
+        CloseDeliverySession(_renewalSession);
+    }
 
-    nvAsmClose(_applicationSession);
+    PRM_CALL("nvAsmClose", nvAsmClose(_applicationSession));
 
     RemoveMediaSessionInstance(this);
     
@@ -754,7 +1408,7 @@ void MediaSessionSystem::Run(IMediaKeySessionCallback& callback) {
     if (WasRequestReceived(Request::PROVISION)) {
         REPORT("MediaSessionSystem::Run firing provisoning ");
 
-        // we just post the job without taking into regards the first requester, all registered callbacks at the time the callback is called will be notified
+        // the challenge goes to the responder elected when the job runs, which need not be this callback
         PostProvisionJob();
         RequestHandled(Request::PROVISION);
     } 
@@ -766,7 +1420,7 @@ void MediaSessionSystem::Run(IMediaKeySessionCallback& callback) {
     if (WasRequestReceived(Request::RENEWAL)) {
         REPORT("MediaSessionSystem::Run firing renewal ");
 
-        // we just post the job without taking into regards the first requester, all registered callbacks at the time the callback is called will be notified
+        // the exchange goes to the responder elected when the job runs, which need not be this callback
         PostRenewalJob();
         RequestHandled(Request::RENEWAL);
     }
@@ -775,19 +1429,21 @@ void MediaSessionSystem::Run(IMediaKeySessionCallback& callback) {
 
 void MediaSessionSystem::Update(const uint8_t *data, uint32_t  length) {
 
-    REPORT("enter MediaSessionSystem::Update");
+    REPORT_TRACE("enter MediaSessionSystem::Update");
 
     Thunder::Core::FrameType<0> frame(const_cast<uint8_t *>(data), length, length);
     Thunder::Core::FrameType<0>::Reader reader(frame, 0);
 
-    REPORT("NagraSytem update triggered");
+    REPORT_TRACE("NagraSytem update triggered");
 
  
    if( reader.HasData() == true ) {
 
-        Request value = static_cast<Request>(reader.Number<requestsSize>());
+        const requestsSize request = reader.Number<requestsSize>();
+        Request value = static_cast<Request>(request & ~RequestIdPresent);
+        const uint32_t requestid = ( ( request & RequestIdPresent ) != 0 ? reader.Number<uint32_t>() : 0 );
 
-        REPORT_EXT("NagraSytem update triggered with %d", value);
+        REPORT_TRACE_EXT("NagraSytem update triggered with %u, request %u", static_cast<requestsSize>(value), requestid);
 
         switch (value) {
         case Request::KEYREADY:
@@ -800,25 +1456,63 @@ void MediaSessionSystem::Update(const uint8_t *data, uint32_t  length) {
             ASSERT( reader.HasData() == true );
             string response = reader.Text();
             TNvBuffer buf = { const_cast<char*>(response.c_str()), response.length() + 1 }; 
-            // DumpData("NagraSystem::RenewalResponse|Keyneeded", (const uint8_t*)buf.data, buf.size);
-            uint32_t result = nvLdsImportMessage(_renewalSession, &buf); 
-            REPORT_LDS(result, "nvLdsImportMessage");
-            break;
-        }
-        case Request::EMMDELIVERY:
-        {
-            REPORT("NagraSytem importing EMM response");
-            ASSERT( reader.HasData() == true );
-            TNvBuffer buf = { nullptr, 0 }; 
-            const uint8_t* pbuffer;
-            buf.size = reader.LockBuffer<uint16_t>(pbuffer);
-            buf.data = const_cast<uint8_t*>(pbuffer);
-            // DumpData("NagraSystem::EMMResponse", (const uint8_t*)buf.data, buf.size);
-            uint32_t result = nvImsmDecryptEMM(_inbandSession, &buf); 
-            REPORT_IMSM(result, "nvImsmDecryptEMM");
-            reader.UnlockBuffer(buf.size);
-            break;
-        }
+
+            TNvSession deliverysession = _renewalSession;
+            bool stale = false;
+
+            g_lock.Lock();
+            if( requestid != 0 ) {
+                auto it = _requestids.find(requestid);
+                if( it == _requestids.end() ) {
+                    stale = true; // superseded, or the exchange already completed
+                }
+                else {
+                    deliverysession = it->second;
+                    _requestids.erase(it);
+                    auto pending = std::find(_pendingresponses.begin(), _pendingresponses.end(), deliverysession);
+                    if( pending != _pendingresponses.end() ) {
+                        _pendingresponses.erase(pending);
+                    }
+                }
+            }
+            else if( ( value == Request::KEYNEEDED ) && ( _pendingresponses.size() == 1 ) ) {
+                // no request ID, only unambiguous when a single exchange is waiting (without correlation that is the shared session anyway)
+                deliverysession = _pendingresponses.front();
+                _pendingresponses.pop_front();
+            }
+            g_lock.Unlock();
+
+            if( stale == true ) {
+                _counters.StaleResponses.fetch_add(1, std::memory_order_relaxed);
+                REPORT_LOG(CDMi::Log::LEVEL_WARNING, "Discarding stale response for request %u", requestid);
+            }
+            else {
+                // DumpData("NagraSystem::RenewalResponse|Keyneeded", (const uint8_t*)buf.data, buf.size);
+                uint32_t result = PRM_CALL("nvLdsImportMessage", nvLdsImportMessage(deliverysession, &buf)); 
+                REPORT_LDS(result, "nvLdsImportMessage");
+            }
+            break;
+        }
+        case Request::EMMDELIVERY:
+        {
+            REPORT_TRACE("NagraSytem importing EMM response");
+            ASSERT( reader.HasData() == true );
+            while( reader.HasData() == true ) { // one or more, see MediaRequest.h
+                const uint8_t* pbuffer;
+                const uint16_t size = reader.LockBuffer<uint16_t>(pbuffer);
+                // DumpData("NagraSystem::EMMResponse", pbuffer, size);
+                DeliverEMM(pbuffer, size);
+                reader.UnlockBuffer(size);
+            }
+            break;
+        }
+        case Request::SECTIONRING:
+        {
+            const string ring = reader.Text();
+            const string doorbell = ( reader.HasData() == true ? reader.Text() : string() );
+            AttachSectionRing(0, ring.c_str(), doorbell.c_str());
+            break;
+        }
         case Request::PROVISION:
         {
             REPORT("NagraSytem importing provsioning response");
@@ -826,7 +1520,7 @@ void MediaSessionSystem::Update(const uint8_t *data, uint32_t  length) {
             string response = reader.Text();
             TNvBuffer buf = { const_cast<char*>(response.c_str()), response.length() + 1 }; 
             //DumpData("NagraSystem::ProvisionResponse", (const uint8_t*)buf.data, buf.size);
-            uint32_t result = nvDpscImportMessage(_provioningSession, &buf);
+            uint32_t result = PRM_CALL("nvDpscImportMessage", nvDpscImportMessage(_provioningSession, &buf));
             REPORT_DPSC(result, "nvDpscImportMessage");
             CloseProvisioningSession();
             InitializeWhenProvisoned();
@@ -846,7 +1540,7 @@ void MediaSessionSystem::Update(const uint8_t *data, uint32_t  length) {
     else {
        REPORT("MediaSessionSystem::Update: expected more data");
     }
-    REPORT("leave MediaSessionSystem::Update");
+    REPORT_TRACE("leave MediaSessionSystem::Update");
 }
 
 CDMi_RESULT MediaSessionSystem::Load() {
@@ -890,22 +1584,47 @@ CDMi_RESULT MediaSessionSystem::ReleaseClearContent(const uint8_t*, uint32_t, co
   return CDMi_S_FALSE;
 }
 
- TNvSession MediaSessionSystem::OpenDescramblingSession(IMediaSessionConnect* session, const uint32_t TSID, const uint16_t Emi) {
+ TNvSession MediaSessionSystem::OpenDescramblingSession(IMediaSessionConnect* session, const uint32_t TSID, const uint16_t Emi, const uint8_t keyids[], const uint32_t keyidcount) {
 
     TNvSession descramblingsession = 0;
     int platStatus;
 
     g_lock.Lock(); // note:we could use a more find grained locking to only protect the _connectsessions
 
-    platStatus = nagra_cma_platf_dsm_open(TSID);
+    _lastDescramblingOpen = Profiler::Now();
+
+    platStatus = PRM_CALL("nagra_cma_platf_dsm_open", nagra_cma_platf_dsm_open(TSID));
     REPORT_PRM_EXT(NAGRA_CMA_PLATF_OK, platStatus,
                    "nagra_cma_platf_dsm_open", " tsid=%u", TSID);
 
-    uint32_t result = nvDsmOpen(&descramblingsession, _applicationSession, TSID, Emi);
+    uint32_t result = PRM_CALL("nvDsmOpen", nvDsmOpen(&descramblingsession, _applicationSession, TSID, Emi));
     REPORT_DSM(result, "nvDsmOpen");
 
     if( result == NV_DSM_SUCCESS ) {
-        _connectsessions[descramblingsession] = session;
+        ConnectSession& entry(_connectsessions[descramblingsession]);
+        entry.Session = session;
+        entry.KeyIds.clear();
+        entry.LastECM = NoECM;
+
+        KeyStatusUpdates known;
+
+        for( uint32_t index = 0; index < keyidcount; ++index ) {
+            KeyId keyid;
+            std::copy(&keyids[index * KeyIdSize], &keyids[(index + 1) * KeyIdSize], keyid.begin());
+            entry.KeyIds.push_back(keyid);
+
+            KeyIdEntry& keyidentry(_keyids[keyid]);
+            keyidentry.Sessions.insert(descramblingsession);
+
+            // another session already has this key, no need to wait for our own needkey to tell the player
+            if( keyidentry.Status != nullptr ) {
+                known.push_back(KeyStatusUpdate(descramblingsession, &keyid, keyidentry.Status));
+            }
+        }
+
+        if( known.empty() == false ) {
+            PostKeyStatusJob(std::move(known));
+        }
     }
 
     g_lock.Unlock();
@@ -916,18 +1635,37 @@ CDMi_RESULT MediaSessionSystem::ReleaseClearContent(const uint8_t*, uint32_t, co
 void MediaSessionSystem::CloseDescramblingSession(TNvSession session, const uint32_t TSID) {
      REPORT("enter MediaSessionSystem::UnregisterConnectSessionS");
 
+    std::unique_ptr<SectionRing> ring; // destructed after unlocking
+
     g_lock.Lock(); // note:we could use a more find grained locking to only protect the _connectsessions
 
     auto it = _connectsessions.find(session);
     ASSERT( it != _connectsessions.end() );
     if( it != _connectsessions.end() ) {
         int platStatus;
-        nvDsmClose(session);
+        PRM_CALL("nvDsmClose", nvDsmClose(session));
 
-        platStatus = nagra_cma_platf_dsm_close(TSID);
+        platStatus = PRM_CALL("nagra_cma_platf_dsm_close", nagra_cma_platf_dsm_close(TSID));
         REPORT_PRM_EXT(NAGRA_CMA_PLATF_OK, platStatus,
                        "nagra_cma_platf_dsm_close", " tsid=%u", TSID);
 
+        ReleaseDeliveryRequests(session);
+        _keystates.erase(session);
+
+        for( const KeyId& keyid : it->second.KeyIds ) {
+            auto keyidentry = _keyids.find(keyid);
+            ASSERT( keyidentry != _keyids.end() );
+            if( keyidentry != _keyids.end() ) {
+                keyidentry->second.Sessions.erase(session);
+                if( keyidentry->second.Sessions.empty() == true ) {
+                    _keyids.erase(keyidentry);
+                }
+            }
+        }
+
+        PurgeCommandJobs(it->second.Session);
+        ring = DetachSectionRing(it->second.Session);
+
         _connectsessions.erase(it);
     }
 
@@ -937,12 +1675,64 @@ void MediaSessionSystem::CloseDescramblingSession(TNvSession session, const uint
 }
 
 void MediaSessionSystem::SetPrmContentMetadata(TNvSession descamblingsession, TNvBuffer* data, TNvStreamType streamtype) {
-    uint32_t result = nvDsmSetPrmContentMetadata(descamblingsession, data, streamtype);
+    uint32_t result = PRM_CALL("nvDsmSetPrmContentMetadata", nvDsmSetPrmContentMetadata(descamblingsession, data, streamtype));
     REPORT_DSM(result, "nvDsmSetPrmContentMetadata");
 }
 
+void MediaSessionSystem::DeliverEMM(const uint8_t section[], const uint16_t length) {
+    _counters.EMMDeliveries.fetch_add(1, std::memory_order_relaxed);
+    QueueEMM(section, length);
+}
+
+void MediaSessionSystem::AttachSectionRing(TNvSession descramblingsession, const char ring[], const char doorbell[]) {
+    std::unique_ptr<SectionRing> created;
+    std::unique_ptr<SectionRing> previous; // destructed after unlocking
+
+    if( ( ring != nullptr ) && ( ring[0] != '\0' ) ) {
+        created.reset(new SectionRing(ring, ( doorbell != nullptr ? doorbell : "" ), [this, descramblingsession](const uint8_t section[], const uint16_t length) {
+            IngestSection(descramblingsession, section, length);
+        }));
+
+        if( created->IsValid() == false ) {
+            created.reset();
+        }
+    }
+
+    g_lock.Lock();
+
+    const void* owner = this;
+    if( descramblingsession != 0 ) {
+        auto session = _connectsessions.find(descramblingsession);
+        owner = ( session != _connectsessions.end() ? static_cast<const void*>(session->second.Session) : nullptr );
+    }
+
+    const bool attached = ( ( owner != nullptr ) && ( created ) );
+
+    if( owner != nullptr ) {
+        previous = DetachSectionRing(owner);
+        if( attached == true ) {
+            _sectionrings[owner] = std::move(created);
+        }
+    }
+
+    g_lock.Unlock();
+
+    REPORT_EXT("Section ring for descrambling session %u %s", descramblingsession, ( attached == true ? "attached" : "detached" ));
+}
+
+std::unique_ptr<SectionRing> MediaSessionSystem::DetachSectionRing(const void* owner) {
+    // already in lock
+    std::unique_ptr<SectionRing> result;
+    auto ring = _sectionrings.find(owner);
+    if( ring != _sectionrings.end() ) {
+        result = std::move(ring->second);
+        _sectionrings.erase(ring);
+    }
+    return result;
+}
+
 void MediaSessionSystem::SetPlatformMetadata(TNvSession descamblingsession, const uint32_t TSID, uint8_t *data, size_t size) {
-    int result = nagra_cma_platf_dsm_cmd(TSID, data, size);
+    int result = PRM_CALL("nagra_cma_platf_dsm_cmd", nagra_cma_platf_dsm_cmd(TSID, data, size));
     REPORT_PRM_EXT(NAGRA_CMA_PLATF_OK, result,
                    "nagra_cma_platf_dsm_cmd", " tsid=%u", TSID);
 }
@@ -952,7 +1742,7 @@ void MediaSessionSystem::Addref() const {
 }
 
 uint32_t MediaSessionSystem::Release() const {
-     REPORT("enter MediaSessionSystem::Release");
+     REPORT_TRACE("enter MediaSessionSystem::Release");
 
     g_lock.Lock(); // need lock here as wel as in CreateMediaSessionSystem(), as the final release can come from external as well as from the connect session
 
@@ -967,7 +1757,7 @@ uint32_t MediaSessionSystem::Release() const {
 
     g_lock.Unlock();
 
-     REPORT("leave MediaSessionSystem::Release");
+     REPORT_TRACE("leave MediaSessionSystem::Release");
     return retval;
 }
 
@@ -982,10 +1772,21 @@ void MediaSessionSystem::RegisterMediaSessionSystemProxy(MediaSessionSystemProxy
 
 void MediaSessionSystem::DeregisterMediaSessionSystemProxy(MediaSessionSystemProxy* proxy) {
     ASSERT(proxy != nullptr);
+    std::unique_ptr<SectionRing> ring; // destructed after unlocking
+
     g_lock.Lock(); 
 
     _systemproxies.remove( proxy ); 
 
+    PurgeCommandJobs(proxy->IMediaKeyCallback());
+
+    ResponderGone(proxy);
+    CancelRenewalJob();
+
+    if( _systemproxies.empty() == true ) {
+        ring = DetachSectionRing(this);
+    }
+
     g_lock.Unlock(); 
 
 }
@@ -993,17 +1794,11 @@ void MediaSessionSystem::DeregisterMediaSessionSystemProxy(MediaSessionSystemPro
 void MediaSessionSystem::PostProvisionJob() {
     DataBuffer buffer;
     GetProvisionChallenge(buffer);
-    Addref(); // make sure we keep this alive for the lambda
-    PostCommandJob([=](const DataBuffer& data){
+    _counters.KeyMessagesPosted.fetch_add(1, std::memory_order_relaxed);
+    PostCommandJob(JobPriority::PROVISION, *this, this, [=](const DataBuffer& data){
         g_lock.Lock(); // could now better be lock per system
-        for( auto proxy : _systemproxies ) {
-            IMediaKeySessionCallback* callback( proxy->IMediaKeyCallback() );
-            if( callback != nullptr ) {
-                callback->OnKeyMessage(data.data(), data.size(), const_cast<char*>("PROVISION"));
-            }
-        }
+        NotifyProxies(data, "PROVISION", Request::PROVISION);
         g_lock.Unlock();
-        Release();
     }
     , std::move(buffer));
 }
@@ -1011,19 +1806,456 @@ void MediaSessionSystem::PostProvisionJob() {
 void MediaSessionSystem::PostRenewalJob() {
     DataBuffer buffer;
     CreateRenewalExchange(buffer);
-    Addref(); // make sure we keep this alive for the lambda
-    PostCommandJob([=](const DataBuffer& data){
+    const std::string label(MessageLabel("RENEWAL", ( buffer.empty() == false ? AssignRequestId(_renewalSession) : 0 )));
+    _counters.KeyMessagesPosted.fetch_add(1, std::memory_order_relaxed);
+    PostCommandJob(JobPriority::BACKGROUND, *this, this, [=](const DataBuffer& data){
+        g_lock.Lock(); // could now better be lock per system
+        NotifyProxies(data, label.c_str(), Request::RENEWAL);
+        g_lock.Unlock();
+    }
+    , std::move(buffer), JobKind::RENEWAL);
+}
+
+void MediaSessionSystem::ScheduleRenewalJob(const uint8_t deferred) {
+    // already in lock
+    // the exchange itself is created when the timer fires, not when the PRM asks for it, a renewal that is already scheduled or queued is replaced
+    const uint32_t delay = ( deferred == 0 ? static_cast<uint32_t>(Profiler::Now() % RenewalSpread) : RenewalSpread );
+    _renewalTimer = PostDelayedCommandJob(JobPriority::BACKGROUND, delay, *this, this, [=](const DataBuffer&){
         g_lock.Lock(); // could now better be lock per system
-        for( auto proxy : _systemproxies ) {
-            IMediaKeySessionCallback* callback( proxy->IMediaKeyCallback() );
-            if( callback != nullptr ) {
-                callback->OnKeyMessage(data.data(), data.size(), const_cast<char*>("RENEWAL"));
+        _renewalTimer = 0;
+        if( ( AnyCallBackSet() == true ) && ( deferred < MaxRenewalDeferrals ) && ( Commands().Load() >= RenewalBusyDepth ) ) {
+            ScheduleRenewalJob(deferred + 1); // wait for a quieter moment
+        }
+        else if( AnyCallBackSet() == true ) {
+            PostRenewalJob();
+        }
+        else {
+            RequestReceived(Request::RENEWAL);
+        }
+        g_lock.Unlock();
+    }
+    , DataBuffer(), JobKind::RENEWAL);
+}
+
+void MediaSessionSystem::CancelRenewalJob() {
+    // already in lock
+    if( ( _renewalTimer != 0 ) && ( AnyCallBackSet() == false ) ) {
+        // nobody can do the exchange now, it is done once a callback registers again (when the timer already fired the job takes care of that)
+        if( CancelCommandJob(_renewalTimer) == true ) {
+            RequestReceived(Request::RENEWAL);
+        }
+        _renewalTimer = 0;
+    }
+}
+
+void MediaSessionSystem::ProcessEMM(const uint8_t section[], const uint16_t length) {
+    const EmmHistory::Hash hash = EmmHistory::Calculate(section, length);
+
+    g_lock.Lock();
+    const bool duplicate = _emmhistory.Contains(hash, Profiler::Now());
+    g_lock.Unlock();
+
+    if( duplicate == true ) {
+        _counters.EMMDuplicates.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        TNvBuffer buf = { const_cast<uint8_t*>(section), length };
+        uint32_t result = PRM_CALL("nvImsmDecryptEMM", nvImsmDecryptEMM(_inbandSession, &buf)); 
+        REPORT_IMSM(result, "nvImsmDecryptEMM");
+
+        if( result == NV_IMSM_SUCCESS ) {
+            g_lock.Lock();
+            // only what the PRM accepted, an EMM that failed (e.g. not provisioned yet) is tried again the next time around
+            _emmhistory.Add(hash, Profiler::Now());
+
+            // an EMM can change the filters (e.g. a new group or unique address), the demux should not keep running the old ones.
+            // Only once the filters were handed out, before that the next Run or provisioning takes care of them.
+            if( ( _filterGeneration != 0 ) && ( RefreshFilters() == true ) && ( AnyCallBackSet() == true ) ) {
+                REPORT("NagraSystem filters changed by EMM");
+                PostFiltersJob(nullptr);
             }
+            g_lock.Unlock();
+        }
+    }
+}
+
+SectionResult MediaSessionSystem::IngestSection(const TNvSession descramblingSession, const uint8_t data[], const uint32_t length) {
+    SectionResult result = SECTION_ACCEPTED;
+    const Section section(data, length);
+
+    _counters.SectionsIngested.fetch_add(1, std::memory_order_relaxed);
+
+    if( ( section.IsValid() == false ) || ( ( section.IsECM() == false ) && ( section.IsEMM() == false ) ) ) {
+        result = SECTION_INVALID;
+    }
+    else if( section.IsCRCValid() == false ) {
+        result = SECTION_CRC_ERROR;
+    }
+    else if( section.IsEMM() == true ) {
+        // repeated EMMs do not have a version that tells anything, the EMM history takes care of those
+        QueueEMM(section.Data(), section.Length());
+    }
+    else {
+        // the ECM table_id toggles between 0x80 and 0x81 when its content changes, for sections with syntax the version is used as well
+        const uint16_t ecm = ( ( section.TableId() << 8 ) | ( section.HasSyntax() == true ? section.Version() : 0xFF ) );
+
+        g_lock.Lock();
+        auto session = _connectsessions.find(descramblingSession);
+        if( session == _connectsessions.end() ) {
+            result = SECTION_NOT_ROUTED;
+        }
+        else if( session->second.LastECM == ecm ) {
+            result = SECTION_UNCHANGED;
+        }
+        else {
+            session->second.LastECM = ecm;
         }
         g_lock.Unlock();
-        Release();
+
+        if( result == SECTION_ACCEPTED ) {
+            TNvBuffer buf = { const_cast<uint8_t*>(section.Data()), section.Length() };
+            SetPrmContentMetadata(descramblingSession, &buf, ::NV_STREAM_TYPE_DVB);
+        }
+    }
+
+    if( result == SECTION_UNCHANGED ) {
+        _counters.SectionsUnchanged.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if( result != SECTION_ACCEPTED ) {
+        _counters.SectionErrors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return result;
+}
+
+void MediaSessionSystem::QueueEMM(const uint8_t section[], const uint16_t length) {
+    g_lock.Lock();
+    // not addressed to us according to the PRM's own filters, the demux would not have passed it either
+    if( ( g_emmprefilter.load(std::memory_order_relaxed) == true ) && ( _emmprefilter.Matches(section, length) == false ) ) {
+        _counters.EMMsRejected.fetch_add(1, std::memory_order_relaxed);
+    }
+    else {
+        if( _emmqueue.size() >= MaxQueuedEMMs ) {
+            _counters.EMMsDropped.fetch_add(1, std::memory_order_relaxed);
+            _emmqueue.pop_front(); // the carousel will bring it again
+        }
+        _emmqueue.push_back(DataBuffer(section, section + length));
+        // it replaces the one that is still queued (if any), so a job dropped from a full CommandHandler queue does not stall us.
+        // Not while the queue is held back for a zap, unless the delayed job is overdue (then it got dropped as well).
+        if( ( _emmHeld == 0 ) || ( ( _emmHeld + ( EmmThrottleDelay * 1000ULL ) ) <= Profiler::Now() ) ) {
+            PostEMMJob(0);
+        }
+    }
+    g_lock.Unlock();
+}
+
+void MediaSessionSystem::PostEMMJob(const uint32_t delay) {
+    // already in lock
+    if( delay == 0 ) {
+        PostCommandJob(JobPriority::EMM, *this, this, [=](const DataBuffer&){
+            ProcessEMMs();
+        }
+        , DataBuffer(), JobKind::EMM);
+    }
+    else {
+        _emmHeld = Profiler::Now() + ( delay * 1000ULL );
+        PostDelayedCommandJob(JobPriority::EMM, delay, *this, this, [=](const DataBuffer&){
+            ProcessEMMs();
+        }
+        , DataBuffer(), JobKind::EMM);
+    }
+}
+
+bool MediaSessionSystem::ZapInProgress(const uint64_t now) const {
+    // already in lock
+    bool result = ( ( _lastDescramblingOpen + ZapSettleTime ) > now );
+
+    // only the exchanges a zap starts count, one that is still not answered after the zap window (it can stay REQUESTED up to
+    // KeyRequestTimeout) is not worth holding the EMMs back for
+    for( auto it = _keystates.begin(); ( result == false ) && ( it != _keystates.end() ); ++it ) {
+        const KeyTracking& tracking(it->second);
+        result = ( ( ( tracking.State == KeyState::REQUESTED ) || ( tracking.State == KeyState::EXPIRING ) ) && ( ( tracking.Requested + ZapSettleTime ) > now ) );
+    }
+
+    return result;
+}
+
+void MediaSessionSystem::ProcessEMMs() {
+    std::vector<DataBuffer> batch;
+
+    g_lock.Lock();
+    const uint64_t now = Profiler::Now();
+    _emmHeld = 0;
+    const bool zap = ZapInProgress(now);
+    if( ( _emmqueue.empty() == false ) && ( zap == true ) && ( ( _emmThrottled == 0 ) || ( ( _emmThrottled + MaxEmmThrottle ) > now ) ) ) {
+        if( _emmThrottled == 0 ) {
+            _emmThrottled = now;
+        }
+        _counters.EMMsThrottled.fetch_add(1, std::memory_order_relaxed);
+        PostEMMJob(EmmThrottleDelay);
+    }
+    else {
+        while( ( _emmqueue.empty() == false ) && ( batch.size() < EmmBatchSize ) ) {
+            batch.push_back(std::move(_emmqueue.front()));
+            _emmqueue.pop_front();
+        }
+        // a hold that ran into MaxEmmThrottle stays over until the backlog is gone, not only for this one batch
+        if( ( zap == false ) || ( _emmqueue.empty() == true ) ) {
+            _emmThrottled = 0;
+        }
+    }
+    g_lock.Unlock();
+
+    for( const DataBuffer& section : batch ) {
+        ProcessEMM(section.data(), static_cast<uint16_t>(section.size()));
+    }
+
+    if( batch.empty() == false ) {
+        g_lock.Lock();
+        if( _emmqueue.empty() == false ) {
+            PostEMMJob(0); // catch up, after whatever got queued in the mean time
+        }
+        g_lock.Unlock();
+    }
+}
+
+void MediaSessionSystem::NotifyProxies(const DataBuffer& data, const char* type, const Request request) {
+    // already in lock
+    // a system wide exchange goes out once, all clients share the same vault so one of them answering is enough
+    MediaSessionSystemProxy* responder = Responder(request);
+
+    if( responder != nullptr ) {
+        if( request == Request::PROVISION ) {
+            _provisionResponder = responder;
+        }
+        _counters.KeyMessagesDispatched.fetch_add(1, std::memory_order_relaxed);
+        SendKeyMessage(*responder, data.data(), data.size(), type);
+    }
+    else if( request != Request::KEYNEEDED ) { // a needkey is asked again after its timeout anyway
+        REPORT_EXT("NagraSystem no client subscribed for %s, postponed", type);
+        RequestReceived(request); // the next Run takes care of it
+    }
+}
+
+void MediaSessionSystem::SendKeyMessage(MediaSessionSystemProxy& proxy, const uint8_t data[], const uint32_t length, const char type[]) {
+    // already in lock
+    IMediaKeySessionCallback* callback( proxy.IMediaKeyCallback() );
+    const uint16_t window = proxy.BatchWindow();
+    ASSERT( callback != nullptr );
+
+    if( window == 0 ) {
+        // batching was just switched off and its flush job did not run yet, what was batched goes first
+        FlushKeyMessages(proxy);
+        callback->OnKeyMessage(data, length, const_cast<char*>(type));
+    }
+    else {
+        KeyMessageBatch& batch( proxy.Batch() );
+        const uint64_t now = Profiler::Now();
+
+        // the flush job should have been there long ago, it was dropped from a full queue
+        if( ( batch.Parts() != 0 ) && ( ( batch.Started() + ( 2000ULL * window ) ) <= now ) ) {
+            FlushKeyMessages(proxy);
+        }
+
+        if( batch.Add(type, data, length, now) == false ) {
+            FlushKeyMessages(proxy);
+            if( batch.Add(type, data, length, now) == false ) {
+                callback->OnKeyMessage(data, length, const_cast<char*>(type)); // does not fit in an envelope at all
+            }
+        }
+
+        if( batch.Parts() == 1 ) {
+            PostFlushJob(callback, window);
+        }
+    }
+}
+
+void MediaSessionSystem::PostFlushJob(IMediaKeySessionCallback* callback, const uint32_t delay) {
+    // already in lock
+    // a flush job for a callback goes when that callback is unregistered
+    CommandHandler::Command command = [=](const DataBuffer&){
+        g_lock.Lock(); // could now better be lock per system
+        for( MediaSessionSystemProxy* entry : _systemproxies ) {
+            if( ( entry != nullptr ) && ( entry->IMediaKeyCallback() == callback ) ) {
+                FlushKeyMessages(*entry);
+            }
+        }
+        g_lock.Unlock();
+    };
+
+    if( delay == 0 ) {
+        PostCommandJob(JobPriority::NEEDKEY, *this, callback, std::move(command), DataBuffer());
+    }
+    else {
+        PostDelayedCommandJob(JobPriority::NEEDKEY, delay, *this, callback, std::move(command), DataBuffer());
+    }
+}
+
+void MediaSessionSystem::FlushKeyMessages(MediaSessionSystemProxy& proxy) {
+    // already in lock
+    KeyMessageBatch& batch( proxy.Batch() );
+    IMediaKeySessionCallback* callback( proxy.IMediaKeyCallback() );
+    std::string type;
+    const uint8_t* data = nullptr;
+    uint32_t length = 0;
+
+    if( ( batch.Parts() != 0 ) && ( callback != nullptr ) ) {
+        if( batch.Single(type, data, length) == true ) {
+            callback->OnKeyMessage(data, length, const_cast<char*>(type.c_str())); // nothing to merge it with, as if it was never batched
+        }
+        else {
+            _counters.KeyMessagesBatched.fetch_add(batch.Parts(), std::memory_order_relaxed);
+            callback->OnKeyMessage(batch.Data(), batch.Length(), const_cast<char*>(KeyMessageBatch::Type));
+        }
+    }
+    batch.Clear();
+}
+
+MediaSessionSystem::MediaSessionSystemProxy* MediaSessionSystem::Responder(const Request request) const {
+    // already in lock
+    // the first registered proxy with a callback that is subscribed, proxies are added at the front so that is the last match
+    MediaSessionSystemProxy* result = nullptr;
+    for( MediaSessionSystemProxy* proxy : _systemproxies ) {
+        if( ( proxy != nullptr ) && ( proxy->IMediaKeyCallback() != nullptr ) && ( proxy->IsSubscribed(request) == true ) ) {
+            result = proxy;
+        }
+    }
+    return result;
+}
+
+void MediaSessionSystem::ResponderGone(const MediaSessionSystemProxy* proxy) {
+    // already in lock
+    // the provisioning challenge would never be answered, hand the same one to the next responder (renewals and needkeys are asked again by the PRM)
+    if( ( proxy == _provisionResponder ) && ( proxy != nullptr ) ) {
+        _provisionResponder = nullptr;
+        if( _provioningSession != 0 ) {
+            REPORT("NagraSystem provisioning responder gone, failing over");
+            if( Responder(Request::PROVISION) != nullptr ) {
+                PostProvisionJob();
+            }
+            else {
+                RequestReceived(Request::PROVISION);
+            }
+        }
+    }
+}
+
+void MediaSessionSystem::KeyStatusChanged(const TNvSession descramblingSession, const char* status) {
+    // already in lock
+    auto session = _connectsessions.find(descramblingSession);
+
+    if( session != _connectsessions.end() ) {
+        KeyStatusUpdates updates;
+
+        if( session->second.KeyIds.empty() == true ) { // no KIDs in the init data, report it for the session as a whole
+            updates.push_back(KeyStatusUpdate(descramblingSession, nullptr, status));
+        }
+        else {
+            // the KID might also be used by other sessions (e.g. the same service on two tuners), they are affected as well
+            for( const KeyId& keyid : session->second.KeyIds ) {
+                auto keyidentry = _keyids.find(keyid);
+                ASSERT( keyidentry != _keyids.end() );
+                if( keyidentry != _keyids.end() ) {
+                    keyidentry->second.Status = status;
+                    for( const TNvSession target : keyidentry->second.Sessions ) {
+                        updates.push_back(KeyStatusUpdate(target, &keyid, status));
+                    }
+                }
+            }
+        }
+
+        PostKeyStatusJob(std::move(updates));
+    }
+}
+
+void MediaSessionSystem::PostKeyStatusJob(KeyStatusUpdates&& updates) {
+    // already in lock
+
+    // one job per connect session, so it can be purged with the session
+    std::map<TNvSession, KeyStatusUpdates> sessions;
+    for( const KeyStatusUpdate& update : updates ) {
+        sessions[update.Session].push_back(update);
+    }
+
+    for( const std::pair<const TNvSession, KeyStatusUpdates>& session : sessions ) {
+        auto target = _connectsessions.find(session.first);
+        if( target != _connectsessions.end() ) {
+            const TNvSession descramblingSession = session.first;
+            const KeyStatusUpdates sessionupdates(session.second);
+
+            PostCommandJob(JobPriority::NEEDKEY, *this, target->second.Session, [=](const DataBuffer&){
+                g_lock.Lock(); // could now better be lock per system
+
+                auto it = _connectsessions.find(descramblingSession);
+                if( it != _connectsessions.end() ) {
+                    for( const KeyStatusUpdate& update : sessionupdates ) {
+                        it->second.Session->OnKeyStatusUpdate(update.Status, ( update.HasKeyId == true ? update.Id.data() : nullptr ), ( update.HasKeyId == true ? KeyIdSize : 0 ));
+                    }
+                    it->second.Session->OnKeyStatusesUpdated();
+                }
+
+                g_lock.Unlock();
+            }
+            , DataBuffer());
+        }
+    }
+}
+
+void MediaSessionSystem::GetStatistics(Statistics::System& statistics) const {
+    // already in lock
+    uint32_t proxies = 0;
+    for( auto proxy : _systemproxies ) {
+        if( proxy != nullptr ) {
+            ++proxies;
+        }
+    }
+
+    statistics.SessionId = _sessionId;
+    statistics.Proxies = proxies;
+    statistics.EMMDeliveries = _counters.EMMDeliveries.load(std::memory_order_relaxed);
+    statistics.NeedKeyEvents = _counters.NeedKeyEvents.load(std::memory_order_relaxed);
+    statistics.RenewalEvents = _counters.RenewalEvents.load(std::memory_order_relaxed);
+    statistics.KeyMessagesPosted = _counters.KeyMessagesPosted.load(std::memory_order_relaxed);
+    statistics.KeyMessagesDispatched = _counters.KeyMessagesDispatched.load(std::memory_order_relaxed);
+    statistics.KeyRequestsSuppressed = _counters.KeyRequestsSuppressed.load(std::memory_order_relaxed);
+    statistics.DeliverySessions = static_cast<uint32_t>(_deliveryrequests.size() + _idledeliverysessions.size());
+    statistics.DeliveryPoolExhausted = _counters.DeliveryPoolExhausted.load(std::memory_order_relaxed);
+    statistics.StaleResponses = _counters.StaleResponses.load(std::memory_order_relaxed);
+    statistics.FilterGeneration = _filterGeneration;
+    statistics.FilterDeltas = _counters.FilterDeltas.load(std::memory_order_relaxed);
+    statistics.EMMDuplicates = _counters.EMMDuplicates.load(std::memory_order_relaxed);
+    statistics.EMMQueue = static_cast<uint32_t>(_emmqueue.size());
+    statistics.EMMsDropped = _counters.EMMsDropped.load(std::memory_order_relaxed);
+    statistics.EMMsThrottled = _counters.EMMsThrottled.load(std::memory_order_relaxed);
+    statistics.SectionsIngested = _counters.SectionsIngested.load(std::memory_order_relaxed);
+    statistics.SectionsUnchanged = _counters.SectionsUnchanged.load(std::memory_order_relaxed);
+    statistics.SectionErrors = _counters.SectionErrors.load(std::memory_order_relaxed);
+    statistics.SectionRings = static_cast<uint32_t>(_sectionrings.size());
+    statistics.KeyMessagesBatched = _counters.KeyMessagesBatched.load(std::memory_order_relaxed);
+    statistics.EMMsRejected = _counters.EMMsRejected.load(std::memory_order_relaxed);
+
+    for( uint8_t from = 0; from < KeyStates; ++from ) {
+        for( uint8_t to = 0; to < KeyStates; ++to ) {
+            const uint32_t count = _counters.KeyTransitions[from][to].load(std::memory_order_relaxed);
+            if( count != 0 ) {
+                Statistics::KeyTransition& entry(statistics.KeyTransitions.Add());
+                entry.From = KeyStateNames[from];
+                entry.To = KeyStateNames[to];
+                entry.Count = count;
+            }
+        }
+    }
+
+    for( const std::pair<const TNvSession, ConnectSession>& session : _connectsessions ) {
+        IMediaSessionConnect::Statistics counters = { 0, 0, 0 };
+        session.second.Session->GetStatistics(counters);
+
+        Statistics::ConnectSession& entry(statistics.ConnectSessions.Add());
+        entry.DescramblingSession = session.first;
+        entry.ECMDeliveries = counters.ECMDeliveries;
+        entry.PlatformDeliveries = counters.PlatformDeliveries;
+        entry.EMMDeliveries = counters.EMMDeliveries;
     }
-    , std::move(buffer));
 }
 
 
@@ -1037,39 +2269,278 @@ namespace {
 
     CommandHandler::CommandHandler()
         : Thunder::Core::Thread(Thunder::Core::Thread::DefaultStackSize(), "Nagra DRM Session Commandhandler")
-        , _commands()
-        ,_lock() {
+        , _classes()
+        , _timers(TimerResolution, Milliseconds())
+        , _wakeup(false, true)
+        ,_lock()
+        , _maxDepth(0)
+        , _posted(0)
+        , _executed(0)
+        , _purged(0)
+        , _replaced(0)
+        , _dropped(0)
+        , _waiting()
+        , _execution() {
     }
 
     CommandHandler::~CommandHandler() {
        Stop();
+       _wakeup.SetEvent();
             
         Wait(Thread::STOPPED,  Thunder::Core::infinite);
     }
 
-    void CommandHandler::PostCommand(Command&& command, Data&& data) {
+    void CommandHandler::PostCommand(const JobPriority priority, const Job& job, Command&& command, Data&& data) {
+        Systems released;
+
         _lock.Lock();           
-        _commands.push(CommandPair(std::move(command), std::move(data)));
-        if( _commands.size() == 1 ) {
+        Enqueue(priority, job, std::move(command), std::move(data), released);
+        if( Depth() == 1 ) {
             Run();
+            _wakeup.SetEvent();
         }
         _lock.Unlock();
+
+        Release(released);
+    }
+
+    CommandHandler::TimerHandle CommandHandler::PostCommand(const JobPriority priority, const uint32_t delay, const Job& job, Command&& command, Data&& data) {
+        TimerHandle handle = 0;
+        const CDMi::MediaSessionSystem* released = nullptr;
+
+        _lock.Lock();           
+        TimedCommand* pending = ( job._kind != JobKind::UNIQUE ? _timers.Find([&job](const TimedCommand& timed) { return job.Supersedes(timed._job); }) : nullptr );
+        if( pending != nullptr ) {
+            // keeps the deadline of the pending one, otherwise a job that keeps getting posted would never run
+            pending->_priority = priority;
+            pending->_command = std::move(command);
+            pending->_data = std::move(data);
+            handle = _timers.HandleOf(pending);
+            released = job._system;
+            ++_replaced;
+        }
+        else {
+            handle = _timers.Schedule(Milliseconds(), delay, TimedCommand(priority, job, std::move(command), std::move(data)));
+            Run();
+            _wakeup.SetEvent(); // the next deadline might have changed
+        }
+        _lock.Unlock();
+
+        if( released != nullptr ) {
+            released->Release();
+        }
+        return handle;
+    }
+
+    bool CommandHandler::CancelCommand(const TimerHandle handle) {
+        const CDMi::MediaSessionSystem* system = nullptr;
+
+        _lock.Lock();
+        const bool cancelled = _timers.Cancel(handle, [&system](TimedCommand&& timed) {
+            system = timed._job._system;
+        });
+        _lock.Unlock();
+
+        if( system != nullptr ) {
+            system->Release();
+        }
+        return cancelled;
+    }
+
+    uint32_t CommandHandler::Load() {
+        _lock.Lock();
+        const uint32_t depth = Depth();
+        _lock.Unlock();
+        return depth;
+    }
+
+    void CommandHandler::Purge(const void* owner) {
+        Systems systems;
+
+        _lock.Lock();
+        for( JobClass& jobclass : _classes ) {
+            auto it = jobclass._commands.begin();
+            while( it != jobclass._commands.end() ) {
+                if( it->_job._owner == owner ) {
+                    systems.push_back(it->_job._system);
+                    it = jobclass._commands.erase(it);
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        _timers.Purge([owner](const TimedCommand& timed) { return ( timed._job._owner == owner ); }, [&systems](TimedCommand&& timed) {
+            systems.push_back(timed._job._system);
+        });
+        _purged += static_cast<uint32_t>(systems.size());
+        _lock.Unlock();
+
+        if( systems.empty() == false ) {
+            TRACE_L1("Purged %u command jobs", static_cast<uint32_t>(systems.size()));
+        }
+
+        Release(systems);
+    }
+
+    void CommandHandler::Enqueue(const JobPriority priority, const Job& job, Command&& command, Data&& data, Systems& released) {
+        // already in lock
+        JobClass& jobclass(_classes[static_cast<uint8_t>(priority)]);
+        ++jobclass._posted;
+        ++_posted;
+
+        if( job._kind != JobKind::UNIQUE ) {
+            auto pending = std::find_if(jobclass._commands.begin(), jobclass._commands.end(), [&job](const CommandEntry& entry) { return job.Supersedes(entry._job); });
+            if( pending != jobclass._commands.end() ) {
+                // takes over the place (and posting time) of the pending one
+                pending->_command = std::move(command);
+                pending->_data = std::move(data);
+                released.push_back(job._system);
+                ++_replaced;
+                return;
+            }
+        }
+
+        if( Depth() >= MaxQueueDepth ) {
+            uint8_t victim = JobPriorities;
+            for( uint8_t index = JobPriorities; index > static_cast<uint8_t>(priority); --index ) {
+                if( _classes[index - 1]._commands.empty() == false ) {
+                    victim = index - 1;
+                    break;
+                }
+            }
+
+            ++_dropped;
+            if( victim == JobPriorities ) {
+                TRACE_L1("Command queue full, dropping the new %s job", JobPriorityNames[static_cast<uint8_t>(priority)]);
+                released.push_back(job._system);
+                return;
+            }
+
+            TRACE_L1("Command queue full, dropping the oldest %s job", JobPriorityNames[victim]);
+            released.push_back(_classes[victim]._commands.front()._job._system);
+            _classes[victim]._commands.pop_front();
+        }
+
+        const uint64_t posted = ( CDMi::Profiler::IsEnabled() == true ? CDMi::Profiler::Now() : 0 );
+        jobclass._commands.push_back(CommandEntry(job, std::move(command), std::move(data), posted));
+        _maxDepth = std::max(_maxDepth, Depth());
+    }
+
+    /* static */ void CommandHandler::Release(const Systems& systems) {
+        for( const CDMi::MediaSessionSystem* system : systems ) {
+            if( system != nullptr ) {
+                system->Release();
+            }
+        }
+    }
+
+    void CommandHandler::GetStatistics(CDMi::Statistics::CommandQueue& statistics) {
+        _lock.Lock();
+        statistics.Depth = Depth();
+        statistics.MaxDepth = _maxDepth;
+        statistics.Posted = _posted;
+        statistics.Executed = _executed;
+        statistics.Scheduled = _timers.Size();
+        statistics.Purged = _purged;
+        statistics.Replaced = _replaced;
+        statistics.Dropped = _dropped;
+        for( uint8_t index = 0; index < JobPriorities; ++index ) {
+            const JobClass& jobclass(_classes[index]);
+            CDMi::Statistics::CommandClass& entry(statistics.Classes.Add());
+            entry.Name = JobPriorityNames[index];
+            entry.Depth = static_cast<uint32_t>(jobclass._commands.size());
+            entry.Posted = jobclass._posted;
+            entry.Executed = jobclass._executed;
+            entry.Promoted = jobclass._promoted;
+            FillLatency(entry.Waiting, jobclass._waiting);
+        }
+        _lock.Unlock();
+
+        FillLatency(statistics.Waiting, _waiting);
+        FillLatency(statistics.Execution, _execution);
+    }
+
+    uint8_t CommandHandler::NextClass() {
+        // already in lock, at least one command available
+        uint8_t selected = JobPriorities;
+
+        for( uint8_t index = 0; index < JobPriorities; ++index ) {
+            if( ( _classes[index]._commands.empty() == false ) && ( _classes[index]._skipped >= StarvationLimit ) ) {
+                selected = index;
+                ++_classes[index]._promoted;
+                break;
+            }
+        }
+
+        if( selected == JobPriorities ) {
+            for( uint8_t index = 0; index < JobPriorities; ++index ) {
+                if( _classes[index]._commands.empty() == false ) {
+                    selected = index;
+                    break;
+                }
+            }
+        }
+
+        for( uint8_t index = 0; index < JobPriorities; ++index ) {
+            if( index == selected ) {
+                _classes[index]._skipped = 0;
+            }
+            else if( _classes[index]._commands.empty() == false ) {
+                ++_classes[index]._skipped;
+            }
+        }
+
+        ASSERT( selected < JobPriorities );
+        return selected;
     }
 
     uint32_t CommandHandler::Worker() {
         while( IsRunning() == true ) {
+            Systems released;
+
             _lock.Lock();
+            _timers.Advance(Milliseconds(), [this, &released](TimedCommand&& timed) {
+                Enqueue(timed._priority, timed._job, std::move(timed._command), std::move(timed._data), released);
+            });
             if( CommandVailable() == true) {
-                Data data(std::move(std::get<1>(_commands.front())));
-                Command command(std::move(std::get<0>(_commands.front())));
-                _commands.pop();
+                JobClass& jobclass(_classes[NextClass()]);
+                const Job job(jobclass._commands.front()._job);
+                Data data(std::move(jobclass._commands.front()._data));
+                Command command(std::move(jobclass._commands.front()._command));
+                const uint64_t posted = jobclass._commands.front()._posted;
+                jobclass._commands.pop_front();
+                ++jobclass._executed;
+                ++_executed;
                 _lock.Unlock();
 
-                command(data.DataBuffer());
+                Release(released);
+
+                if( posted != 0 ) {
+                    const uint64_t started = CDMi::Profiler::Now();
+                    jobclass._waiting.Record(started - posted);
+                    _waiting.Record(started - posted);
+                    command(data.DataBuffer());
+                    _execution.Record(CDMi::Profiler::Now() - started);
+                }
+                else {
+                    command(data.DataBuffer());
+                }
+
+                if( job._system != nullptr ) {
+                    job._system->Release();
+                }
+            }
+            else if( _timers.IsEmpty() == false ) {
+                const uint32_t timeout = std::max(_timers.NextTimeout(Milliseconds()), TimerResolution);
+                _lock.Unlock();
+                Release(released);
+                _wakeup.Lock(timeout);
             }
             else {
                 Block(); //needs to be in lock to prevent racecondition with Run()  
                 _lock.Unlock();
+                Release(released);
             }
         }
         return Thunder::Core::infinite;
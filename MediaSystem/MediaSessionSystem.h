@@ -26,15 +26,30 @@
 #include <set>
 #include <map>
 #include <forward_list>
+#include <deque>
+#include <atomic>
+#include <array>
+#include <memory>
 
 #include "../IMediaSessionSystem.h"
 #include "../IMediaSessionConnect.h"
 #include "../MediaRequest.h"
 #include "../Report.h"
+#include "../ParsePSSHHeader.h"
+#include "Profiler.h"
+#include "EmmHistory.h"
+#include "EmmPrefilter.h"
+#include "KeyMessageBatch.h"
+#include "SectionRing.h"
+#include "TimerWheel.h"
 
 
 namespace CDMi {
 
+namespace Statistics {
+    class System;
+}
+
 class MediaSessionSystem : public IMediaSessionSystem {
 private:
 
@@ -45,7 +60,11 @@ private:
         : IMediaKeySession()
         , _system(system)
         , _callback(nullptr)
-        , _sessionid(g_NAGRASessionIDPrefix) {
+        , _sessionid(g_NAGRASessionIDPrefix)
+        , _filterGeneration(0)
+        , _subscriptions(~static_cast<requestsSize>(0))
+        , _batchWindow(0)
+        , _batch() {
             _sessionid += std::to_string(reinterpret_cast<std::uintptr_t>(this));
             _system.RegisterMediaSessionSystemProxy(this);
             TRACE_L1("system proxy created, %s", _sessionid.c_str());
@@ -72,9 +91,7 @@ private:
 
         void Update(
             const uint8_t *f_pbKeyMessageResponse, 
-            uint32_t f_cbKeyMessageResponse) override {
-            _system.Update(f_pbKeyMessageResponse, f_cbKeyMessageResponse);
-            }
+            uint32_t f_cbKeyMessageResponse) override;
 
         virtual CDMi_RESULT Remove() override {
             return _system.Remove();
@@ -122,10 +139,35 @@ private:
             return _sessionid;
         }
 
+        // generation of the filter snapshot the callback last got, 0 if none yet
+        uint32_t FilterGeneration() const {
+            return _filterGeneration;
+        }
+        void FilterGeneration(const uint32_t generation) {
+            _filterGeneration = generation;
+        }
+
+        // everything until the client sends a SUBSCRIBE
+        bool IsSubscribed(const Request request) const {
+            return ( ( _subscriptions & static_cast<requestsSize>(request) ) != 0 );
+        }
+
+        // ms, 0 when key messages are not batched
+        uint16_t BatchWindow() const {
+            return _batchWindow;
+        }
+        KeyMessageBatch& Batch() {
+            return _batch;
+        }
+
     private:
         MediaSessionSystem& _system;
         IMediaKeySessionCallback *_callback;
         std::string _sessionid;
+        uint32_t _filterGeneration;
+        requestsSize _subscriptions;
+        uint16_t _batchWindow;
+        KeyMessageBatch _batch; // waiting for the window to pass
     };
 
 
@@ -140,6 +182,10 @@ public:
 
     static IMediaKeySession* CreateMediaSessionSystem(const uint8_t *f_pbInitData, const uint32_t f_cbInitData, const std::string& defaultoperatorvault, const std::string& licensepath);
     static void DestroyMediaSessionSystem(IMediaKeySession* session);
+    static void EnableCorrelation(const bool enabled);
+    static void EnableEmmPrefilter(const bool enabled);
+
+    SectionResult IngestSection(const TNvSession descramblingSession, const uint8_t data[], const uint32_t length);
 
     // IMediaSessionSystem overrides
     void Run(IMediaKeySessionCallback& callback);
@@ -170,10 +216,12 @@ public:
         uint8_t  *f_pbClearContentOpaque );
 
     // IMediaSessionSystem overrides
-    TNvSession OpenDescramblingSession(IMediaSessionConnect* session, const uint32_t TSID, const uint16_t Emi) override;
+    TNvSession OpenDescramblingSession(IMediaSessionConnect* session, const uint32_t TSID, const uint16_t Emi, const uint8_t keyids[], const uint32_t keyidcount) override;
     void CloseDescramblingSession(TNvSession session, const uint32_t TSID) override;
     void SetPrmContentMetadata(TNvSession descamblingsession, TNvBuffer* data, TNvStreamType streamtype) override;
     void SetPlatformMetadata(TNvSession descamblingsession, const uint32_t TSID, uint8_t *data, size_t size) override;
+    void DeliverEMM(const uint8_t section[], const uint16_t length) override;
+    void AttachSectionRing(TNvSession descramblingsession, const char ring[], const char doorbell[]) override;
 
 
     const std::string& SessionId() const {
@@ -183,6 +231,12 @@ public:
     virtual void Addref() const override;
     virtual uint32_t Release() const override;
 
+    void GetStatistics(Statistics::System& statistics) const;
+
+    uint32_t ConnectSessionCount() const {
+        return static_cast<uint32_t>(_connectsessions.size());
+    }
+
     bool HasProxyWithSessionID(const char* sessionid) const {
         bool result = false;
         for( auto proxy : _systemproxies ) {
@@ -196,21 +250,137 @@ public:
 
 private:
     using FilterStorage = std::vector<uint8_t>;
-    using ConnectSessionStorage = std::map<TNvSession, IMediaSessionConnect*>;
+    using KeyId = std::array<uint8_t, KeyIdSize>;
+
+    struct ConnectSession {
+        IMediaSessionConnect* Session;
+        std::vector<KeyId> KeyIds;
+        uint16_t LastECM; // table_id and version of the last ECM section ingested, NoECM if none
+    };
+
+    static constexpr uint16_t NoECM = 0xFFFF;
+
+    // all connect sessions using a KID and the last status reported for it (nullptr if none yet)
+    struct KeyIdEntry {
+        std::set<TNvSession> Sessions;
+        const char* Status;
+    };
+
+    struct KeyStatusUpdate {
+        KeyStatusUpdate(const TNvSession session, const KeyId* keyid, const char* status)
+            : Session(session)
+            , HasKeyId(keyid != nullptr)
+            , Id()
+            , Status(status) {
+            if( keyid != nullptr ) {
+                Id = *keyid;
+            }
+        }
+
+        TNvSession Session;
+        bool HasKeyId;
+        KeyId Id;
+        const char* Status;
+    };
+
+    // key state of a descrambling session (0 for the system itself), used to not ask for the same key more than once
+    enum class KeyState : uint8_t {
+        ABSENT = 0,
+        REQUESTED,
+        PRESENT,
+        EXPIRING
+    };
+    constexpr static uint8_t KeyStates = 4;
+
+    struct KeyTracking {
+        KeyTracking()
+            : State(KeyState::ABSENT)
+            , Reason()
+            , Requested(0) {
+        }
+
+        KeyState State;
+        TNvKeyStatus Reason; // the key status of the needkey that triggered the last request
+        uint64_t Requested;
+    };
+
+    using ConnectSessionStorage = std::map<TNvSession, ConnectSession>;
+    using SectionRingStorage = std::map<const void*, std::unique_ptr<SectionRing>>; // by connect session, or the system itself
+    using KeyStateStorage = std::map<TNvSession, KeyTracking>;
+    using KeyIdIndex = std::map<KeyId, KeyIdEntry>;
+    using KeyStatusUpdates = std::vector<KeyStatusUpdate>;
     using DeliverySessionsStorage = std::set<TNvSession>;
+    using PendingResponseStorage = std::deque<TNvSession>;
+    using RequestIdStorage = std::map<uint32_t, TNvSession>; // request ID -> delivery session the message was exported from
+    using DeliveryRequestStorage = std::map<TNvSession, std::set<TNvSession>>; // delivery session -> descrambling sessions waiting for its result
     using MediaSessionSystemProxyStorage = std::forward_list<MediaSessionSystemProxy*>;
 
+    struct Counters {
+        Counters()
+            : EMMDeliveries(0)
+            , NeedKeyEvents(0)
+            , RenewalEvents(0)
+            , KeyMessagesPosted(0)
+            , KeyMessagesDispatched(0)
+            , KeyRequestsSuppressed(0)
+            , DeliveryPoolExhausted(0)
+            , StaleResponses(0)
+            , FilterDeltas(0)
+            , EMMDuplicates(0)
+            , EMMsDropped(0)
+            , EMMsThrottled(0)
+            , SectionsIngested(0)
+            , SectionsUnchanged(0)
+            , SectionErrors(0)
+            , KeyMessagesBatched(0)
+            , EMMsRejected(0) {
+            for( uint8_t from = 0; from < KeyStates; ++from ) {
+                for( uint8_t to = 0; to < KeyStates; ++to ) {
+                    KeyTransitions[from][to].store(0, std::memory_order_relaxed);
+                }
+            }
+        }
+
+        std::atomic<uint32_t> EMMDeliveries;
+        std::atomic<uint32_t> NeedKeyEvents;
+        std::atomic<uint32_t> RenewalEvents;
+        std::atomic<uint32_t> KeyMessagesPosted;
+        std::atomic<uint32_t> KeyMessagesDispatched;
+        std::atomic<uint32_t> KeyRequestsSuppressed;
+        std::atomic<uint32_t> DeliveryPoolExhausted;
+        std::atomic<uint32_t> StaleResponses;
+        std::atomic<uint32_t> FilterDeltas;
+        std::atomic<uint32_t> EMMDuplicates;
+        std::atomic<uint32_t> EMMsDropped;
+        std::atomic<uint32_t> EMMsThrottled;
+        std::atomic<uint32_t> SectionsIngested;
+        std::atomic<uint32_t> SectionsUnchanged;
+        std::atomic<uint32_t> SectionErrors;
+        std::atomic<uint32_t> KeyMessagesBatched;
+        std::atomic<uint32_t> EMMsRejected;
+        std::atomic<uint32_t> KeyTransitions[KeyStates][KeyStates];
+    };
+
     static bool OnRenewal(TNvSession appSession);
     static bool OnNeedKey(TNvSession appSession, TNvSession descramblingSession, TNvKeyStatus keyStatus,  TNvBuffer* content, TNvStreamType streamtype);
     static bool OnDeliveryCompleted(TNvSession deliverySession);
 
     void OnNeedKey(const TNvSession descramblingSession, const TNvKeyStatus keyStatus, const TNvBuffer* content, const TNvStreamType streamtype);
     void OnRenewal();
-   // void OnDeliverySessionCompleted(const TNvSession deliverySession); //not needed at the moment, cleanup later
+    void OnDeliverySessionCompleted(const TNvSession deliverySession, const bool succeeded);
     void GetFilters(FilterStorage& filters);
+    bool RefreshFilters();
+    void NotifyFilters(MediaSessionSystemProxy& proxy, const DataBuffer& snapshot, const DataBuffer& delta, const uint32_t generation);
     void GetProvisionChallenge(DataBuffer& buffer);
     void InitializeWhenProvisoned();
     void HandleFilters(IMediaKeySessionCallback* callback);
+    void PostFiltersJob(IMediaKeySessionCallback* callback);
+    void ProcessEMM(const uint8_t section[], const uint16_t length);
+    void QueueEMM(const uint8_t section[], const uint16_t length);
+    void ProcessEMMs();
+    void PostEMMJob(const uint32_t delay);
+    bool ZapInProgress(const uint64_t now) const;
+    std::unique_ptr<SectionRing> DetachSectionRing(const void* owner);
 
     void CloseProvisioningSession();
 
@@ -226,17 +396,21 @@ private:
         return static_cast<Request>(static_cast<requestsSize>(_requests) & static_cast<requestsSize>(request)) == request;
     }
 
-   // inline TNvSession OpenKeyNeedSession(); //not needed at the moment
+    TNvSession AcquireDeliverySession();
+    void RecycleDeliverySession(const TNvSession session);
+    uint32_t AssignRequestId(const TNvSession deliverysession);
+    void ForgetRequestIds(const TNvSession deliverysession);
+    void ReleaseDeliveryRequests(const TNvSession descramblingSession);
     inline void OpenRenewalSession();
 
     inline TNvSession OpenDeliverySession();
-  //  inline void CloseDeliverySession(const TNvSession session); // not needed at the moment
+    void CloseDeliverySession(const TNvSession session);
 
     void CreateRenewalExchange(DataBuffer& buffer);
 
     static MediaSessionSystem* MediaSessionSystemFromAsmHandle(const TNvSession appsession) {
         MediaSessionSystem* system( nullptr );
-        uint32_t result = nvAsmGetContext(appsession, reinterpret_cast<TNvHandle*>(&system));
+        uint32_t result = PRM_CALL("nvAsmGetContext", nvAsmGetContext(appsession, reinterpret_cast<TNvHandle*>(&system)));
         REPORT_ASM(result, "nvAsmGetContext");
         return ( result == NV_ASM_SUCCESS ? system : nullptr );
     }
@@ -261,6 +435,18 @@ private:
 
     void PostProvisionJob();
     void PostRenewalJob();
+    void ScheduleRenewalJob(const uint8_t deferred = 0);
+    void CancelRenewalJob();
+    void NotifyProxies(const DataBuffer& data, const char* type, const Request request);
+    MediaSessionSystemProxy* Responder(const Request request) const;
+    void ResponderGone(const MediaSessionSystemProxy* proxy);
+    void SendKeyMessage(MediaSessionSystemProxy& proxy, const uint8_t data[], const uint32_t length, const char type[]);
+    void FlushKeyMessages(MediaSessionSystemProxy& proxy);
+    void PostFlushJob(IMediaKeySessionCallback* callback, const uint32_t delay);
+    void KeyStatusChanged(const TNvSession descramblingSession, const char* status);
+    void PostKeyStatusJob(KeyStatusUpdates&& updates);
+    bool KeyRequestNeeded(const TNvSession descramblingSession, const TNvKeyStatus keyStatus);
+    void ChangeKeyState(const TNvSession descramblingSession, const KeyState state);
 
     constexpr static const char* const g_NAGRASessionIDPrefix = { "NSSID:" };
 
@@ -268,13 +454,33 @@ private:
     Request _requests;
     TNvSession _applicationSession;
     TNvSession  _inbandSession;
- //   DeliverySessionsStorage _needKeySessions; At the moment is seems that one delivery session is a correct implementation. As we have not been able to fully test yet if this works in all usage patterns we leave the code to have more in place for now
-    TNvSession  _renewalSession; // if we do not need the _needKeySessions we should rename this deliverySession
+    DeliverySessionsStorage _idledeliverysessions; // completed needkey delivery sessions, ready for reuse
+    PendingResponseStorage _pendingresponses; // needkey delivery sessions waiting for a response (each once), in the order the key messages were exported
+    RequestIdStorage _requestids; // exchanges a response is still accepted for
+    uint32_t _nextRequestId;
+    TNvSession  _renewalSession; // renewal exchanges, also used for needkeys when all delivery sessions are in use
     TNvSession  _provioningSession;
+    DataBuffer _provisionChallenge; // exported from _provioningSession, sent again when its responder goes away
     ConnectSessionStorage _connectsessions;
+    KeyIdIndex _keyids;
+    DeliveryRequestStorage _deliveryrequests;
+    KeyStateStorage _keystates;
     std::string _licensepath;
     MediaSessionSystemProxyStorage _systemproxies;
+    FilterStorage _filters; // last snapshot from the PRM
+    DataBuffer _filterDelta; // from the previous snapshot to this one, empty for the first
+    uint32_t _filterGeneration; // of _filters, 0 if not read yet
+    EmmPrefilter _emmprefilter; // compiled from _filters
+    EmmHistory _emmhistory; // EMMs the inband session decrypted recently
+    std::deque<DataBuffer> _emmqueue; // EMMs waiting for the CommandHandler, oldest first
+    uint64_t _emmThrottled; // us, since when the EMM queue is held back for a zap, 0 if not
+    uint64_t _emmHeld; // us, when the delayed EMM job is due, 0 if there is none
+    TimerHandle _renewalTimer; // the scheduled renewal, 0 if there is none
+    uint64_t _lastDescramblingOpen; // us
+    SectionRingStorage _sectionrings; // destructing one waits for its thread, so never in lock
+    const MediaSessionSystemProxy* _provisionResponder; // got the provisioning challenge, nullptr if none
     mutable uint32_t _referenceCount;
+    Counters _counters;
     
 };
 
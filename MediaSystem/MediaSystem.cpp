@@ -16,6 +16,7 @@
 
 #include <interfaces/IDRM.h> 
 #include "MediaSessionSystem.h"
+#include "Profiler.h"
 
 #include <core/core.h>
 #include "../Report.h"
@@ -68,15 +69,31 @@ private:
     public:
         Config () 
             : OperatorVaultPath()
-            , LicensePath() {
+            , LicensePath()
+            , Profiling(false)
+            , SlowCall(0)
+            , Correlation(false)
+            , EMMPrefilter(false) {
             Add("operatorvault", &OperatorVaultPath);
             Add("licensepath", &LicensePath);
+            Add("profiling", &Profiling);
+            Add("slowcall", &SlowCall);
+            Add("correlation", &Correlation);
+            Add("emmprefilter", &EMMPrefilter);
         }
         Config (const Config& copy) 
             : OperatorVaultPath(copy.OperatorVaultPath)
-            , LicensePath(copy.LicensePath) {
+            , LicensePath(copy.LicensePath)
+            , Profiling(copy.Profiling)
+            , SlowCall(copy.SlowCall)
+            , Correlation(copy.Correlation)
+            , EMMPrefilter(copy.EMMPrefilter) {
             Add("operatorvault", &OperatorVaultPath);
             Add("licensepath", &LicensePath);
+            Add("profiling", &Profiling);
+            Add("slowcall", &SlowCall);
+            Add("correlation", &Correlation);
+            Add("emmprefilter", &EMMPrefilter);
         }
         virtual ~Config() {
         }
@@ -84,6 +101,10 @@ private:
     public:
         Thunder::Core::JSON::String OperatorVaultPath;
         Thunder::Core::JSON::String LicensePath;
+        Thunder::Core::JSON::Boolean Profiling; // record the duration of every PRM call
+        Thunder::Core::JSON::DecUInt32 SlowCall; // us, report PRM calls taking longer than this (only when profiling)
+        Thunder::Core::JSON::Boolean Correlation; // add the request ID to the KEYNEEDED and RENEWAL key message types
+        Thunder::Core::JSON::Boolean EMMPrefilter; // drop EMMs that match none of the PRM filters before they are queued, see EmmPrefilter.h
     };
 
     NagraSystem& operator= (const NagraSystem&) = delete;
@@ -106,6 +127,9 @@ public:
         config.FromString(configline);
         _operatorvaultpath = config.OperatorVaultPath.Value();
         _licensepath = config.LicensePath.Value();
+        Profiler::Configure(config.Profiling.Value(), config.SlowCall.Value());
+        MediaSessionSystem::EnableCorrelation(config.Correlation.Value());
+        MediaSessionSystem::EnableEmmPrefilter(config.EMMPrefilter.Value());
     }
 
     CDMi_RESULT CreateMediaKeySession(
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Profiler.h"
+
+#include "../Report.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+    // note: constant initialized, PRM calls are also done from static constructors
+    std::atomic<bool> g_enabled(false);
+    std::atomic<uint32_t> g_slowcall(0);
+    std::atomic<const CDMi::Profiler::CallLatency*> g_latencies(nullptr);
+
+}
+
+namespace CDMi {
+namespace Profiler {
+
+void Configure(const bool enabled, const uint32_t slowcall) {
+    g_slowcall.store(slowcall, std::memory_order_relaxed);
+    g_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+bool IsEnabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Histogram::Histogram()
+    : _count(0)
+    , _total(0)
+    , _max(0) {
+
+    for( std::atomic<uint32_t>& bucket : _buckets ) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+void Histogram::Record(const uint64_t duration) {
+    const uint32_t value = static_cast<uint32_t>(std::min(duration, static_cast<uint64_t>(~static_cast<uint32_t>(0))));
+
+    uint8_t index = 0;
+    while( ( index < ( Buckets - 1 ) ) && ( ( value >> ( index + 1 ) ) != 0 ) ) {
+        ++index;
+    }
+
+    _buckets[index].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+    _total.fetch_add(duration, std::memory_order_relaxed);
+
+    uint32_t max = _max.load(std::memory_order_relaxed);
+    while( ( value > max ) && ( _max.compare_exchange_weak(max, value, std::memory_order_relaxed) == false ) ) {
+    }
+}
+
+CallLatency::CallLatency(const char* name)
+    : Histogram()
+    , _name(name)
+    , _next(g_latencies.load(std::memory_order_relaxed))
+    , _slow(0) {
+
+    while( g_latencies.compare_exchange_weak(_next, this, std::memory_order_release, std::memory_order_relaxed) == false ) {
+    }
+}
+
+/* static */ const CallLatency* CallLatency::First() {
+    return g_latencies.load(std::memory_order_acquire);
+}
+
+void CallLatency::Record(const uint64_t duration) {
+    Histogram::Record(duration);
+
+    const uint32_t slowcall = g_slowcall.load(std::memory_order_relaxed);
+    if( ( slowcall != 0 ) && ( duration >= slowcall ) ) {
+        _slow.fetch_add(1, std::memory_order_relaxed);
+        REPORT_LOG(CDMi::Log::LEVEL_WARNING, "Call to %s was slow, took %u us", _name, static_cast<uint32_t>(duration));
+    }
+}
+
+} // namespace Profiler
+} // namespace CDMi
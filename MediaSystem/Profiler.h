@@ -0,0 +1,126 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <atomic>
+
+namespace CDMi {
+namespace Profiler {
+
+    // bucket n counts the durations of [2^n, 2^(n+1)) us, bucket 0 also the ones below 1 us, the last one everything above
+    constexpr uint8_t Buckets = 24;
+
+    // enabled by the "profiling" config option, slowcall (us) is the duration above which a call is reported as slow (0 disables that)
+    void Configure(const bool enabled, const uint32_t slowcall);
+    bool IsEnabled();
+    uint64_t Now();
+
+    class Histogram {
+    public:
+        Histogram(const Histogram&) = delete;
+        Histogram& operator=(const Histogram&) = delete;
+
+        Histogram();
+        ~Histogram() = default;
+
+        void Record(const uint64_t duration);
+
+        uint32_t Count() const {
+            return _count.load(std::memory_order_relaxed);
+        }
+        uint64_t Total() const {
+            return _total.load(std::memory_order_relaxed);
+        }
+        uint32_t Max() const {
+            return _max.load(std::memory_order_relaxed);
+        }
+        uint32_t Bucket(const uint8_t index) const {
+            ASSERT(index < Buckets);
+            return _buckets[index].load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<uint32_t> _count;
+        std::atomic<uint64_t> _total;
+        std::atomic<uint32_t> _max;
+        std::atomic<uint32_t> _buckets[Buckets];
+    };
+
+    // One instance per PRM_CALL site (a function static)
+    class CallLatency : public Histogram {
+    public:
+        class Scope {
+        public:
+            Scope(const Scope&) = delete;
+            Scope& operator=(const Scope&) = delete;
+
+            explicit Scope(CallLatency& latency)
+                : _latency(latency)
+                , _start(IsEnabled() == true ? Now() : 0) {
+            }
+            ~Scope() {
+                if( _start != 0 ) {
+                    _latency.Record(Now() - _start);
+                }
+            }
+
+        private:
+            CallLatency& _latency;
+            const uint64_t _start;
+        };
+
+    public:
+        CallLatency(const CallLatency&) = delete;
+        CallLatency& operator=(const CallLatency&) = delete;
+
+        explicit CallLatency(const char* name);
+        ~CallLatency() = default;
+
+        void Record(const uint64_t duration);
+
+        const char* Name() const {
+            return _name;
+        }
+        uint32_t Slow() const {
+            return _slow.load(std::memory_order_relaxed);
+        }
+
+        // all call sites that were executed at least once, note there can be more than one site for the same call name
+        static const CallLatency* First();
+
+        const CallLatency* Next() const {
+            return _next;
+        }
+
+    private:
+        const char* _name;
+        const CallLatency* _next;
+        std::atomic<uint32_t> _slow;
+    };
+
+} // namespace Profiler
+} // namespace CDMi
+
+// wraps a call into the Nagra PRM library, when profiling is enabled its wall clock duration is recorded under callname
+#define PRM_CALL(callname, call) \
+    ([&]() -> decltype(call) { \
+        static CDMi::Profiler::CallLatency latency(callname); \
+        CDMi::Profiler::CallLatency::Scope scope(latency); \
+        return call; \
+    }())
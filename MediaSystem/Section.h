@@ -0,0 +1,108 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+namespace CDMi {
+
+    // A raw MPEG-2 private section as it comes from the demux, nothing is copied.
+    // Short sections (section_syntax_indicator 0, like most ECMs and EMMs) have no version and no CRC.
+    class Section {
+    public:
+        static constexpr uint8_t HeaderSize = 3;
+        static constexpr uint8_t ExtendedHeaderSize = 8;
+        static constexpr uint8_t CRCSize = 4;
+
+        Section(const Section&) = delete;
+        Section& operator=(const Section&) = delete;
+
+        // length: what is available, anything after the section (stuffing) is ignored
+        Section(const uint8_t data[], const uint32_t length)
+            : _data(data)
+            , _length(0) {
+            if( length >= HeaderSize ) {
+                const uint32_t sectionlength = HeaderSize + ( ( ( data[1] & 0x0F ) << 8 ) | data[2] );
+                if( ( sectionlength <= length ) && ( ( HasSyntax() == false ) || ( sectionlength >= ( ExtendedHeaderSize + CRCSize ) ) ) ) {
+                    _length = static_cast<uint16_t>(sectionlength);
+                }
+            }
+        }
+        ~Section() = default;
+
+        // MPEG-2 CRC32 (polynomial 0x04C11DB7, no reflection), a byte at a time from a table
+        static uint32_t CRC32(const uint8_t data[], const uint32_t length) {
+            static const struct Table {
+                Table() {
+                    for( uint32_t index = 0; index < 256; ++index ) {
+                        uint32_t crc = ( index << 24 );
+                        for( uint8_t bit = 0; bit < 8; ++bit ) {
+                            crc = ( ( crc & 0x80000000 ) != 0 ? ( ( crc << 1 ) ^ 0x04C11DB7 ) : ( crc << 1 ) );
+                        }
+                        Entries[index] = crc;
+                    }
+                }
+                uint32_t Entries[256];
+            } table;
+
+            uint32_t crc = 0xFFFFFFFF;
+            for( uint32_t index = 0; index < length; ++index ) {
+                crc = ( crc << 8 ) ^ table.Entries[( ( crc >> 24 ) ^ data[index] ) & 0xFF];
+            }
+            return crc;
+        }
+
+        bool IsValid() const {
+            return ( _length != 0 );
+        }
+        bool HasSyntax() const {
+            return ( ( _data[1] & 0x80 ) != 0 );
+        }
+        // a short section has no CRC, it is always fine
+        bool IsCRCValid() const {
+            return ( ( HasSyntax() == false ) || ( CRC32(_data, _length) == 0 ) ); // the CRC over the section including its CRC is 0
+        }
+
+        uint8_t TableId() const {
+            return _data[0];
+        }
+        // only for sections with syntax
+        uint8_t Version() const {
+            return ( ( _data[5] >> 1 ) & 0x1F );
+        }
+
+        bool IsECM() const {
+            return ( ( TableId() & 0xFE ) == 0x80 );
+        }
+        bool IsEMM() const {
+            return ( ( TableId() >= 0x82 ) && ( TableId() <= 0x8F ) );
+        }
+
+        const uint8_t* Data() const {
+            return _data;
+        }
+        // of the complete section, 0 if it is not valid
+        uint16_t Length() const {
+            return _length;
+        }
+
+    private:
+        const uint8_t* _data;
+        uint16_t _length;
+    };
+
+} // namespace CDMi
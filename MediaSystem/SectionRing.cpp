@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "SectionRing.h"
+
+#include "../Report.h"
+
+namespace CDMi {
+
+SectionRing::SectionRing(const string& ring, const string& doorbell, Ingest&& ingest)
+    : Thunder::Core::Thread(Thunder::Core::Thread::DefaultStackSize(), "Nagra DRM Section Ring")
+    , _ring(ring, Thunder::Core::File::USER_READ | Thunder::Core::File::USER_WRITE | Thunder::Core::File::SHAREABLE, 0, false) // size 0: the producer created it
+    , _doorbell(doorbell.c_str())
+    , _ingest(std::move(ingest))
+    , _sections(0) {
+
+    if( _ring.IsValid() == true ) {
+        REPORT_EXT("Section ring %s attached", ring.c_str());
+        Drain(); // whatever the producer wrote before we were there
+        Run();
+    }
+    else {
+        REPORT_EXT("Section ring %s could not be opened", ring.c_str());
+    }
+}
+
+SectionRing::~SectionRing() {
+    Stop();
+    _doorbell.Relinquish(); // wakes up the Wait
+    Wait(Thread::STOPPED | Thread::BLOCKED, Thunder::Core::infinite);
+}
+
+uint32_t SectionRing::Worker() {
+    if( _doorbell.Wait(Thunder::Core::infinite) == Thunder::Core::ERROR_NONE ) {
+        _doorbell.Acknowledge();
+        Drain();
+    }
+    else {
+        Block(); // relinquished
+    }
+    return 0;
+}
+
+void SectionRing::Drain() {
+    uint8_t header[2];
+
+    while( _ring.Used() >= sizeof(header) ) {
+        _ring.Read(header, sizeof(header));
+        const uint16_t length = ( ( header[0] << 8 ) | header[1] );
+
+        if( ( length > MaxSectionSize ) || ( _ring.Used() < length ) ) {
+            // the producer writes a section in one go, so this is not a section in progress but a ring that is out of sync
+            REPORT_EXT("Section ring out of sync (length %u), flushed", length);
+            _ring.Flush();
+            break;
+        }
+
+        _ring.Read(_section, length);
+        _sections.fetch_add(1, std::memory_order_relaxed);
+        _ingest(_section, length);
+    }
+}
+
+} // namespace CDMi
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <atomic>
+#include <functional>
+
+namespace CDMi {
+
+    // Consumer side of a shared memory ring (Thunder CyclicBuffer, created by the producer) the demux writes ECM and EMM sections into,
+    // so they do not each need an Update. A section is written in one go as a big endian uint16 length followed by the section,
+    // after writing the producer rings the doorbell. The ring is drained on its own thread, every section is handed to ingest.
+    class SectionRing : virtual public Thunder::Core::Thread {
+    public:
+        using Ingest = std::function<void(const uint8_t section[], const uint16_t length)>;
+
+        static constexpr uint16_t MaxSectionSize = 4096; // of a private section, including the header
+
+        SectionRing(const SectionRing&) = delete;
+        SectionRing& operator=(const SectionRing&) = delete;
+
+        // ring: file name of the CyclicBuffer, doorbell: where the producer rings
+        SectionRing(const string& ring, const string& doorbell, Ingest&& ingest);
+        ~SectionRing() override;
+
+        bool IsValid() const {
+            return ( _ring.IsValid() == true );
+        }
+
+        uint32_t Sections() const {
+            return _sections.load(std::memory_order_relaxed);
+        }
+
+    protected:
+        uint32_t Worker() override;
+
+    private:
+        void Drain();
+
+    private:
+        Thunder::Core::CyclicBuffer _ring;
+        Thunder::Core::DoorBell _doorbell;
+        Ingest _ingest;
+        std::atomic<uint32_t> _sections;
+        uint8_t _section[MaxSectionSize];
+    };
+
+} // namespace CDMi
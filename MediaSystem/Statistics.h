@@ -0,0 +1,412 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+// JSON layout of the data returned by GetMediaSessionSystemStatistics()
+
+namespace CDMi {
+namespace Statistics {
+
+    class ConnectSession : public Thunder::Core::JSON::Container {
+    private:
+        ConnectSession& operator= (const ConnectSession&);
+
+    public:
+        ConnectSession()
+            : DescramblingSession()
+            , ECMDeliveries()
+            , PlatformDeliveries()
+            , EMMDeliveries() {
+            Init();
+        }
+        ConnectSession(const ConnectSession& copy)
+            : DescramblingSession(copy.DescramblingSession)
+            , ECMDeliveries(copy.ECMDeliveries)
+            , PlatformDeliveries(copy.PlatformDeliveries)
+            , EMMDeliveries(copy.EMMDeliveries) {
+            Init();
+        }
+        ~ConnectSession() override = default;
+
+    private:
+        void Init() {
+            Add(_T("descramblingsession"), &DescramblingSession);
+            Add(_T("ecmdeliveries"), &ECMDeliveries);
+            Add(_T("platformdeliveries"), &PlatformDeliveries);
+            Add(_T("emmdeliveries"), &EMMDeliveries);
+        }
+
+    public:
+        Thunder::Core::JSON::DecUInt32 DescramblingSession;
+        Thunder::Core::JSON::DecUInt32 ECMDeliveries;
+        Thunder::Core::JSON::DecUInt32 PlatformDeliveries;
+        Thunder::Core::JSON::DecUInt32 EMMDeliveries; // forwarded to the system
+    };
+
+    class KeyTransition : public Thunder::Core::JSON::Container {
+    private:
+        KeyTransition& operator= (const KeyTransition&);
+
+    public:
+        KeyTransition()
+            : From()
+            , To()
+            , Count() {
+            Init();
+        }
+        KeyTransition(const KeyTransition& copy)
+            : From(copy.From)
+            , To(copy.To)
+            , Count(copy.Count) {
+            Init();
+        }
+        ~KeyTransition() override = default;
+
+    private:
+        void Init() {
+            Add(_T("from"), &From);
+            Add(_T("to"), &To);
+            Add(_T("count"), &Count);
+        }
+
+    public:
+        Thunder::Core::JSON::String From;
+        Thunder::Core::JSON::String To;
+        Thunder::Core::JSON::DecUInt32 Count;
+    };
+
+    class System : public Thunder::Core::JSON::Container {
+    private:
+        System& operator= (const System&);
+
+    public:
+        System()
+            : SessionId()
+            , Proxies()
+            , EMMDeliveries()
+            , NeedKeyEvents()
+            , RenewalEvents()
+            , KeyMessagesPosted()
+            , KeyMessagesDispatched()
+            , KeyRequestsSuppressed()
+            , KeyTransitions()
+            , DeliverySessions()
+            , DeliveryPoolExhausted()
+            , StaleResponses()
+            , FilterGeneration()
+            , FilterDeltas()
+            , EMMDuplicates()
+            , EMMQueue()
+            , EMMsDropped()
+            , EMMsThrottled()
+            , SectionsIngested()
+            , SectionsUnchanged()
+            , SectionErrors()
+            , SectionRings()
+            , KeyMessagesBatched()
+            , EMMsRejected()
+            , ConnectSessions() {
+            Init();
+        }
+        System(const System& copy)
+            : SessionId(copy.SessionId)
+            , Proxies(copy.Proxies)
+            , EMMDeliveries(copy.EMMDeliveries)
+            , NeedKeyEvents(copy.NeedKeyEvents)
+            , RenewalEvents(copy.RenewalEvents)
+            , KeyMessagesPosted(copy.KeyMessagesPosted)
+            , KeyMessagesDispatched(copy.KeyMessagesDispatched)
+            , KeyRequestsSuppressed(copy.KeyRequestsSuppressed)
+            , KeyTransitions(copy.KeyTransitions)
+            , DeliverySessions(copy.DeliverySessions)
+            , DeliveryPoolExhausted(copy.DeliveryPoolExhausted)
+            , StaleResponses(copy.StaleResponses)
+            , FilterGeneration(copy.FilterGeneration)
+            , FilterDeltas(copy.FilterDeltas)
+            , EMMDuplicates(copy.EMMDuplicates)
+            , EMMQueue(copy.EMMQueue)
+            , EMMsDropped(copy.EMMsDropped)
+            , EMMsThrottled(copy.EMMsThrottled)
+            , SectionsIngested(copy.SectionsIngested)
+            , SectionsUnchanged(copy.SectionsUnchanged)
+            , SectionErrors(copy.SectionErrors)
+            , SectionRings(copy.SectionRings)
+            , KeyMessagesBatched(copy.KeyMessagesBatched)
+            , EMMsRejected(copy.EMMsRejected)
+            , ConnectSessions(copy.ConnectSessions) {
+            Init();
+        }
+        ~System() override = default;
+
+    private:
+        void Init() {
+            Add(_T("sessionid"), &SessionId);
+            Add(_T("proxies"), &Proxies);
+            Add(_T("emmdeliveries"), &EMMDeliveries);
+            Add(_T("needkeyevents"), &NeedKeyEvents);
+            Add(_T("renewalevents"), &RenewalEvents);
+            Add(_T("keymessagesposted"), &KeyMessagesPosted);
+            Add(_T("keymessagesdispatched"), &KeyMessagesDispatched);
+            Add(_T("keyrequestssuppressed"), &KeyRequestsSuppressed);
+            Add(_T("keytransitions"), &KeyTransitions);
+            Add(_T("deliverysessions"), &DeliverySessions);
+            Add(_T("deliverypoolexhausted"), &DeliveryPoolExhausted);
+            Add(_T("staleresponses"), &StaleResponses);
+            Add(_T("filtergeneration"), &FilterGeneration);
+            Add(_T("filterdeltas"), &FilterDeltas);
+            Add(_T("emmduplicates"), &EMMDuplicates);
+            Add(_T("emmqueue"), &EMMQueue);
+            Add(_T("emmsdropped"), &EMMsDropped);
+            Add(_T("emmsthrottled"), &EMMsThrottled);
+            Add(_T("sectionsingested"), &SectionsIngested);
+            Add(_T("sectionsunchanged"), &SectionsUnchanged);
+            Add(_T("sectionerrors"), &SectionErrors);
+            Add(_T("sectionrings"), &SectionRings);
+            Add(_T("keymessagesbatched"), &KeyMessagesBatched);
+            Add(_T("emmsrejected"), &EMMsRejected);
+            Add(_T("connectsessions"), &ConnectSessions);
+        }
+
+    public:
+        Thunder::Core::JSON::String SessionId;
+        Thunder::Core::JSON::DecUInt32 Proxies;
+        Thunder::Core::JSON::DecUInt32 EMMDeliveries;
+        Thunder::Core::JSON::DecUInt32 NeedKeyEvents;
+        Thunder::Core::JSON::DecUInt32 RenewalEvents;
+        Thunder::Core::JSON::DecUInt32 KeyMessagesPosted;
+        Thunder::Core::JSON::DecUInt32 KeyMessagesDispatched;
+        Thunder::Core::JSON::DecUInt32 KeyRequestsSuppressed;
+        Thunder::Core::JSON::ArrayType<KeyTransition> KeyTransitions;
+        Thunder::Core::JSON::DecUInt32 DeliverySessions;
+        Thunder::Core::JSON::DecUInt32 DeliveryPoolExhausted;
+        Thunder::Core::JSON::DecUInt32 StaleResponses;
+        Thunder::Core::JSON::DecUInt32 FilterGeneration;
+        Thunder::Core::JSON::DecUInt32 FilterDeltas; // FILTERSDELTA messages sent instead of the full set
+        Thunder::Core::JSON::DecUInt32 EMMDuplicates; // decrypted within the history window already, the hit ratio is this against emmdeliveries
+        Thunder::Core::JSON::DecUInt32 EMMQueue; // waiting to be decrypted
+        Thunder::Core::JSON::DecUInt32 EMMsDropped; // the EMM queue was full
+        Thunder::Core::JSON::DecUInt32 EMMsThrottled; // times the EMM queue was held back because of a zap
+        Thunder::Core::JSON::DecUInt32 SectionsIngested; // through IngestMediaSessionSystemSection
+        Thunder::Core::JSON::DecUInt32 SectionsUnchanged; // ECMs skipped because table_id and version did not change
+        Thunder::Core::JSON::DecUInt32 SectionErrors; // invalid, CRC errors or not routed
+        Thunder::Core::JSON::DecUInt32 SectionRings; // attached shared memory rings
+        Thunder::Core::JSON::DecUInt32 KeyMessagesBatched; // key messages sent as part of a BATCH message
+        Thunder::Core::JSON::DecUInt32 EMMsRejected; // matched none of the PRM filters, the reject rate is this against emmdeliveries plus the EMM sections ingested
+        Thunder::Core::JSON::ArrayType<ConnectSession> ConnectSessions;
+    };
+
+    // durations in us, only recorded when profiling is enabled
+    class Latency : public Thunder::Core::JSON::Container {
+    private:
+        Latency& operator= (const Latency&);
+
+    public:
+        Latency()
+            : Count()
+            , Total()
+            , Max()
+            , Histogram() {
+            Init();
+        }
+        Latency(const Latency& copy)
+            : Count(copy.Count)
+            , Total(copy.Total)
+            , Max(copy.Max)
+            , Histogram(copy.Histogram) {
+            Init();
+        }
+        ~Latency() override = default;
+
+    private:
+        void Init() {
+            Add(_T("count"), &Count);
+            Add(_T("total"), &Total);
+            Add(_T("max"), &Max);
+            Add(_T("histogram"), &Histogram);
+        }
+
+    public:
+        Thunder::Core::JSON::DecUInt32 Count;
+        Thunder::Core::JSON::DecUInt64 Total;
+        Thunder::Core::JSON::DecUInt32 Max;
+        Thunder::Core::JSON::ArrayType<Thunder::Core::JSON::DecUInt32> Histogram; // see Profiler::Buckets for the bucket boundaries
+    };
+
+    class Call : public Thunder::Core::JSON::Container {
+    private:
+        Call& operator= (const Call&);
+
+    public:
+        Call()
+            : Name()
+            , Errors()
+            , Slow()
+            , Duration() {
+            Init();
+        }
+        Call(const Call& copy)
+            : Name(copy.Name)
+            , Errors(copy.Errors)
+            , Slow(copy.Slow)
+            , Duration(copy.Duration) {
+            Init();
+        }
+        ~Call() override = default;
+
+    private:
+        void Init() {
+            Add(_T("call"), &Name);
+            Add(_T("errors"), &Errors);
+            Add(_T("slow"), &Slow);
+            Add(_T("duration"), &Duration);
+        }
+
+    public:
+        Thunder::Core::JSON::String Name;
+        Thunder::Core::JSON::DecUInt32 Errors;
+        Thunder::Core::JSON::DecUInt32 Slow;
+        Latency Duration;
+    };
+
+    class CommandClass : public Thunder::Core::JSON::Container {
+    private:
+        CommandClass& operator= (const CommandClass&);
+
+    public:
+        CommandClass()
+            : Name()
+            , Depth()
+            , Posted()
+            , Executed()
+            , Promoted()
+            , Waiting() {
+            Init();
+        }
+        CommandClass(const CommandClass& copy)
+            : Name(copy.Name)
+            , Depth(copy.Depth)
+            , Posted(copy.Posted)
+            , Executed(copy.Executed)
+            , Promoted(copy.Promoted)
+            , Waiting(copy.Waiting) {
+            Init();
+        }
+        ~CommandClass() override = default;
+
+    private:
+        void Init() {
+            Add(_T("class"), &Name);
+            Add(_T("depth"), &Depth);
+            Add(_T("posted"), &Posted);
+            Add(_T("executed"), &Executed);
+            Add(_T("promoted"), &Promoted);
+            Add(_T("waiting"), &Waiting);
+        }
+
+    public:
+        Thunder::Core::JSON::String Name;
+        Thunder::Core::JSON::DecUInt32 Depth;
+        Thunder::Core::JSON::DecUInt32 Posted;
+        Thunder::Core::JSON::DecUInt32 Executed;
+        Thunder::Core::JSON::DecUInt32 Promoted; // picked before a higher class to prevent starvation
+        Latency Waiting;
+    };
+
+    class CommandQueue : public Thunder::Core::JSON::Container {
+    private:
+        CommandQueue(const CommandQueue&) = delete;
+        CommandQueue& operator= (const CommandQueue&) = delete;
+
+    public:
+        CommandQueue()
+            : Depth()
+            , MaxDepth()
+            , Posted()
+            , Executed()
+            , Scheduled()
+            , Purged()
+            , Replaced()
+            , Dropped()
+            , Waiting()
+            , Execution()
+            , Classes() {
+            Add(_T("depth"), &Depth);
+            Add(_T("maxdepth"), &MaxDepth);
+            Add(_T("posted"), &Posted);
+            Add(_T("executed"), &Executed);
+            Add(_T("scheduled"), &Scheduled);
+            Add(_T("purged"), &Purged);
+            Add(_T("replaced"), &Replaced);
+            Add(_T("dropped"), &Dropped);
+            Add(_T("waiting"), &Waiting);
+            Add(_T("execution"), &Execution);
+            Add(_T("classes"), &Classes);
+        }
+        ~CommandQueue() override = default;
+
+    public:
+        Thunder::Core::JSON::DecUInt32 Depth;
+        Thunder::Core::JSON::DecUInt32 MaxDepth;
+        Thunder::Core::JSON::DecUInt32 Posted;
+        Thunder::Core::JSON::DecUInt32 Executed;
+        Thunder::Core::JSON::DecUInt32 Scheduled; // delayed jobs waiting for their timer
+        Thunder::Core::JSON::DecUInt32 Purged; // dropped because their proxy or connect session went away
+        Thunder::Core::JSON::DecUInt32 Replaced; // superseded by a newer job of the same kind for the same system
+        Thunder::Core::JSON::DecUInt32 Dropped; // the queue was full
+        Latency Waiting; // from posting a job until the CommandHandler picks it up
+        Latency Execution; // running the job, so mostly the client callbacks
+        Thunder::Core::JSON::ArrayType<CommandClass> Classes;
+    };
+
+    class Data : public Thunder::Core::JSON::Container {
+    private:
+        Data(const Data&) = delete;
+        Data& operator= (const Data&) = delete;
+
+    public:
+        Data()
+            : Systems()
+            , Proxies()
+            , ConnectSessions()
+            , SystemDetails()
+            , Calls()
+            , LockWait()
+            , Commands() {
+            Add(_T("systems"), &Systems);
+            Add(_T("proxies"), &Proxies);
+            Add(_T("connectsessions"), &ConnectSessions);
+            Add(_T("systemdetails"), &SystemDetails);
+            Add(_T("calls"), &Calls);
+            Add(_T("lockwait"), &LockWait);
+            Add(_T("commands"), &Commands);
+        }
+        ~Data() override = default;
+
+    public:
+        Thunder::Core::JSON::DecUInt32 Systems;
+        Thunder::Core::JSON::DecUInt32 Proxies;
+        Thunder::Core::JSON::DecUInt32 ConnectSessions;
+        Thunder::Core::JSON::ArrayType<System> SystemDetails;
+        Thunder::Core::JSON::ArrayType<Call> Calls;
+        Latency LockWait; // waiting for the lock shared by all systems
+        CommandQueue Commands;
+    };
+
+} // namespace Statistics
+} // namespace CDMi
@@ -0,0 +1,243 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace CDMi {
+
+    using TimerHandle = uint32_t; // 0 is never used
+
+    // Hierarchical timer wheel, LEVELS wheels of 2^SLOTBITS slots each, a slot of level n covers 2^(SLOTBITS*n) ticks.
+    // With the defaults and a 10 ms tick that is 640 ms, 41 s and 43 min, later deadlines wait in the last slot and are placed again.
+    // Not thread safe, the owner locks.
+    template <typename ENTRY, uint8_t LEVELS = 3, uint8_t SLOTBITS = 6>
+    class TimerWheel {
+    public:
+        using Handle = TimerHandle;
+
+    private:
+        static constexpr uint32_t Slots = ( 1 << SLOTBITS );
+        static constexpr uint32_t SlotMask = ( Slots - 1 );
+
+        struct Timer {
+            Timer(const uint64_t expiry, ENTRY&& entry)
+                : Expiry(expiry)
+                , Entry(std::move(entry)) {
+            }
+
+            uint64_t Expiry; // tick
+            ENTRY Entry;
+        };
+
+        using TimerStorage = std::map<Handle, Timer>;
+        using Slot = std::vector<Handle>; // can hold handles of cancelled timers, they are skipped
+
+    public:
+        TimerWheel(const TimerWheel&) = delete;
+        TimerWheel& operator=(const TimerWheel&) = delete;
+
+        // resolution: ms per tick, now: ms
+        TimerWheel(const uint32_t resolution, const uint64_t now)
+            : _resolution(resolution)
+            , _current(now / resolution)
+            , _nextHandle(1)
+            , _timers() {
+            ASSERT( resolution != 0 );
+        }
+        ~TimerWheel() = default;
+
+        bool IsEmpty() const {
+            return ( _timers.empty() == true );
+        }
+        uint32_t Size() const {
+            return static_cast<uint32_t>(_timers.size());
+        }
+
+        // the entry is due after at least delay ms
+        Handle Schedule(const uint64_t now, const uint32_t delay, ENTRY&& entry) {
+            if( _timers.empty() == true ) {
+                _current = now / _resolution; // nothing to expire in between, no need to walk all ticks
+            }
+
+            uint64_t expiry = ( now + delay + _resolution - 1 ) / _resolution;
+            if( expiry <= _current ) {
+                expiry = _current + 1;
+            }
+
+            Handle handle = _nextHandle++;
+            while( ( handle == 0 ) || ( _timers.find(handle) != _timers.end() ) ) {
+                handle = _nextHandle++;
+            }
+
+            _timers.emplace(handle, Timer(expiry, std::move(entry)));
+            Place(handle, expiry);
+
+            return handle;
+        }
+
+        // the cancelled entry is handed to action
+        template <typename ACTION>
+        bool Cancel(const Handle handle, ACTION&& action) {
+            auto timer = _timers.find(handle);
+            const bool found = ( timer != _timers.end() );
+            if( found == true ) {
+                ENTRY entry(std::move(timer->second.Entry));
+                _timers.erase(timer);
+                action(std::move(entry));
+            }
+            return found;
+        }
+
+        // first pending entry predicate returns true for, nullptr if none, it can be changed in place
+        template <typename PREDICATE>
+        ENTRY* Find(PREDICATE&& predicate) {
+            ENTRY* result = nullptr;
+            for( std::pair<const Handle, Timer>& timer : _timers ) {
+                if( predicate(static_cast<const ENTRY&>(timer.second.Entry)) == true ) {
+                    result = &(timer.second.Entry);
+                    break;
+                }
+            }
+            return result;
+        }
+
+        // handle of the entry, which must be pending
+        Handle HandleOf(const ENTRY* entry) const {
+            Handle result = 0;
+            for( const std::pair<const Handle, Timer>& timer : _timers ) {
+                if( &(timer.second.Entry) == entry ) {
+                    result = timer.first;
+                    break;
+                }
+            }
+            ASSERT( result != 0 );
+            return result;
+        }
+
+        // cancels every entry predicate returns true for, they are handed to action
+        template <typename PREDICATE, typename ACTION>
+        void Purge(PREDICATE&& predicate, ACTION&& action) {
+            auto timer = _timers.begin();
+            while( timer != _timers.end() ) {
+                if( predicate(static_cast<const ENTRY&>(timer->second.Entry)) == true ) {
+                    ENTRY entry(std::move(timer->second.Entry));
+                    timer = _timers.erase(timer);
+                    action(std::move(entry));
+                }
+                else {
+                    ++timer;
+                }
+            }
+        }
+
+        // ms until the next tick that has something to do, only valid when not empty
+        uint32_t NextTimeout(const uint64_t now) const {
+            ASSERT( IsEmpty() == false );
+            uint64_t next = ~static_cast<uint64_t>(0);
+            for( const std::pair<const Handle, Timer>& timer : _timers ) {
+                next = std::min(next, timer.second.Expiry);
+            }
+            const uint64_t deadline = next * _resolution;
+            return ( deadline > now ? static_cast<uint32_t>(deadline - now) : 0 );
+        }
+
+        // hands every entry that is due to action, in order of expiry
+        template <typename ACTION>
+        void Advance(const uint64_t now, ACTION&& action) {
+            const uint64_t target = now / _resolution;
+
+            while( ( _current < target ) && ( _timers.empty() == false ) ) {
+                ++_current;
+
+                // move the timers of the higher levels down when we pass their slot boundary, highest level first
+                for( uint8_t level = LEVELS - 1; level > 0; --level ) {
+                    if( ( _current & ( ( static_cast<uint64_t>(1) << ( SLOTBITS * level ) ) - 1 ) ) == 0 ) {
+                        Slot slot;
+                        slot.swap(_wheels[level][SlotIndex(_current, level)]);
+                        for( const Handle handle : slot ) {
+                            auto timer = _timers.find(handle);
+                            if( timer != _timers.end() ) {
+                                Place(handle, timer->second.Expiry);
+                            }
+                        }
+                    }
+                }
+
+                Slot slot;
+                slot.swap(_wheels[0][SlotIndex(_current, 0)]);
+                for( const Handle handle : slot ) {
+                    auto timer = _timers.find(handle);
+                    if( timer != _timers.end() ) {
+                        if( timer->second.Expiry <= _current ) {
+                            ENTRY entry(std::move(timer->second.Entry));
+                            _timers.erase(timer);
+                            action(std::move(entry));
+                        }
+                        else {
+                            Place(handle, timer->second.Expiry); // beyond the range of the wheels when scheduled
+                        }
+                    }
+                }
+            }
+
+            if( _timers.empty() == true ) {
+                _current = std::max(_current, target);
+                for( Slot (&wheel)[Slots] : _wheels ) {
+                    for( Slot& slot : wheel ) {
+                        slot.clear();
+                    }
+                }
+            }
+        }
+
+    private:
+        static uint32_t SlotIndex(const uint64_t tick, const uint8_t level) {
+            return static_cast<uint32_t>(( tick >> ( SLOTBITS * level ) ) & SlotMask);
+        }
+
+        void Place(const Handle handle, const uint64_t expiry) {
+            const uint64_t tick = std::max(expiry, _current);
+            const uint64_t delta = tick - _current;
+
+            uint8_t level = 0;
+            while( ( level < ( LEVELS - 1 ) ) && ( delta >= ( static_cast<uint64_t>(1) << ( SLOTBITS * ( level + 1 ) ) ) ) ) {
+                ++level;
+            }
+
+            if( ( level == ( LEVELS - 1 ) ) && ( delta >= ( static_cast<uint64_t>(1) << ( SLOTBITS * LEVELS ) ) ) ) {
+                // too far away, park it in the last slot we will pass before the wheel wraps
+                _wheels[level][SlotIndex(_current - 1, level)].push_back(handle);
+            }
+            else {
+                _wheels[level][SlotIndex(tick, level)].push_back(handle);
+            }
+        }
+
+    private:
+        const uint32_t _resolution;
+        uint64_t _current; // last tick that was handled
+        Handle _nextHandle;
+        TimerStorage _timers;
+        Slot _wheels[LEVELS][Slots];
+    };
+
+} // namespace CDMi
@@ -20,56 +20,75 @@ namespace {
 
 constexpr uint8_t CommonEncryption[] = { 0x10, 0x77, 0xef, 0xec, 0xc0, 0xb2, 0x4d, 0x02, 0xac, 0xe3, 0x3c, 0x1e, 0x52, 0xe2, 0xfb, 0x4b };
 
+constexpr uint32_t PSSHBoxType = 0x70737368; // "pssh"
+
+uint32_t ReadNumber(const uint8_t data[]) { // all box fields are big endian
+    return ( static_cast<uint32_t>(data[0]) << 24 ) | ( static_cast<uint32_t>(data[1]) << 16 ) | ( static_cast<uint32_t>(data[2]) << 8 ) | static_cast<uint32_t>(data[3]);
 }
 
-int32_t CDMi::FindPSSHHeaderPrivateData(const uint8_t*& data, const uint32_t length) {
+// KID count, KIDs, data length and data filling the remaining box content exactly
+bool IsLegacyLayout(const uint8_t data[], const uint32_t length) {
+    bool result = false;
 
-    Thunder::Core::FrameType<0> frame(const_cast<uint8_t *>(data), length, length);
-    Thunder::Core::FrameType<0>::Reader reader(frame, 0);
+    if( length >= 8 ) {
+        const uint64_t kidsize = static_cast<uint64_t>(ReadNumber(data)) * CDMi::KeyIdSize;
+        if( ( kidsize + 8 ) <= length ) {
+            const uint32_t offset = static_cast<uint32_t>(kidsize) + 4;
+            result = ( ( static_cast<uint64_t>(ReadNumber(&data[offset])) + offset + 4 ) == length );
+        }
+    }
+
+    return result;
+}
+
+// parses the pssh box content following the box size and type
+int32_t ParseBox(const uint8_t data[], const uint32_t length, CDMi::PSSHHeader& header) {
+    constexpr uint32_t fullboxheadersize = 4; // version and flags
 
-    // parse pssh header
     int32_t result = -1; //not enough data
-    uint32_t remainingsize = reader.Number<uint32_t>();
-    ASSERT(remainingsize <= length);
-    ASSERT(remainingsize >= 4); 
-    remainingsize -= 4;
-
-    if( remainingsize >= 4 ) {
-        uint32_t psshident = reader.Number<uint32_t>();
-        result = psshident == 0x70737368 ? result : -2;   
-        remainingsize -= 4;     
-
-        if ( result == -1 && remainingsize >= 4 ) {
-            uint32_t header = reader.Number<uint32_t>();
-            remainingsize -= 4;     
-            constexpr uint16_t buffersize = 16;
-
-            if ( remainingsize >= buffersize ) {
-                uint8_t buffer[buffersize];
-                reader.Copy(buffersize, buffer);
-                result = ( memcmp (buffer, CommonEncryption, buffersize)  == 0 ) ? result : -3;
-                remainingsize -= buffersize;     
-
-                if ( result == -1 && remainingsize >= 4 ) {
-
-                    const uint8_t* buffer = nullptr;
-                    uint32_t KIDcount = reader.LockBuffer<uint32_t>(buffer);
-                    remainingsize -= 4;
-                    
-                    //for now we are not interested in the KIDs
-                    if( remainingsize >= ( KIDcount * 16 ) ) {
-                        reader.UnlockBuffer(KIDcount * 16);    
-                        remainingsize -= ( KIDcount * buffersize );
-
-                        //now we got to the private data we are looking for...
-                        if( remainingsize >= 4 ) {
-                            uint32_t datalength = reader.Number<uint32_t>();
-                            remainingsize -= 4;
-                            ASSERT(datalength == remainingsize);
-                            result = datalength;
-                            data = &data[length-reader.Length()]; // pointer will be invalid of course when datalength is 0 but then should be ignored by callee
-                        }
+
+    if( length >= ( fullboxheadersize + sizeof(CommonEncryption) ) ) {
+        const uint8_t version = data[0];
+        uint32_t offset = fullboxheadersize;
+
+        if( memcmp(&data[offset], CommonEncryption, sizeof(CommonEncryption)) != 0 ) {
+            result = -3;
+        }
+        else {
+            offset += sizeof(CommonEncryption);
+
+            uint32_t kidcount = 0;
+            const uint8_t* kids = nullptr;
+
+            // only v1 and up carry the KIDs, but players have always been sending v0 boxes in the v1 layout (this parser used
+            // to read a KID count whatever the version), so a v0 box that exactly fits that layout is taken as such
+            if( ( version > 0 ) || ( IsLegacyLayout(&data[offset], length - offset) == true ) ) {
+                if( ( length - offset ) >= 4 ) {
+                    kidcount = ReadNumber(&data[offset]);
+                    offset += 4;
+                    if( kidcount <= ( ( length - offset ) / CDMi::KeyIdSize ) ) {
+                        kids = &data[offset];
+                        offset += kidcount * CDMi::KeyIdSize;
                     }
+                    else {
+                        offset = length;
+                    }
+                }
+                else {
+                    offset = length;
+                }
+            }
+
+            if( ( length - offset ) >= 4 ) {
+                const uint32_t datalength = ReadNumber(&data[offset]);
+                offset += 4;
+
+                if( ( datalength <= ( length - offset ) ) && ( datalength <= static_cast<uint32_t>(INT32_MAX) ) ) {
+                    header.KeyIds = kids;
+                    header.KeyIdCount = kidcount;
+                    header.PrivateData = &data[offset]; // pointer will be invalid of course when datalength is 0 but then should be ignored by callee
+                    header.PrivateDataLength = datalength;
+                    result = static_cast<int32_t>(datalength);
                 }
             }
         }
@@ -77,3 +96,70 @@ int32_t CDMi::FindPSSHHeaderPrivateData(const uint8_t*& data, const uint32_t len
 
     return result;
 }
+
+}
+
+int32_t CDMi::ParsePSSHHeader(const uint8_t data[], const uint32_t length, PSSHHeader& header) {
+
+    header.KeyIds = nullptr;
+    header.KeyIdCount = 0;
+    header.PrivateData = nullptr;
+    header.PrivateDataLength = 0;
+
+    int32_t result = -1; //not enough data
+    bool psshfound = false;
+    bool boxfound = false;
+    bool malformed = false;
+    uint32_t offset = 0;
+
+    // multi DRM init data is just a concatenation of boxes, walk them until we find ours
+    while( ( result < 0 ) && ( ( length - offset ) >= 8 ) ) {
+        const uint8_t* box = &data[offset];
+        const uint32_t remaining = length - offset;
+        uint64_t boxsize = ReadNumber(box);
+        uint32_t headersize = 8;
+
+        if( boxsize == 1 ) { // 64 bit size follows the type
+            if( remaining < 16 ) {
+                break;
+            }
+            boxsize = ( static_cast<uint64_t>(ReadNumber(&box[8])) << 32 ) | ReadNumber(&box[12]);
+            headersize = 16;
+        }
+        else if( boxsize == 0 ) { // box extends to the end of the data
+            boxsize = remaining;
+        }
+
+        if( ( boxsize < headersize ) || ( boxsize > remaining ) ) {
+            break;
+        }
+
+        boxfound = true;
+
+        if( ReadNumber(&box[4]) == PSSHBoxType ) {
+            psshfound = true;
+            result = ParseBox(&box[headersize], static_cast<uint32_t>(boxsize) - headersize, header);
+            malformed = malformed || ( result == -1 );
+        }
+
+        offset += static_cast<uint32_t>(boxsize);
+    }
+
+    if( ( result < 0 ) && ( offset == length ) && ( malformed == false ) ) { // all boxes were complete, just not the one we are looking for
+        result = ( psshfound == true ? -3 : ( boxfound == true ? -2 : -1 ) );
+    }
+
+    return result;
+}
+
+int32_t CDMi::FindPSSHHeaderPrivateData(const uint8_t*& data, const uint32_t length) {
+    PSSHHeader header;
+
+    int32_t result = ParsePSSHHeader(data, length, header);
+
+    if( result >= 0 ) {
+        data = header.PrivateData;
+    }
+
+    return result;
+}
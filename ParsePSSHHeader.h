@@ -21,7 +21,22 @@
 #include <core/core.h>
 
 namespace CDMi {
+
+    constexpr uint8_t KeyIdSize = 16;
+
+    // all pointers point into the parsed init data, nothing is copied
+    struct PSSHHeader {
+        const uint8_t* KeyIds; // KeyIdCount consecutive KIDs of KeyIdSize bytes
+        uint32_t KeyIdCount;
+        const uint8_t* PrivateData;
+        uint32_t PrivateDataLength;
+    };
+
+    //input: init data, one or more concatenated (v0 or v1) pssh boxes, output: KIDs and private data of the first box with our system ID.
+    //returns length of private data, or a negative value: -1 not enough data, -2 no pssh box, -3 no box with our system ID
+    int32_t ParsePSSHHeader(const uint8_t data[], const uint32_t length, PSSHHeader& header);
+
     //input: pointer to pssh header data and length of total buffer, output: pointer at position of private data and returns length of private data and negative value in case of invalid pssh header
-    int32_t FindPSSHHeaderPrivateData(const uint8_t*& data, const uint32_t length);  
+    int32_t FindPSSHHeaderPrivateData(const uint8_t*& data, const uint32_t length);
 
 } // namespace CDMi
@@ -18,43 +18,78 @@
 
 #include <core/core.h>
 
+#include "Logger.h"
+
+// Lines above this level are compiled out completely, e.g. build with -DNAGRA_REPORT_LEVEL=0 to only keep the PRM call failures
+#ifndef NAGRA_REPORT_LEVEL
+#ifdef __DEBUG__
+#define NAGRA_REPORT_LEVEL 3
+#else
+#define NAGRA_REPORT_LEVEL 2
+#endif
+#endif
+
+#define REPORT_LOG(level, ...) 							\
+    do { \
+        if( level <= NAGRA_REPORT_LEVEL ) { \
+            CDMi::Log::Write(level, __VA_ARGS__);	\
+        } \
+    } while(0)
+
 #define REPORT_PRM_EXT(success, result, callname, x, ...) 							\
-    if( result != success ) { \
-        fprintf(stderr, "Call to %s failed, result = [%d]" #x "\n", callname, result, __VA_ARGS__);	\
-        fflush(stderr);  \
-    }  
+    do { \
+        if( result != success ) { \
+            static CDMi::Log::CallSite reportsite(callname); \
+            const int32_t suppressed = reportsite.Failed(); \
+            if( suppressed > 0 ) { \
+                REPORT_LOG(CDMi::Log::LEVEL_ERROR, "Call to %s failed %d more times", callname, suppressed);	\
+            } \
+            if( suppressed >= 0 ) { \
+                REPORT_LOG(CDMi::Log::LEVEL_ERROR, "Call to %s failed, result = [%d]" x, callname, result, __VA_ARGS__);	\
+            } \
+        } \
+    } while(0)
 
 #define REPORT_PRM(success, result, callname) 							\
-    if( result != success ) { \
-        fprintf(stderr, "Call to %s failed, result = [%d]\n", callname, result);	\
-        fflush(stderr);  \
-    }  
+    do { \
+        if( result != success ) { \
+            static CDMi::Log::CallSite reportsite(callname); \
+            const int32_t suppressed = reportsite.Failed(); \
+            if( suppressed > 0 ) { \
+                REPORT_LOG(CDMi::Log::LEVEL_ERROR, "Call to %s failed %d more times", callname, suppressed);	\
+            } \
+            if( suppressed >= 0 ) { \
+                REPORT_LOG(CDMi::Log::LEVEL_ERROR, "Call to %s failed, result = [%d]", callname, result);	\
+            } \
+        } \
+    } while(0)
+
+#define REPORT(x) REPORT_LOG(CDMi::Log::LEVEL_INFO, "%s", x)
+
+#define REPORT_EXT(x, ...) REPORT_LOG(CDMi::Log::LEVEL_INFO, x, __VA_ARGS__)
 
-#define REPORT(x) 							\
-    fprintf(stderr, #x "\n");	\
-    fflush(stderr);  
+// for the per ECM/EMM paths, only compiled in for debug builds by default
+#define REPORT_TRACE(x) REPORT_LOG(CDMi::Log::LEVEL_TRACE, "%s", x)
 
-#define REPORT_EXT(x, ...) 							\
-    fprintf(stderr, #x "\n", __VA_ARGS__);	\
-    fflush(stderr);  
+#define REPORT_TRACE_EXT(x, ...) REPORT_LOG(CDMi::Log::LEVEL_TRACE, x, __VA_ARGS__)
 
-#define REPORT_ASM_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_ASM_SUCCESS, callname, x, ...)
+#define REPORT_ASM_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_ASM_SUCCESS, result, callname, x, __VA_ARGS__)
 
 #define REPORT_ASM(result, callname) REPORT_PRM(NV_ASM_SUCCESS, result, callname)
 
-#define REPORT_DSM_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_DSM_SUCCESS, callname, x, ...)
+#define REPORT_DSM_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_DSM_SUCCESS, result, callname, x, __VA_ARGS__)
 
 #define REPORT_DSM(result, callname) REPORT_PRM(NV_DSM_SUCCESS, result, callname)
 
-#define REPORT_LDS_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_LDS_SUCCESS, callname, x, ...)
+#define REPORT_LDS_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_LDS_SUCCESS, result, callname, x, __VA_ARGS__)
 
 #define REPORT_LDS(result, callname) REPORT_PRM(NV_LDS_SUCCESS, result, callname)
 
-#define REPORT_IMSM_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_IMSM_SUCCESS, callname, x, ...)
+#define REPORT_IMSM_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_IMSM_SUCCESS, result, callname, x, __VA_ARGS__)
 
 #define REPORT_IMSM(result, callname) REPORT_PRM(NV_IMSM_SUCCESS, result, callname)
 
-#define REPORT_DPSC_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_DPSC_SUCCESS, callname, x, ...)
+#define REPORT_DPSC_EXT(result, callname, x, ...) REPORT_PRM_EXT(NV_DPSC_SUCCESS, result, callname, x, __VA_ARGS__)
 
 #define REPORT_DPSC(result, callname) REPORT_PRM(NV_DPSC_SUCCESS, result, callname)
 
@@ -0,0 +1,453 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NagraBenchmark <NagraSystem.drm> <NagraConnect.drm> [sessions|lookup|ecm|needkey|emm|contention|all] [iterations]
+//
+// Runs NagraSystem and NagraConnect on the stub PRM library (all latencies 0 unless NAGRA_PRM_STUB_LATENCY is set), so
+// what is measured is the plugins themselves. DRMNagraSystem.drm (what NagraConnect loads) must be on the library path.
+
+#include "../Harness.h"
+#include "../../MediaSystem/Statistics.h"
+
+#include <PRMStub.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+using namespace Thunder;
+using namespace CDMi;
+
+namespace {
+
+    constexpr uint32_t Timeout = 2000; // ms
+    constexpr uint32_t CarouselRate = 2000; // EMMs/s, a busy EMM PID
+
+    class Benchmark {
+    public:
+        Benchmark(const Benchmark&) = delete;
+        Benchmark& operator=(const Benchmark&) = delete;
+
+        Benchmark(const string& system, const string& connect, const uint32_t iterations)
+            : _system(system, _T("{\"correlation\":true}"))
+            , _connect(connect)
+            , _systemPath(system)
+            , _iterations(iterations)
+            , _interface(_system.Function<Test::GetSystemInterface>(_T("GetMediaSessionSystemInterface")))
+            , _statistics(_system.Function<Test::GetStatistics>(_T("GetMediaSessionSystemStatistics")))
+            , _requestId(0)
+            , _keyMessage(false, true)
+            , _keyUsable(false, true)
+            , _callback([this](const string& type, const uint32_t requestid, const uint8_t[], const uint32_t) {
+                  if( type == _T("KEYNEEDED") ) {
+                      _keyMessageTime = Test::Now();
+                      _requestId = requestid;
+                      _keyMessage.SetEvent();
+                  }
+              }
+              , [this](const string& status) {
+                  if( status == _T("KeyUsable") ) {
+                      _keyUsableTime = Test::Now();
+                      _keyUsable.SetEvent();
+                  }
+              })
+            , _keyMessageTime(0)
+            , _keyUsableTime(0) {
+        }
+        ~Benchmark() = default;
+
+        bool IsValid() const {
+            return ( ( _system.IsValid() == true ) && ( _connect.IsValid() == true ) && ( _interface != nullptr ) && ( _statistics != nullptr ) );
+        }
+
+        // creating and destroying system proxies, systems and connect sessions
+        void Sessions() {
+            IMediaKeySession* base = _system.Create(std::vector<uint8_t>()); // keeps the default system alive
+            base->Run(&_callback);
+
+            Measure("system proxy create/destroy", _iterations, [this](const uint32_t) {
+                _system.Destroy(_system.Create(std::vector<uint8_t>()));
+            });
+
+            Measure("system create/destroy", _iterations, [this](const uint32_t iteration) {
+                _system.Destroy(_system.Create(Test::SystemInitData("benchmark-" + std::to_string(iteration))));
+            });
+
+            const std::vector<uint8_t> initdata(Test::ConnectInitData(1, 0, base->GetSessionId()));
+            Measure("connect session create/destroy", _iterations, [this, &initdata](const uint32_t) {
+                IMediaKeySession* session = _connect.Create(initdata);
+                session->Run(&_callback);
+                _connect.Destroy(session);
+            });
+
+            base->Run(nullptr);
+            _system.Destroy(base);
+        }
+
+        // GetMediaSessionSystemInterface() with more systems and proxies, the one looked for is the last one created
+        void Lookup() {
+            static const uint8_t systemcounts[] = { 1, 4, 16 };
+            constexpr uint8_t proxiesPerSystem = 4;
+
+            for( const uint8_t systems : systemcounts ) {
+                std::vector<IMediaKeySession*> proxies;
+                for( uint8_t system = 0; system < systems; ++system ) {
+                    const std::vector<uint8_t> initdata(system == 0 ? std::vector<uint8_t>() : Test::SystemInitData("benchmark-" + std::to_string(system)));
+                    for( uint8_t proxy = 0; proxy < proxiesPerSystem; ++proxy ) {
+                        proxies.push_back(_system.Create(initdata));
+                    }
+                }
+
+                const string last(proxies.back()->GetSessionId());
+                const string label(std::to_string(systems) + " systems, " + std::to_string(systems * proxiesPerSystem) + " proxies");
+
+                Measure(("lookup default, " + label).c_str(), _iterations, [this](const uint32_t) {
+                    _interface(nullptr)->Release();
+                });
+                Measure(("lookup by proxy id, " + label).c_str(), _iterations, [this, &last](const uint32_t) {
+                    _interface(last.c_str())->Release();
+                });
+                Measure(("lookup unknown id, " + label).c_str(), _iterations, [this](const uint32_t) {
+                    IMediaSessionSystem* system = _interface("unknown");
+                    if( system != nullptr ) {
+                        system->Release();
+                    }
+                });
+
+                for( IMediaKeySession* proxy : proxies ) {
+                    _system.Destroy(proxy);
+                }
+            }
+        }
+
+        // the ECMDELIVERY Update, the key is there so it ends in nvDsmSetPrmContentMetadata()
+        void ECM() {
+            constexpr uint8_t sessionCount = 4;
+
+            PRMStubSetNeedKeyOnECM(false);
+
+            IMediaKeySession* base = _system.Create(std::vector<uint8_t>());
+            base->Run(&_callback);
+
+            std::vector<IMediaKeySession*> sessions;
+            for( uint8_t index = 0; index < sessionCount; ++index ) {
+                sessions.push_back(_connect.Create(Test::ConnectInitData(index + 1, 0, base->GetSessionId())));
+            }
+
+            std::vector<std::unique_ptr<Test::Message>> ecms;
+            for( uint8_t index = 0; index < 2; ++index ) {
+                ecms.emplace_back(new Test::Message(Request::ECMDELIVERY));
+                ecms.back()->Buffer(Test::Section(0x80 | index, 184, index));
+            }
+
+            Measure("ECM Update", _iterations, [&sessions, &ecms](const uint32_t iteration) {
+                const Test::Message& ecm(*ecms[( iteration / sessionCount ) & 1]);
+                sessions[iteration % sessionCount]->Update(ecm.Data(), ecm.Length());
+            });
+
+            for( IMediaKeySession* session : sessions ) {
+                _connect.Destroy(session);
+            }
+            base->Run(nullptr);
+            _system.Destroy(base);
+
+            PRMStubSetNeedKeyOnECM(true);
+        }
+
+        // from the PRM raising OnNeedKey to the KEYNEEDED key message on the connect session, and from the license
+        // response to the KeyUsable status on the connect session
+        void NeedKey() {
+            Test::Samples needkey;
+            Test::Samples keyusable;
+
+            IMediaKeySession* base = _system.Create(std::vector<uint8_t>());
+            base->Run(&_callback);
+            IMediaKeySession* session = _connect.Create(Test::ConnectInitData(1, 0, base->GetSessionId()));
+            session->Run(&_callback);
+
+            Test::Message ecm(Request::ECMDELIVERY);
+            ecm.Buffer(Test::Section(0x80, 184, 0));
+
+            PRMStubSetObserver([](const PRMStubEvent event, const TNvSession) {
+                if( event == PRMSTUB_NEEDKEY ) {
+                    g_needKeyTime = Test::Now();
+                }
+            });
+
+            for( uint32_t iteration = 0; iteration < _iterations; ++iteration ) {
+                _keyMessage.ResetEvent();
+                _keyUsable.ResetEvent();
+
+                PRMStubExpireKeys();
+                session->Update(ecm.Data(), ecm.Length());
+
+                if( _keyMessage.Lock(Timeout) != Core::ERROR_NONE ) {
+                    printf("no KEYNEEDED key message within %u ms\n", Timeout);
+                    break;
+                }
+                needkey.Add(_keyMessageTime - g_needKeyTime);
+
+                Test::Message response(Request::KEYNEEDED, _requestId);
+                response.Text(_T("license"));
+                const uint64_t responded = Test::Now();
+                base->Update(response.Data(), response.Length());
+
+                if( _keyUsable.Lock(Timeout) != Core::ERROR_NONE ) {
+                    printf("no KeyUsable status within %u ms\n", Timeout);
+                    break;
+                }
+                keyusable.Add(_keyUsableTime - responded);
+            }
+
+            PRMStubSetObserver(nullptr);
+
+            needkey.Print("OnNeedKey to KEYNEEDED callback");
+            keyusable.Print("license response to KeyUsable callback");
+
+            session->Run(nullptr);
+            _connect.Destroy(session);
+            base->Run(nullptr);
+            _system.Destroy(base);
+        }
+
+        // an EMM carousel on the system proxy at CarouselRate, without and with the emmprefilter option. Most EMMs are for other
+        // devices and groups, and every one is new so the EMM history does not hide any. Reported are the EMMDELIVERY Update, how
+        // long the queue took to drain after the last EMM and how many EMMs reached the PRM.
+        void EMM() {
+            static const char* const configs[] = { _T("{\"correlation\":true}"), _T("{\"correlation\":true,\"emmprefilter\":true}") };
+            static const char* const names[] = { "EMM carousel, no prefilter", "EMM carousel, prefilter" };
+            uint32_t sequence = 0;
+
+            for( uint8_t config = 0; config < 2; ++config ) {
+                Test::Plugin configured(_systemPath, configs[config]); // the options apply to all systems of the loaded plugin
+
+                IMediaKeySession* base = _system.Create(std::vector<uint8_t>());
+                base->Run(&_callback); // reads the filters
+
+                const uint32_t prm = PRMStubCount(PRMSTUB_EMMS);
+                uint32_t skipped, rejected;
+                Skipped(skipped, rejected);
+                uint64_t updates = 0;
+
+                const uint64_t start = Test::Now();
+                for( uint32_t iteration = 0; iteration < _iterations; ++iteration ) {
+                    const uint64_t due = start + ( ( static_cast<uint64_t>(iteration) * 1000000 ) / CarouselRate );
+                    const uint64_t now = Test::Now();
+                    if( due > now ) {
+                        std::this_thread::sleep_for(std::chrono::microseconds(due - now));
+                    }
+
+                    Test::Message emm(Request::EMMDELIVERY);
+                    emm.Buffer(CarouselEMM(sequence++));
+
+                    const uint64_t update = Test::Now();
+                    base->Update(emm.Data(), emm.Length());
+                    updates += ( Test::Now() - update );
+                }
+
+                const uint64_t sent = Test::Now();
+                uint32_t decrypted, skippedNow, rejectedNow;
+                do {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    decrypted = PRMStubCount(PRMSTUB_EMMS) - prm;
+                    Skipped(skippedNow, rejectedNow);
+                } while( ( ( decrypted + ( skippedNow - skipped ) ) < _iterations ) && ( ( Test::Now() - sent ) < ( Timeout * 1000ULL ) ) );
+                const uint64_t drained = Test::Now() - sent;
+                rejected = rejectedNow - rejected;
+
+                printf("%-44s %8u EMMs, %7.3f us/Update, drained %8u us after the last, %u to the PRM, %u rejected\n", names[config], _iterations,
+                    ( _iterations != 0 ? static_cast<double>(updates) / _iterations : 0.0 ), static_cast<uint32_t>(drained), decrypted, rejected);
+
+                base->Run(nullptr);
+                _system.Destroy(base);
+            }
+
+            Test::Plugin restored(_systemPath, configs[0]);
+        }
+
+        // Addref/Release of the system, and its lookup, from more threads at once
+        void Contention() {
+            static const uint8_t threadcounts[] = { 1, 2, 4, 8 };
+
+            IMediaKeySession* base = _system.Create(std::vector<uint8_t>());
+            const string id(base->GetSessionId());
+
+            for( const uint8_t threads : threadcounts ) {
+                IMediaSessionSystem* system = _interface(nullptr);
+                MeasureThreads(("Addref/Release, " + std::to_string(threads) + " threads").c_str(), threads, [system]() {
+                    system->Addref();
+                    system->Release();
+                });
+                system->Release();
+
+                MeasureThreads(("lookup/Release, " + std::to_string(threads) + " threads").c_str(), threads, [this, &id]() {
+                    _interface(id.c_str())->Release();
+                });
+            }
+
+            _system.Destroy(base);
+        }
+
+    private:
+        void Measure(const char name[], const uint32_t iterations, const std::function<void(const uint32_t iteration)>& operation) {
+            const uint64_t start = Test::Now();
+            for( uint32_t iteration = 0; iteration < iterations; ++iteration ) {
+                operation(iteration);
+            }
+            Report(name, iterations, Test::Now() - start);
+        }
+
+        void MeasureThreads(const char name[], const uint8_t threads, const std::function<void()>& operation) {
+            std::atomic<bool> go(false);
+            std::vector<std::thread> workers;
+            for( uint8_t thread = 0; thread < threads; ++thread ) {
+                workers.emplace_back([this, &go, &operation]() {
+                    while( go.load() == false ) {
+                        std::this_thread::yield();
+                    }
+                    for( uint32_t iteration = 0; iteration < _iterations; ++iteration ) {
+                        operation();
+                    }
+                });
+            }
+            const uint64_t start = Test::Now();
+            go = true;
+            for( std::thread& worker : workers ) {
+                worker.join();
+            }
+            Report(name, _iterations * threads, Test::Now() - start);
+        }
+
+        // 1 in 50 global, 1 in 10 for our first group, 1 in 500 for our unique address, the rest for other groups and devices.
+        // The address is followed by the sequence number, so every EMM is new.
+        static std::vector<uint8_t> CarouselEMM(const uint32_t sequence) {
+            uint8_t tableid = 0x86;
+            uint32_t address = PRMSTUB_UNIQUE_ADDRESS + 1 + sequence;
+
+            if( ( sequence % 50 ) == 0 ) {
+                tableid = 0x82;
+                address = sequence;
+            }
+            else if( ( sequence % 500 ) == 1 ) {
+                address = PRMSTUB_UNIQUE_ADDRESS;
+            }
+            else if( ( sequence % 10 ) == 2 ) {
+                tableid = 0x84;
+                address = ( ( PRMSTUB_GROUP_ADDRESS << 8 ) | ( sequence & 0xFF ) ); // 3 byte group address
+            }
+            else if( ( sequence % 2 ) == 0 ) {
+                tableid = 0x84;
+                address = ( ( ( PRMSTUB_GROUP_ADDRESS + 0x100 + ( sequence & 0xFF ) ) << 8 ) | ( sequence & 0xFF ) );
+            }
+
+            std::vector<uint8_t> section(Test::Section(tableid, static_cast<uint16_t>(64 + ( ( sequence * 7 ) % 120 )), address));
+            section[7] = static_cast<uint8_t>(sequence >> 24);
+            section[8] = static_cast<uint8_t>(sequence >> 16);
+            section[9] = static_cast<uint8_t>(sequence >> 8);
+            section[10] = static_cast<uint8_t>(sequence);
+            return section;
+        }
+
+        // EMMs of all systems that did not reach the PRM (duplicates, dropped from a full queue or rejected by the prefilter),
+        // and how many of those the prefilter rejected
+        void Skipped(uint32_t& skipped, uint32_t& rejected) const {
+            Statistics::Data statistics;
+            statistics.FromString(Test::StatisticsSnapshot(_statistics));
+            skipped = 0;
+            rejected = 0;
+            auto index = statistics.SystemDetails.Elements();
+            while( index.Next() == true ) {
+                const Statistics::System& system(index.Current());
+                skipped += system.EMMDuplicates.Value() + system.EMMsDropped.Value() + system.EMMsRejected.Value();
+                rejected += system.EMMsRejected.Value();
+            }
+        }
+
+        static void Report(const char name[], const uint32_t operations, const uint64_t duration) {
+            printf("%-44s %8u ops in %8u us, %10.3f us/op, %12.0f ops/s\n", name, operations, static_cast<uint32_t>(duration),
+                ( operations != 0 ? static_cast<double>(duration) / operations : 0.0 ), ( duration != 0 ? ( operations * 1000000.0 ) / duration : 0.0 ));
+        }
+
+    private:
+        Test::Plugin _system;
+        Test::Plugin _connect;
+        const string _systemPath;
+        const uint32_t _iterations;
+        Test::GetSystemInterface _interface;
+        Test::GetStatistics _statistics;
+        std::atomic<uint32_t> _requestId;
+        Core::Event _keyMessage;
+        Core::Event _keyUsable;
+        Test::Callback _callback;
+        std::atomic<uint64_t> _keyMessageTime;
+        std::atomic<uint64_t> _keyUsableTime;
+
+        static std::atomic<uint64_t> g_needKeyTime;
+    };
+
+    std::atomic<uint64_t> Benchmark::g_needKeyTime(0);
+
+}
+
+int main(int argc, char* argv[]) {
+    if( argc < 3 ) {
+        printf("usage: %s <NagraSystem.drm> <NagraConnect.drm> [sessions|lookup|ecm|needkey|emm|contention|all] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    const string scenario(argc > 3 ? argv[3] : "all");
+    const uint32_t iterations = ( argc > 4 ? static_cast<uint32_t>(strtoul(argv[4], nullptr, 10)) : 10000 );
+
+    Benchmark benchmark(argv[1], argv[2], iterations);
+
+    if( benchmark.IsValid() == false ) {
+        printf("could not load the plugins\n");
+        return 1;
+    }
+
+    bool known = false;
+    if( ( scenario == "all" ) || ( scenario == "sessions" ) ) {
+        benchmark.Sessions();
+        known = true;
+    }
+    if( ( scenario == "all" ) || ( scenario == "lookup" ) ) {
+        benchmark.Lookup();
+        known = true;
+    }
+    if( ( scenario == "all" ) || ( scenario == "ecm" ) ) {
+        benchmark.ECM();
+        known = true;
+    }
+    if( ( scenario == "all" ) || ( scenario == "needkey" ) ) {
+        benchmark.NeedKey();
+        known = true;
+    }
+    if( ( scenario == "all" ) || ( scenario == "emm" ) ) {
+        benchmark.EMM();
+        known = true;
+    }
+    if( ( scenario == "all" ) || ( scenario == "contention" ) ) {
+        benchmark.Contention();
+        known = true;
+    }
+
+    if( known == false ) {
+        printf("unknown scenario %s\n", scenario.c_str());
+    }
+
+    return ( known == true ? 0 : 1 );
+}
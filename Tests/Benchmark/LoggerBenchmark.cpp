@@ -0,0 +1,87 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NagraLoggerBenchmark [ecms]
+//
+// The reporting cost per ECM in MediaSessionConnect::Update, before and after the ring buffer logger: the same five lines
+// written with fprintf/fflush as Report.h used to, through the ring, and as REPORT_TRACE (compiled out unless the build
+// keeps the trace level). Both write to stderr, so run it with stderr going where the plugins' output goes on the box
+// (or to /dev/null to only see the formatting and locking cost).
+
+#include "../../Report.h"
+
+using namespace CDMi;
+
+namespace {
+
+    constexpr uint32_t EcmDelivery = 0x40; // the request value that was reported
+
+    void Legacy(const uint32_t ecms) {
+        for( uint32_t ecm = 0; ecm < ecms; ++ecm ) {
+            fprintf(stderr, "enter MediaSessionConnect::Update\n");
+            fflush(stderr);
+            fprintf(stderr, "NagraSytem update triggered\n");
+            fflush(stderr);
+            fprintf(stderr, "NagraSytem update triggered with %d\n", EcmDelivery);
+            fflush(stderr);
+            fprintf(stderr, "NagraSytem importing ECM response\n");
+            fflush(stderr);
+            fprintf(stderr, "leave MediaSessionConnect::Update\n");
+            fflush(stderr);
+        }
+    }
+
+    void Ring(const uint32_t ecms) {
+        for( uint32_t ecm = 0; ecm < ecms; ++ecm ) {
+            Log::Write(Log::LEVEL_TRACE, "%s", "enter MediaSessionConnect::Update");
+            Log::Write(Log::LEVEL_TRACE, "%s", "NagraSytem update triggered");
+            Log::Write(Log::LEVEL_TRACE, "NagraSytem update triggered with %u", EcmDelivery);
+            Log::Write(Log::LEVEL_TRACE, "%s", "NagraSytem importing ECM response");
+            Log::Write(Log::LEVEL_TRACE, "%s", "leave MediaSessionConnect::Update");
+        }
+    }
+
+    void Trace(const uint32_t ecms) {
+        for( uint32_t ecm = 0; ecm < ecms; ++ecm ) {
+            REPORT_TRACE("enter MediaSessionConnect::Update");
+            REPORT_TRACE("NagraSytem update triggered");
+            REPORT_TRACE_EXT("NagraSytem update triggered with %u", EcmDelivery);
+            REPORT_TRACE("NagraSytem importing ECM response");
+            REPORT_TRACE("leave MediaSessionConnect::Update");
+        }
+    }
+
+    void Measure(const char name[], const uint32_t ecms, void (*run)(const uint32_t)) {
+        const uint64_t start = Thunder::Core::Time::Now().Ticks();
+        run(ecms);
+        const uint64_t duration = Thunder::Core::Time::Now().Ticks() - start;
+        printf("%-44s %8u ECMs in %8u us, %10.3f us/ECM\n", name, ecms, static_cast<uint32_t>(duration), ( ecms != 0 ? static_cast<double>(duration) / ecms : 0.0 ));
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    const uint32_t ecms = ( argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : 100000 );
+
+    Measure("before: fprintf/fflush", ecms, Legacy);
+    Measure("after: ring buffer", ecms, Ring);
+    Measure("after: REPORT_TRACE", ecms, Trace);
+    printf("REPORT_TRACE is %s in this build (NAGRA_REPORT_LEVEL %d)\n", ( NAGRA_REPORT_LEVEL >= Log::LEVEL_TRACE ? "kept" : "compiled out" ), NAGRA_REPORT_LEVEL);
+
+    Log::Flush();
+
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NagraPSSHBenchmark [iterations]
+//
+// ParsePSSHHeader and FindPSSHHeaderPrivateData on large multi DRM init data: foreign boxes with big payloads first and
+// ours last (v1 with many KIDs, and v0 in the legacy layout), and init data without our box at all. Every result is
+// checked, so it fails (exit code 1) if the parser no longer finds what it should.
+
+#include "../Harness.h"
+#include "../../ParsePSSHHeader.h"
+
+using namespace CDMi;
+using namespace CDMi::Test;
+
+namespace {
+
+    constexpr uint8_t Widevine[] = { 0xed, 0xef, 0x8b, 0xa9, 0x79, 0xd6, 0x4a, 0xce, 0xa3, 0xc8, 0x27, 0xdc, 0xd5, 0x1d, 0x21, 0xed };
+    constexpr uint8_t PlayReady[] = { 0x9a, 0x04, 0xf0, 0x79, 0x98, 0x40, 0x42, 0x86, 0xab, 0x92, 0xe6, 0x5b, 0xe0, 0x88, 0x5f, 0x95 };
+
+    constexpr uint32_t ForeignBoxes = 8; // alternating Widevine and PlayReady
+    constexpr uint32_t ForeignDataSize = 4096;
+    constexpr uint32_t KeyIds = 64;
+
+    struct InitData {
+        const char* Name;
+        std::vector<uint8_t> Data;
+        int32_t Expected; // private data length or the error
+        uint32_t KeyIdCount;
+    };
+
+    std::vector<uint8_t> Foreign() {
+        const std::vector<uint8_t> payload(ForeignDataSize, 0x5A);
+        std::vector<uint8_t> data;
+        for( uint32_t box = 0; box < ForeignBoxes; ++box ) {
+            AppendPSSH(data, ( ( box & 1 ) == 0 ? Widevine : PlayReady ), 1, KeyIds, payload.data(), static_cast<uint32_t>(payload.size()));
+        }
+        return data;
+    }
+
+    std::vector<InitData> Create() {
+        const std::vector<uint8_t> privatedata(ConnectInitData(0x1234, 0x4001, string()));
+        const uint8_t* nagra = privatedata.data();
+        const int32_t length = FindPSSHHeaderPrivateData(nagra, static_cast<uint32_t>(privatedata.size()));
+        std::vector<InitData> initdata;
+
+        std::vector<uint8_t> data(Foreign());
+        AppendPSSH(data, CommonEncryption, 1, KeyIds, nagra, length);
+        initdata.push_back({ "multi DRM, v1 with KIDs last", data, length, KeyIds });
+
+        data = Foreign();
+        const size_t box = data.size();
+        AppendPSSH(data, CommonEncryption, 1, KeyIds, nagra, length);
+        data[box + 8] = 0; // v0 in the layout players have always been sending
+        initdata.push_back({ "multi DRM, v0 legacy layout last", data, length, KeyIds });
+
+        data = Foreign();
+        AppendPSSH(data, CommonEncryption, 0, 0, nagra, length);
+        initdata.push_back({ "multi DRM, v0 last", data, length, 0 });
+
+        initdata.push_back({ "multi DRM, not ours", Foreign(), -3, 0 });
+
+        return initdata;
+    }
+
+    bool Parse(const InitData& initdata, const uint32_t iterations) {
+        bool result = true;
+        PSSHHeader header;
+
+        const uint64_t start = Now();
+        for( uint32_t iteration = 0; ( iteration < iterations ) && ( result == true ); ++iteration ) {
+            result = ( ( ParsePSSHHeader(initdata.Data.data(), static_cast<uint32_t>(initdata.Data.size()), header) == initdata.Expected )
+                && ( header.KeyIdCount == initdata.KeyIdCount ) );
+        }
+        const uint64_t duration = Now() - start;
+
+        printf("%-26s %-34s %6u bytes, %8.3f us/call%s\n", "ParsePSSHHeader", initdata.Name, static_cast<uint32_t>(initdata.Data.size()),
+            ( iterations != 0 ? static_cast<double>(duration) / iterations : 0.0 ), ( result == true ? "" : ", WRONG RESULT" ));
+
+        return result;
+    }
+
+    bool Find(const InitData& initdata, const uint32_t iterations) {
+        bool result = true;
+
+        const uint64_t start = Now();
+        for( uint32_t iteration = 0; ( iteration < iterations ) && ( result == true ); ++iteration ) {
+            const uint8_t* data = initdata.Data.data();
+            result = ( FindPSSHHeaderPrivateData(data, static_cast<uint32_t>(initdata.Data.size())) == initdata.Expected );
+        }
+        const uint64_t duration = Now() - start;
+
+        printf("%-26s %-34s %6u bytes, %8.3f us/call%s\n", "FindPSSHHeaderPrivateData", initdata.Name, static_cast<uint32_t>(initdata.Data.size()),
+            ( iterations != 0 ? static_cast<double>(duration) / iterations : 0.0 ), ( result == true ? "" : ", WRONG RESULT" ));
+
+        return result;
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    const uint32_t iterations = ( argc > 1 ? static_cast<uint32_t>(strtoul(argv[1], nullptr, 10)) : 100000 );
+
+    bool result = true;
+
+    for( const InitData& initdata : Create() ) {
+        result = Parse(initdata, iterations) && result;
+        result = Find(initdata, iterations) && result;
+    }
+
+    Log::Flush();
+
+    return ( result == true ? 0 : 1 );
+}
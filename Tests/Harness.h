@@ -0,0 +1,297 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+#include <interfaces/IDRM.h>
+
+#include "../IMediaSessionSystem.h"
+#include "../MediaRequest.h"
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// What the benchmarks and tools share: loading the plugins, building init data and Update messages, and the
+// client side callback, all the way OCDM drives the plugins.
+
+namespace CDMi {
+namespace Test {
+
+    constexpr uint8_t CommonEncryption[] = { 0x10, 0x77, 0xef, 0xec, 0xc0, 0xb2, 0x4d, 0x02, 0xac, 0xe3, 0x3c, 0x1e, 0x52, 0xe2, 0xfb, 0x4b };
+
+    using GetSystemInterface = IMediaSessionSystem* (*)(const char* systemsessionid);
+    using GetStatistics = uint32_t (*)(char buffer[], const uint32_t length);
+
+    inline uint64_t Now() {
+        return Thunder::Core::Time::Now().Ticks(); // us
+    }
+
+    inline void Append(std::vector<uint8_t>& data, const uint32_t value) {
+        data.push_back(static_cast<uint8_t>(value >> 24));
+        data.push_back(static_cast<uint8_t>(value >> 16));
+        data.push_back(static_cast<uint8_t>(value >> 8));
+        data.push_back(static_cast<uint8_t>(value));
+    }
+
+    // what GetMediaSessionSystemStatistics() returns, see MediaSystem/Statistics.h
+    inline string StatisticsSnapshot(const GetStatistics function) {
+        string text;
+        text.resize(16 * 1024);
+        uint32_t length = function(&text[0], static_cast<uint32_t>(text.size()));
+        if( length >= text.size() ) {
+            text.resize(length + 1);
+            length = function(&text[0], static_cast<uint32_t>(text.size()));
+        }
+        text.resize(std::min(length, static_cast<uint32_t>(text.size() - 1)));
+        return text;
+    }
+
+    // a pssh box, v1 carries kidcount (generated) KIDs
+    inline void AppendPSSH(std::vector<uint8_t>& data, const uint8_t systemid[16], const uint8_t version, const uint32_t kidcount, const uint8_t privatedata[], const uint32_t length) {
+        const uint32_t kids = ( version > 0 ? kidcount : 0 );
+        Append(data, 8 + 4 + 16 + ( version > 0 ? 4 + ( kids * 16 ) : 0 ) + 4 + length);
+        Append(data, 0x70737368); // "pssh"
+        Append(data, static_cast<uint32_t>(version) << 24);
+        data.insert(data.end(), systemid, systemid + 16);
+        if( version > 0 ) {
+            Append(data, kids);
+            for( uint32_t kid = 0; kid < kids; ++kid ) {
+                Append(data, kid);
+                data.insert(data.end(), 12, static_cast<uint8_t>(kid));
+            }
+        }
+        Append(data, length);
+        data.insert(data.end(), privatedata, privatedata + length);
+    }
+
+    // a system session on an operator vault (the default one without init data)
+    inline std::vector<uint8_t> SystemInitData(const string& operatorvault) {
+        std::vector<uint8_t> data;
+        AppendPSSH(data, CommonEncryption, 1, 0, reinterpret_cast<const uint8_t*>(operatorvault.c_str()), static_cast<uint32_t>(operatorvault.length()));
+        return data;
+    }
+
+    // a connect session on the system the proxy belongs to (the default system if empty)
+    inline std::vector<uint8_t> ConnectInitData(const uint32_t TSID, const uint16_t Emi, const string& systemsessionid, const uint32_t kidcount = 0) {
+        std::vector<uint8_t> privatedata;
+        Append(privatedata, TSID);
+        privatedata.push_back(static_cast<uint8_t>(Emi >> 8));
+        privatedata.push_back(static_cast<uint8_t>(Emi));
+        privatedata.insert(privatedata.end(), systemsessionid.begin(), systemsessionid.end());
+
+        std::vector<uint8_t> data;
+        AppendPSSH(data, CommonEncryption, 1, kidcount, privatedata.data(), static_cast<uint32_t>(privatedata.size()));
+        return data;
+    }
+
+    // a short (no CRC) private section of length bytes in total, the payload starts with the sequence number so it is unique
+    inline std::vector<uint8_t> Section(const uint8_t tableid, const uint16_t length, const uint32_t sequence) {
+        std::vector<uint8_t> section;
+        section.push_back(tableid);
+        section.push_back(static_cast<uint8_t>( 0x70 | ( ( ( length - 3 ) >> 8 ) & 0x0F ) ));
+        section.push_back(static_cast<uint8_t>( length - 3 ));
+        Append(section, sequence);
+        section.resize(length, 0xA5);
+        return section;
+    }
+
+    // the payload of an Update(), see MediaRequest.h
+    class Message {
+    public:
+        Message(const Message&) = delete;
+        Message& operator=(const Message&) = delete;
+
+        explicit Message(const Request request, const uint32_t requestid = 0, const uint16_t capacity = 4096)
+            : _buffer(capacity)
+            , _length(0) {
+            Thunder::Core::FrameType<0> frame(_buffer.data(), static_cast<uint16_t>(_buffer.size()), 0);
+            Thunder::Core::FrameType<0>::Writer writer(frame, 0);
+            writer.Number<requestsSize>(static_cast<requestsSize>(request) | ( requestid != 0 ? RequestIdPresent : 0 ));
+            if( requestid != 0 ) {
+                writer.Number<uint32_t>(requestid);
+            }
+            _length = writer.Offset();
+        }
+        ~Message() = default;
+
+        Message& Number(const requestsSize value) {
+            Thunder::Core::FrameType<0> frame(_buffer.data(), static_cast<uint16_t>(_buffer.size()), _length);
+            Thunder::Core::FrameType<0>::Writer writer(frame, _length);
+            writer.Number<requestsSize>(value);
+            _length = writer.Offset();
+            return *this;
+        }
+        Message& Text(const string& text) {
+            Thunder::Core::FrameType<0> frame(_buffer.data(), static_cast<uint16_t>(_buffer.size()), _length);
+            Thunder::Core::FrameType<0>::Writer writer(frame, _length);
+            writer.Text(text);
+            _length = writer.Offset();
+            return *this;
+        }
+        Message& Buffer(const uint8_t data[], const uint16_t length) {
+            Thunder::Core::FrameType<0> frame(_buffer.data(), static_cast<uint16_t>(_buffer.size()), _length);
+            Thunder::Core::FrameType<0>::Writer writer(frame, _length);
+            writer.Buffer<uint16_t>(length, data);
+            _length = writer.Offset();
+            return *this;
+        }
+        Message& Buffer(const std::vector<uint8_t>& data) {
+            return Buffer(data.data(), static_cast<uint16_t>(data.size()));
+        }
+
+        const uint8_t* Data() const {
+            return _buffer.data();
+        }
+        uint32_t Length() const {
+            return _length;
+        }
+
+    private:
+        std::vector<uint8_t> _buffer;
+        uint16_t _length;
+    };
+
+    class Callback : public IMediaKeySessionCallback {
+    public:
+        // type without the request ID, requestid 0 if there was none
+        using KeyMessage = std::function<void(const string& type, const uint32_t requestid, const uint8_t data[], const uint32_t length)>;
+        using KeyStatus = std::function<void(const string& status)>;
+
+        Callback(const Callback&) = delete;
+        Callback& operator=(const Callback&) = delete;
+
+        Callback(KeyMessage&& message, KeyStatus&& status)
+            : _message(std::move(message))
+            , _status(std::move(status)) {
+        }
+        ~Callback() override = default;
+
+        void OnKeyMessage(const uint8_t* data, const uint32_t length, char* label) override {
+            const string text(label != nullptr ? label : "");
+            const size_t separator = text.find(':');
+            const uint32_t requestid = ( separator != string::npos ? static_cast<uint32_t>(strtoul(text.c_str() + separator + 1, nullptr, 10)) : 0 );
+            if( _message ) {
+                _message(text.substr(0, separator), requestid, data, length);
+            }
+        }
+        void OnError(int16_t, CDMi_RESULT, const char*) override {
+        }
+        void OnKeyStatusUpdate(const char* status, const uint8_t*, const uint8_t) override {
+            if( _status ) {
+                _status(string(status != nullptr ? status : ""));
+            }
+        }
+        void OnKeyStatusesUpdated() const override {
+        }
+
+    private:
+        KeyMessage _message;
+        KeyStatus _status;
+    };
+
+    // one of the .drm files, loaded like OCDM does
+    class Plugin {
+    public:
+        Plugin(const Plugin&) = delete;
+        Plugin& operator=(const Plugin&) = delete;
+
+        Plugin(const string& path, const string& configline = string())
+            : _library(path.c_str())
+            , _keys(nullptr) {
+            if( _library.IsLoaded() == true ) {
+                ISystemFactory* (*factory)() = Function<ISystemFactory* (*)()>(_T("GetSystemFactory"));
+                if( factory != nullptr ) {
+                    _keys = factory()->Instance();
+                    if( ( _keys != nullptr ) && ( configline.empty() == false ) ) {
+                        _keys->Initialize(nullptr, configline);
+                    }
+                }
+            }
+        }
+        ~Plugin() = default;
+
+        bool IsValid() const {
+            return ( _keys != nullptr );
+        }
+
+        IMediaKeySession* Create(const std::vector<uint8_t>& initdata) const {
+            IMediaKeySession* session = nullptr;
+            if( _keys->CreateMediaKeySession(string(), 0, "cenc", initdata.data(), static_cast<uint32_t>(initdata.size()), nullptr, 0, &session) != CDMi_SUCCESS ) {
+                session = nullptr;
+            }
+            return session;
+        }
+        void Destroy(IMediaKeySession* session) const {
+            _keys->DestroyMediaKeySession(session);
+        }
+
+        template<typename FUNCTION>
+        FUNCTION Function(const TCHAR name[]) {
+            return reinterpret_cast<FUNCTION>(_library.LoadFunction(name));
+        }
+
+    private:
+        Thunder::Core::Library _library;
+        IMediaKeys* _keys;
+    };
+
+    // durations in us
+    class Samples {
+    public:
+        Samples(const Samples&) = delete;
+        Samples& operator=(const Samples&) = delete;
+
+        Samples()
+            : _lock()
+            , _samples() {
+        }
+        ~Samples() = default;
+
+        void Add(const uint64_t duration) {
+            std::lock_guard<std::mutex> guard(_lock);
+            _samples.push_back(duration);
+        }
+        void Clear() {
+            std::lock_guard<std::mutex> guard(_lock);
+            _samples.clear();
+        }
+        void Print(const char name[]) {
+            std::lock_guard<std::mutex> guard(_lock);
+            if( _samples.empty() == true ) {
+                printf("%-44s no samples\n", name);
+            }
+            else {
+                std::sort(_samples.begin(), _samples.end());
+                uint64_t total = 0;
+                for( const uint64_t sample : _samples ) {
+                    total += sample;
+                }
+                printf("%-44s %8u samples, avg %8.1f us, p50 %6u us, p99 %6u us, max %6u us\n", name, static_cast<uint32_t>(_samples.size()),
+                    static_cast<double>(total) / _samples.size(), static_cast<uint32_t>(_samples[_samples.size() / 2]),
+                    static_cast<uint32_t>(_samples[( _samples.size() * 99 ) / 100]), static_cast<uint32_t>(_samples.back()));
+            }
+        }
+
+    private:
+        std::mutex _lock;
+        std::vector<uint64_t> _samples;
+    };
+
+} // namespace Test
+} // namespace CDMi
@@ -0,0 +1,491 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NagraLoadGenerator <NagraSystem.drm> <NagraConnect.drm> [-s sessions] [-t TSIDs] [-d seconds] [-e ECM interval ms]
+//                    [-m EMMs/s] [-r renewal interval ms] [-k key period ms]
+//
+// Runs a set-top box worth of traffic on the plugins and the stub PRM library: connect sessions spread over TSIDs get an
+// ECM every ECM interval, the system proxy gets EMMs, the PRM asks for a renewal every renewal interval and all keys expire
+// every key period (so the next ECM of every session raises OnNeedKey). KEYNEEDED and RENEWAL key messages are answered
+// from a separate thread, like a client doing the license exchange would. Every second it prints the throughput, the
+// g_lock wait and the command queue depth from GetMediaSessionSystemStatistics(), at the end the callback latencies as
+// seen by the client. It fails (exit code 1) when no ECM got through or no key ever became usable.
+
+#include "../Harness.h"
+#include "../../MediaSystem/Statistics.h"
+
+#include <PRMStub.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace Thunder;
+using namespace CDMi;
+
+namespace {
+
+    constexpr uint16_t ECMSize = 184;
+    constexpr uint16_t EMMDuplicateEvery = 8; // every so many EMMs one is sent again, for the EMM history
+    constexpr uint32_t EMMInterval = 10; // ms
+
+    struct Options {
+        uint32_t Sessions;
+        uint32_t TSIDs;
+        uint32_t Duration; // s
+        uint32_t ECMInterval; // ms
+        uint32_t EMMRate; // per s
+        uint32_t RenewalInterval; // ms, 0 for none
+        uint32_t KeyPeriod; // ms, 0 for none
+    };
+
+    class LoadGenerator {
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        struct Session {
+            Session(const Session&) = delete;
+            Session& operator=(const Session&) = delete;
+
+            explicit Session(const uint32_t tsid)
+                : TSID(tsid)
+                , MediaKeySession(nullptr)
+                , Callback()
+                , Armed(false)
+                , NeedKeySince(0)
+                , Responded(0) {
+            }
+            ~Session() = default;
+
+            const uint32_t TSID;
+            IMediaKeySession* MediaKeySession;
+            std::unique_ptr<Test::Callback> Callback;
+            std::atomic<bool> Armed; // the keys expired, the next ECM starts the clock
+            std::atomic<uint64_t> NeedKeySince;
+            std::atomic<uint64_t> Responded;
+        };
+
+        // a key message to answer
+        struct Exchange {
+            Request Type;
+            uint32_t RequestId;
+            Session* Origin; // nullptr if it came in on the system proxy
+        };
+
+    public:
+        LoadGenerator(const LoadGenerator&) = delete;
+        LoadGenerator& operator=(const LoadGenerator&) = delete;
+
+        LoadGenerator(const string& system, const string& connect, const Options& options)
+            : _system(system, _T("{\"profiling\":true,\"correlation\":true}"))
+            , _connect(connect)
+            , _options(options)
+            , _statistics(_system.Function<Test::GetStatistics>(_T("GetMediaSessionSystemStatistics")))
+            , _base(nullptr)
+            , _baseCallback([this](const string& type, const uint32_t requestid, const uint8_t[], const uint32_t) {
+                  if( type == _T("RENEWAL") ) {
+                      const uint64_t requested = _renewalRequested.exchange(0);
+                      if( requested != 0 ) {
+                          _renewal.Add(Test::Now() - requested);
+                      }
+                      Respond({ Request::RENEWAL, requestid, nullptr });
+                  }
+                  else if( type == _T("KEYNEEDED") ) {
+                      Respond({ Request::KEYNEEDED, requestid, nullptr });
+                  }
+              }
+              , nullptr)
+            , _sessions()
+            , _stopLock()
+            , _stopped()
+            , _stop(false)
+            , _exchangeLock()
+            , _exchangeQueued()
+            , _exchanges()
+            , _ecms(0)
+            , _emms(0)
+            , _keyMessages(0)
+            , _responses(0)
+            , _keysUsable(0)
+            , _renewals(0)
+            , _renewalRequested(0)
+            , _needKey()
+            , _keyUsable()
+            , _renewal() {
+        }
+        ~LoadGenerator() = default;
+
+        bool IsValid() const {
+            return ( ( _system.IsValid() == true ) && ( _connect.IsValid() == true ) && ( _statistics != nullptr ) );
+        }
+
+        bool Run() {
+            if( Open() == true ) {
+                std::vector<std::thread> threads;
+
+                threads.emplace_back([this]() { Responder(); });
+                for( uint32_t tsid = 0; tsid < _options.TSIDs; ++tsid ) {
+                    threads.emplace_back([this, tsid]() { ECMFeeder(tsid + 1); });
+                }
+                if( _options.EMMRate != 0 ) {
+                    threads.emplace_back([this]() { EMMFeeder(); });
+                }
+                if( _options.RenewalInterval != 0 ) {
+                    threads.emplace_back([this]() {
+                        Periodic(_options.RenewalInterval, [this]() {
+                            _renewalRequested = Test::Now();
+                            _renewals += PRMStubRenewal();
+                        });
+                    });
+                }
+                if( _options.KeyPeriod != 0 ) {
+                    threads.emplace_back([this]() {
+                        Periodic(_options.KeyPeriod, [this]() {
+                            PRMStubExpireKeys();
+                            for( std::unique_ptr<Session>& session : _sessions ) {
+                                session->Armed = true;
+                            }
+                        });
+                    });
+                }
+
+                Monitor();
+
+                {
+                    std::lock_guard<std::mutex> guard(_stopLock);
+                    _stop = true;
+                }
+                _stopped.notify_all();
+                {
+                    std::lock_guard<std::mutex> guard(_exchangeLock);
+                }
+                _exchangeQueued.notify_all();
+
+                for( std::thread& thread : threads ) {
+                    thread.join();
+                }
+
+                Report();
+            }
+
+            Close();
+
+            return ( ( _ecms != 0 ) && ( _keysUsable != 0 ) );
+        }
+
+    private:
+        bool Open() {
+            bool result = false;
+
+            _base = _system.Create(std::vector<uint8_t>());
+            if( _base != nullptr ) {
+                _base->Run(&_baseCallback);
+
+                result = true;
+                for( uint32_t index = 0; ( index < _options.Sessions ) && ( result == true ); ++index ) {
+                    _sessions.emplace_back(new Session(( index % _options.TSIDs ) + 1));
+                    Session* session = _sessions.back().get();
+
+                    session->Callback.reset(new Test::Callback([this, session](const string& type, const uint32_t requestid, const uint8_t[], const uint32_t) {
+                        if( type == _T("KEYNEEDED") ) {
+                            const uint64_t since = session->NeedKeySince.exchange(0);
+                            if( since != 0 ) {
+                                _needKey.Add(Test::Now() - since);
+                            }
+                            Respond({ Request::KEYNEEDED, requestid, session });
+                        }
+                    }
+                    , [this, session](const string& status) {
+                        if( status == _T("KeyUsable") ) {
+                            const uint64_t responded = session->Responded.exchange(0);
+                            if( responded != 0 ) {
+                                _keyUsable.Add(Test::Now() - responded);
+                            }
+                            ++_keysUsable;
+                        }
+                    }));
+
+                    session->MediaKeySession = _connect.Create(Test::ConnectInitData(session->TSID, 0, _base->GetSessionId()));
+                    if( session->MediaKeySession != nullptr ) {
+                        session->MediaKeySession->Run(session->Callback.get());
+                        session->Armed = true; // no key yet
+                    }
+                    else {
+                        printf("could not create connect session %u\n", index);
+                        result = false;
+                    }
+                }
+            }
+            else {
+                printf("could not create the system proxy\n");
+            }
+
+            return result;
+        }
+
+        void Close() {
+            for( std::unique_ptr<Session>& session : _sessions ) {
+                if( session->MediaKeySession != nullptr ) {
+                    session->MediaKeySession->Run(nullptr);
+                    _connect.Destroy(session->MediaKeySession);
+                }
+            }
+            _sessions.clear();
+
+            if( _base != nullptr ) {
+                _base->Run(nullptr);
+                _system.Destroy(_base);
+                _base = nullptr;
+            }
+        }
+
+        // false once stopping
+        bool WaitUntil(const Clock::time_point& deadline) {
+            std::unique_lock<std::mutex> guard(_stopLock);
+            return ( _stopped.wait_until(guard, deadline, [this]() { return _stop; }) == false );
+        }
+
+        void Periodic(const uint32_t interval, const std::function<void()>& action) {
+            Clock::time_point next = Clock::now() + std::chrono::milliseconds(interval);
+            while( WaitUntil(next) == true ) {
+                action();
+                next += std::chrono::milliseconds(interval);
+            }
+        }
+
+        // all sessions on one TSID, the ECM changes (table_id 0x80/0x81) with every key period
+        void ECMFeeder(const uint32_t tsid) {
+            std::vector<Session*> sessions;
+            for( std::unique_ptr<Session>& session : _sessions ) {
+                if( session->TSID == tsid ) {
+                    sessions.push_back(session.get());
+                }
+            }
+
+            const Clock::time_point start = Clock::now();
+            uint32_t sequence = 0;
+
+            do {
+                const uint32_t period = ( _options.KeyPeriod != 0 ? static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count() / _options.KeyPeriod) : 0 );
+                Test::Message ecm(Request::ECMDELIVERY);
+                ecm.Buffer(Test::Section(0x80 | ( period & 1 ), ECMSize, period));
+
+                for( Session* session : sessions ) {
+                    if( session->Armed.exchange(false) == true ) {
+                        session->NeedKeySince = Test::Now();
+                    }
+                    session->MediaKeySession->Update(ecm.Data(), ecm.Length());
+                    ++_ecms;
+                }
+
+                ++sequence;
+            } while( WaitUntil(start + std::chrono::milliseconds(static_cast<uint64_t>(sequence) * _options.ECMInterval)) == true );
+        }
+
+        // EMMs of varying size over the EMM table_ids, an EMMDELIVERY Update each like a player forwarding the EMM PID
+        void EMMFeeder() {
+            const Clock::time_point start = Clock::now();
+            uint32_t sequence = 0;
+            uint32_t tick = 0;
+
+            while( WaitUntil(start + std::chrono::milliseconds(static_cast<uint64_t>(++tick) * EMMInterval)) == true ) {
+                const uint32_t due = static_cast<uint32_t>(( static_cast<uint64_t>(tick) * EMMInterval * _options.EMMRate ) / 1000);
+
+                for( ; sequence < due; ++sequence ) {
+                    const uint32_t content = ( ( ( sequence % EMMDuplicateEvery ) == 0 ) && ( sequence != 0 ) ? sequence - 1 : sequence );
+                    Test::Message emm(Request::EMMDELIVERY);
+                    emm.Buffer(Test::Section(0x82 + ( content % 14 ), 64 + ( ( content * 7 ) % 120 ), content));
+                    _base->Update(emm.Data(), emm.Length());
+                }
+                _emms = sequence;
+            }
+        }
+
+        void Respond(const Exchange& exchange) {
+            ++_keyMessages;
+            {
+                std::lock_guard<std::mutex> guard(_exchangeLock);
+                _exchanges.push_back(exchange);
+            }
+            _exchangeQueued.notify_one();
+        }
+
+        // answers on the system proxy, outside the plugin callbacks like a client would
+        void Responder() {
+            std::unique_lock<std::mutex> guard(_exchangeLock);
+
+            while( true ) {
+                _exchangeQueued.wait(guard, [this]() { return ( ( _exchanges.empty() == false ) || ( Stopping() == true ) ); });
+
+                if( _exchanges.empty() == true ) {
+                    break;
+                }
+
+                const Exchange exchange(_exchanges.front());
+                _exchanges.pop_front();
+                guard.unlock();
+
+                Test::Message response(exchange.Type, exchange.RequestId);
+                response.Text(_T("license"));
+                if( exchange.Origin != nullptr ) {
+                    exchange.Origin->Responded = Test::Now();
+                }
+                _base->Update(response.Data(), response.Length());
+                ++_responses;
+
+                guard.lock();
+            }
+        }
+
+        bool Stopping() {
+            std::lock_guard<std::mutex> guard(_stopLock);
+            return ( _stop );
+        }
+
+        string Snapshot() const {
+            return Test::StatisticsSnapshot(_statistics);
+        }
+
+        // once a second until the duration is over
+        void Monitor() {
+            const Clock::time_point start = Clock::now();
+            uint32_t ecms = 0, emms = 0, keymessages = 0;
+            uint32_t lockwaits = 0, waits = 0;
+            uint64_t lockwait = 0, wait = 0;
+
+            printf("%4s %8s %8s %8s | %10s %8s %8s | %6s %8s %10s\n", "s", "ECM/s", "EMM/s", "keymsg/s", "lockwait/s", "avg us", "max us", "depth", "maxdepth", "waited us");
+
+            for( uint32_t second = 1; second <= _options.Duration; ++second ) {
+                std::this_thread::sleep_until(start + std::chrono::seconds(second));
+
+                Statistics::Data statistics;
+                statistics.FromString(Snapshot());
+
+                const uint32_t lockwaitcount = statistics.LockWait.Count.Value();
+                const uint64_t lockwaittotal = statistics.LockWait.Total.Value();
+                const uint32_t waitcount = statistics.Commands.Waiting.Count.Value();
+                const uint64_t waittotal = statistics.Commands.Waiting.Total.Value();
+
+                printf("%4u %8u %8u %8u | %10u %8.1f %8u | %6u %8u %10.1f\n", second, _ecms - ecms, _emms - emms, _keyMessages - keymessages,
+                    lockwaitcount - lockwaits, ( lockwaitcount != lockwaits ? static_cast<double>(lockwaittotal - lockwait) / ( lockwaitcount - lockwaits ) : 0.0 ),
+                    statistics.LockWait.Max.Value(), statistics.Commands.Depth.Value(), statistics.Commands.MaxDepth.Value(),
+                    ( waitcount != waits ? static_cast<double>(waittotal - wait) / ( waitcount - waits ) : 0.0 ));
+
+                ecms = _ecms;
+                emms = _emms;
+                keymessages = _keyMessages;
+                lockwaits = lockwaitcount;
+                lockwait = lockwaittotal;
+                waits = waitcount;
+                wait = waittotal;
+            }
+        }
+
+        void Report() {
+            Statistics::Data statistics;
+            statistics.FromString(Snapshot());
+
+            const double duration = ( _options.Duration != 0 ? _options.Duration : 1 );
+
+            printf("\n%u sessions on %u TSIDs for %u s\n", _options.Sessions, _options.TSIDs, _options.Duration);
+            printf("%-44s %10u, %10.0f/s\n", "ECMs", _ecms.load(), _ecms / duration);
+            printf("%-44s %10u, %10.0f/s\n", "EMMs", _emms.load(), _emms / duration);
+            printf("%-44s %10u\n", "renewals asked", _renewals.load());
+            printf("%-44s %10u\n", "key messages answered", _responses.load());
+            printf("%-44s %10u\n", "keys usable", _keysUsable.load());
+            printf("%-44s %10u ECMs, %u EMMs, %u needkeys, %u renewals, %u imports\n", "PRM stub", PRMStubCount(PRMSTUB_ECMS), PRMStubCount(PRMSTUB_EMMS),
+                PRMStubCount(PRMSTUB_NEEDKEYS), PRMStubCount(PRMSTUB_RENEWALS), PRMStubCount(PRMSTUB_IMPORTS));
+            printf("%-44s %10u waits, avg %.1f us, max %u us\n", "g_lock", statistics.LockWait.Count.Value(),
+                ( statistics.LockWait.Count.Value() != 0 ? static_cast<double>(statistics.LockWait.Total.Value()) / statistics.LockWait.Count.Value() : 0.0 ),
+                statistics.LockWait.Max.Value());
+            printf("%-44s %10u executed, max depth %u, %u dropped, %u replaced, %u purged\n", "command queue", statistics.Commands.Executed.Value(),
+                statistics.Commands.MaxDepth.Value(), statistics.Commands.Dropped.Value(), statistics.Commands.Replaced.Value(), statistics.Commands.Purged.Value());
+
+            _needKey.Print("first ECM without key to KEYNEEDED callback");
+            _keyUsable.Print("license response to KeyUsable callback");
+            _renewal.Print("PRM renewal to RENEWAL callback");
+        }
+
+    private:
+        Test::Plugin _system;
+        Test::Plugin _connect;
+        const Options _options;
+        Test::GetStatistics _statistics;
+        IMediaKeySession* _base;
+        Test::Callback _baseCallback;
+        std::vector<std::unique_ptr<Session>> _sessions;
+
+        std::mutex _stopLock;
+        std::condition_variable _stopped;
+        bool _stop;
+
+        std::mutex _exchangeLock;
+        std::condition_variable _exchangeQueued;
+        std::deque<Exchange> _exchanges;
+
+        std::atomic<uint32_t> _ecms;
+        std::atomic<uint32_t> _emms;
+        std::atomic<uint32_t> _keyMessages;
+        std::atomic<uint32_t> _responses;
+        std::atomic<uint32_t> _keysUsable;
+        std::atomic<uint32_t> _renewals;
+        std::atomic<uint64_t> _renewalRequested;
+
+        Test::Samples _needKey;
+        Test::Samples _keyUsable;
+        Test::Samples _renewal;
+    };
+
+}
+
+int main(int argc, char* argv[]) {
+    Options options = { 16, 4, 10, 100, 200, 5000, 10000 };
+
+    bool valid = true;
+    int option;
+    while( ( option = getopt(argc, argv, "s:t:d:e:m:r:k:") ) != -1 ) {
+        const uint32_t value = static_cast<uint32_t>(strtoul(optarg, nullptr, 10));
+        switch( option ) {
+        case 's': options.Sessions = value; break;
+        case 't': options.TSIDs = value; break;
+        case 'd': options.Duration = value; break;
+        case 'e': options.ECMInterval = value; break;
+        case 'm': options.EMMRate = value; break;
+        case 'r': options.RenewalInterval = value; break;
+        case 'k': options.KeyPeriod = value; break;
+        default: valid = false; break;
+        }
+    }
+
+    if( ( valid == false ) || ( ( argc - optind ) != 2 ) || ( options.TSIDs == 0 ) || ( options.ECMInterval == 0 ) ) {
+        printf("usage: %s <NagraSystem.drm> <NagraConnect.drm> [-s sessions] [-t TSIDs] [-d seconds] [-e ECM interval ms] [-m EMMs/s] [-r renewal interval ms] [-k key period ms]\n", argv[0]);
+        return 1;
+    }
+
+    LoadGenerator generator(argv[optind], argv[optind + 1], options);
+
+    if( generator.IsValid() == false ) {
+        printf("could not load the plugins\n");
+        return 1;
+    }
+
+    return ( generator.Run() == true ? 0 : 1 );
+}
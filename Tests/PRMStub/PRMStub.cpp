@@ -0,0 +1,755 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Stand-in for libnagra_cma, the definitions follow the declarations of the PRM SDK headers (NAGRA_INCLUDE_DIRS).
+
+#include "PRMStub.h"
+
+#include <nagra/nagra_cma_platf.h>
+#include <nagra/prm_asm.h>
+#include <nagra/prm_dsm.h>
+#include <nagra/nv_imsm.h>
+#include <nagra/nv_dpsc.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace {
+
+    using RenewalListener = bool (*)(TNvSession);
+    using NeedKeyListener = bool (*)(TNvSession, TNvSession, TNvKeyStatus, TNvBuffer*, TNvStreamType);
+    using CompleteListener = bool (*)(TNvSession);
+
+    constexpr uint32_t Failure = ~static_cast<uint32_t>(0);
+
+    // the content handed to OnNeedKey, so nvLdsUsePrmContentMetadata knows which descrambling session the exchange is for
+    constexpr uint8_t ContentTag[] = { 'S', 'T', 'U', 'B' };
+    constexpr uint8_t ContentSize = sizeof(ContentTag) + sizeof(TNvSession);
+
+    struct Application {
+        void* Context;
+        RenewalListener Renewal;
+        NeedKeyListener NeedKey;
+    };
+
+    struct Descrambling {
+        TNvSession Application;
+        bool Key;
+        bool Requested; // OnNeedKey raised, waiting for the key
+    };
+
+    struct Delivery {
+        TNvSession Application;
+        TNvSession Descrambling; // 0: renewal
+        CompleteListener Complete;
+    };
+
+    // the thread the listeners are called on, from nvInitialize() until nvTerminate()
+    class Dispatcher {
+    public:
+        Dispatcher(const Dispatcher&) = delete;
+        Dispatcher& operator=(const Dispatcher&) = delete;
+
+        Dispatcher()
+            : _lock()
+            , _signal()
+            , _events()
+            , _running(false)
+            , _thread() {
+        }
+        ~Dispatcher() {
+            Stop();
+        }
+
+        void Start() {
+            std::lock_guard<std::mutex> guard(_lock);
+            if( _running == false ) {
+                _running = true;
+                _thread = std::thread(&Dispatcher::Worker, this);
+            }
+        }
+        void Stop() {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                _running = false;
+                _events.clear(); // the plugin is going away, its listeners must not be called anymore
+            }
+            _signal.notify_one();
+            if( _thread.joinable() == true ) {
+                _thread.join();
+            }
+        }
+        void Post(std::function<void()>&& event) {
+            {
+                std::lock_guard<std::mutex> guard(_lock);
+                if( _running == true ) {
+                    _events.push_back(std::move(event));
+                }
+            }
+            _signal.notify_one();
+        }
+
+    private:
+        void Worker() {
+            std::unique_lock<std::mutex> guard(_lock);
+            while( _running == true ) {
+                if( _events.empty() == true ) {
+                    _signal.wait(guard);
+                }
+                else {
+                    std::function<void()> event(std::move(_events.front()));
+                    _events.pop_front();
+                    guard.unlock();
+                    event();
+                    guard.lock();
+                }
+            }
+        }
+
+    private:
+        std::mutex _lock;
+        std::condition_variable _signal;
+        std::deque<std::function<void()>> _events;
+        bool _running;
+        std::thread _thread;
+    };
+
+    class Stub {
+    public:
+        Stub(const Stub&) = delete;
+        Stub& operator=(const Stub&) = delete;
+
+        Stub()
+            : _lock()
+            , _nextSession(1)
+            , _applications()
+            , _descramblings()
+            , _deliveries()
+            , _needKeyOnECM(true)
+            , _filters(4)
+            , _observer(nullptr)
+            , _dispatcher() {
+            for( std::atomic<uint32_t>& latency : _latencies ) {
+                latency = 0;
+            }
+            for( std::atomic<uint32_t>& counter : _counters ) {
+                counter = 0;
+            }
+            Configure(::getenv("NAGRA_PRM_STUB_LATENCY"));
+        }
+        ~Stub() = default;
+
+        static Stub& Instance() {
+            static Stub stub;
+            return stub;
+        }
+
+    public:
+        void Delay(const PRMStubGroup group) const {
+            const uint32_t latency = _latencies[group].load(std::memory_order_relaxed);
+            if( latency != 0 ) {
+                std::this_thread::sleep_for(std::chrono::microseconds(latency));
+            }
+        }
+        void Latency(const PRMStubGroup group, const uint32_t latency) {
+            _latencies[group] = latency;
+        }
+        void Count(const PRMStubCounter counter, const int32_t delta = 1) {
+            _counters[counter].fetch_add(delta, std::memory_order_relaxed);
+        }
+        uint32_t Counter(const PRMStubCounter counter) const {
+            return _counters[counter].load(std::memory_order_relaxed);
+        }
+        void NeedKeyOnECM(const bool enabled) {
+            _needKeyOnECM = enabled;
+        }
+        void Filters(const uint8_t count) {
+            _filters = count;
+        }
+        uint8_t Filters() const {
+            return _filters.load(std::memory_order_relaxed);
+        }
+        void Observer(PRMStubObserver observer) {
+            _observer = observer;
+        }
+        Dispatcher& Events() {
+            return _dispatcher;
+        }
+
+        TNvSession OpenApplication() {
+            std::lock_guard<std::mutex> guard(_lock);
+            const TNvSession session = NewSession();
+            Application& application(_applications[session]);
+            application.Context = nullptr;
+            application.Renewal = nullptr;
+            application.NeedKey = nullptr;
+            return session;
+        }
+        bool CloseApplication(const TNvSession session) {
+            std::lock_guard<std::mutex> guard(_lock);
+            return ( Close(_applications, session) == true );
+        }
+        bool SetContext(const TNvSession session, void* context) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _applications.find(session);
+            if( index != _applications.end() ) {
+                index->second.Context = context;
+            }
+            return ( index != _applications.end() );
+        }
+        bool GetContext(const TNvSession session, TNvHandle* context) const {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _applications.find(session);
+            if( index != _applications.end() ) {
+                *context = static_cast<TNvHandle>(index->second.Context);
+            }
+            return ( index != _applications.end() );
+        }
+        bool Listener(const TNvSession session, RenewalListener renewal, NeedKeyListener needkey) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _applications.find(session);
+            if( index != _applications.end() ) {
+                if( renewal != nullptr ) {
+                    index->second.Renewal = renewal;
+                }
+                if( needkey != nullptr ) {
+                    index->second.NeedKey = needkey;
+                }
+            }
+            return ( index != _applications.end() );
+        }
+
+        TNvSession OpenDescrambling(const TNvSession application) {
+            std::lock_guard<std::mutex> guard(_lock);
+            TNvSession session = 0;
+            if( _applications.find(application) != _applications.end() ) {
+                session = NewSession();
+                Descrambling& descrambling(_descramblings[session]);
+                descrambling.Application = application;
+                descrambling.Key = false;
+                descrambling.Requested = false;
+            }
+            return session;
+        }
+        bool CloseDescrambling(const TNvSession session) {
+            std::lock_guard<std::mutex> guard(_lock);
+            return ( Close(_descramblings, session) == true );
+        }
+        bool ECM(const TNvSession session) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _descramblings.find(session);
+            if( ( index != _descramblings.end() ) && ( _needKeyOnECM == true ) && ( index->second.Key == false ) && ( index->second.Requested == false ) ) {
+                PostNeedKey(index->first, index->second);
+            }
+            return ( index != _descramblings.end() );
+        }
+        bool NeedKey(const TNvSession session) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _descramblings.find(session);
+            if( index != _descramblings.end() ) {
+                PostNeedKey(index->first, index->second);
+            }
+            return ( index != _descramblings.end() );
+        }
+        uint32_t Renewal() {
+            std::lock_guard<std::mutex> guard(_lock);
+            uint32_t count = 0;
+            for( const std::pair<const TNvSession, Application>& application : _applications ) {
+                if( application.second.Renewal != nullptr ) {
+                    const TNvSession session = application.first;
+                    RenewalListener listener = application.second.Renewal;
+                    _dispatcher.Post([this, session, listener]() {
+                        Count(PRMSTUB_RENEWALS);
+                        Observe(PRMSTUB_RENEWAL, session);
+                        listener(session);
+                    });
+                    ++count;
+                }
+            }
+            return count;
+        }
+        void ExpireKeys() {
+            std::lock_guard<std::mutex> guard(_lock);
+            for( std::pair<const TNvSession, Descrambling>& descrambling : _descramblings ) {
+                descrambling.second.Key = false;
+            }
+        }
+
+        TNvSession OpenDelivery(const TNvSession application) {
+            std::lock_guard<std::mutex> guard(_lock);
+            TNvSession session = 0;
+            if( _applications.find(application) != _applications.end() ) {
+                session = NewSession();
+                Delivery& delivery(_deliveries[session]);
+                delivery.Application = application;
+                delivery.Descrambling = 0;
+                delivery.Complete = nullptr;
+            }
+            return session;
+        }
+        bool CloseDelivery(const TNvSession session) {
+            std::lock_guard<std::mutex> guard(_lock);
+            return ( Close(_deliveries, session) == true );
+        }
+        bool Listener(const TNvSession session, CompleteListener complete) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _deliveries.find(session);
+            if( index != _deliveries.end() ) {
+                index->second.Complete = complete;
+            }
+            return ( index != _deliveries.end() );
+        }
+        bool Content(const TNvSession session, const TNvBuffer* content) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _deliveries.find(session);
+            if( index != _deliveries.end() ) {
+                index->second.Descrambling = 0;
+                if( ( content != nullptr ) && ( content->size == ContentSize ) && ( memcmp(content->data, ContentTag, sizeof(ContentTag)) == 0 ) ) {
+                    memcpy(&(index->second.Descrambling), &(static_cast<const uint8_t*>(content->data)[sizeof(ContentTag)]), sizeof(TNvSession));
+                }
+            }
+            return ( index != _deliveries.end() );
+        }
+        std::string Challenge(const TNvSession session) const {
+            std::lock_guard<std::mutex> guard(_lock);
+            std::string challenge;
+            auto index = _deliveries.find(session);
+            if( index != _deliveries.end() ) {
+                challenge = "challenge:" + std::to_string(session) + ':' + std::to_string(index->second.Descrambling);
+            }
+            return challenge;
+        }
+        bool Import(const TNvSession session) {
+            std::lock_guard<std::mutex> guard(_lock);
+            auto index = _deliveries.find(session);
+            if( index != _deliveries.end() ) {
+                auto descrambling = _descramblings.find(index->second.Descrambling);
+                if( descrambling != _descramblings.end() ) {
+                    descrambling->second.Key = true;
+                    descrambling->second.Requested = false;
+                }
+                CompleteListener listener = index->second.Complete;
+                if( listener != nullptr ) {
+                    _dispatcher.Post([this, session, listener]() {
+                        Observe(PRMSTUB_COMPLETED, session);
+                        listener(session);
+                    });
+                }
+            }
+            return ( index != _deliveries.end() );
+        }
+
+        TNvSession OpenOther() {
+            std::lock_guard<std::mutex> guard(_lock);
+            return NewSession();
+        }
+        void CloseOther() {
+            Count(PRMSTUB_SESSIONS, -1);
+        }
+
+    private:
+        void Configure(const char settings[]) {
+            static const char* const names[PRMSTUB_GROUPS] = { "asm", "dsm", "lds", "imsm", "dpsc", "platform" };
+
+            const std::string text( settings != nullptr ? settings : "" );
+            size_t start = 0;
+            while( start < text.length() ) {
+                size_t end = text.find(',', start);
+                if( end == std::string::npos ) {
+                    end = text.length();
+                }
+                const std::string entry(text.substr(start, end - start));
+                const size_t separator = entry.find('=');
+                if( separator != std::string::npos ) {
+                    for( uint8_t group = 0; group < PRMSTUB_GROUPS; ++group ) {
+                        if( entry.compare(0, separator, names[group]) == 0 ) {
+                            _latencies[group] = static_cast<uint32_t>(strtoul(entry.c_str() + separator + 1, nullptr, 10));
+                        }
+                    }
+                }
+                start = end + 1;
+            }
+        }
+        TNvSession NewSession() {
+            // already in lock
+            Count(PRMSTUB_SESSIONS);
+            return _nextSession++;
+        }
+        template<typename SESSIONS>
+        bool Close(SESSIONS& sessions, const TNvSession session) {
+            // already in lock
+            const bool closed = ( sessions.erase(session) != 0 );
+            if( closed == true ) {
+                Count(PRMSTUB_SESSIONS, -1);
+            }
+            return closed;
+        }
+        void PostNeedKey(const TNvSession session, Descrambling& descrambling) {
+            // already in lock
+            descrambling.Requested = true;
+            const TNvSession application = descrambling.Application;
+            _dispatcher.Post([this, application, session]() {
+                NeedKeyListener listener = nullptr;
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    auto entry = _applications.find(application);
+                    if( entry != _applications.end() ) {
+                        listener = entry->second.NeedKey;
+                    }
+                }
+                if( listener != nullptr ) {
+                    uint8_t content[ContentSize];
+                    memcpy(content, ContentTag, sizeof(ContentTag));
+                    memcpy(&content[sizeof(ContentTag)], &session, sizeof(session));
+                    TNvBuffer buffer = { content, sizeof(content) };
+                    Count(PRMSTUB_NEEDKEYS);
+                    Observe(PRMSTUB_NEEDKEY, session);
+                    listener(application, session, TNvKeyStatus(), &buffer, NV_STREAM_TYPE_DVB);
+                }
+            });
+        }
+        void Observe(const PRMStubEvent event, const TNvSession session) const {
+            PRMStubObserver observer = _observer.load();
+            if( observer != nullptr ) {
+                observer(event, session);
+            }
+        }
+
+    private:
+        mutable std::mutex _lock;
+        TNvSession _nextSession;
+        std::map<TNvSession, Application> _applications;
+        std::map<TNvSession, Descrambling> _descramblings;
+        std::map<TNvSession, Delivery> _deliveries;
+        std::atomic<bool> _needKeyOnECM;
+        std::atomic<uint8_t> _filters;
+        std::atomic<PRMStubObserver> _observer;
+        std::atomic<uint32_t> _latencies[PRMSTUB_GROUPS];
+        std::atomic<uint32_t> _counters[PRMSTUB_COUNTERS];
+        Dispatcher _dispatcher;
+    };
+
+    // the two-call pattern of the export calls: without a buffer only the size is returned
+    bool Export(const std::string& message, TNvBuffer* buffer) {
+        bool exported = false;
+        if( buffer != nullptr ) {
+            if( buffer->data == nullptr ) {
+                buffer->size = message.length() + 1;
+                exported = true;
+            }
+            else if( buffer->size >= ( message.length() + 1 ) ) {
+                memcpy(buffer->data, message.c_str(), message.length() + 1);
+                buffer->size = message.length() + 1;
+                exported = true;
+            }
+        }
+        return exported;
+    }
+
+    uint32_t Result(const bool succeeded, const uint32_t success) {
+        return ( succeeded == true ? success : Failure );
+    }
+
+    // the filter bytes in the first half, the mask bytes in the second, see PRMStubAddress
+    void Filter(TNvFilter& filter, const uint8_t index) {
+        uint8_t value[1 + sizeof(uint32_t)] = {};
+        uint8_t length = 0;
+
+        if( index == 0 ) {
+            value[0] = 0x82;
+            length = 1;
+        }
+        else if( index == 1 ) {
+            value[0] = 0x86;
+            value[1] = static_cast<uint8_t>(PRMSTUB_UNIQUE_ADDRESS >> 24);
+            value[2] = static_cast<uint8_t>(PRMSTUB_UNIQUE_ADDRESS >> 16);
+            value[3] = static_cast<uint8_t>(PRMSTUB_UNIQUE_ADDRESS >> 8);
+            value[4] = static_cast<uint8_t>(PRMSTUB_UNIQUE_ADDRESS);
+            length = 5;
+        }
+        else {
+            const uint32_t group = PRMSTUB_GROUP_ADDRESS + index - 2;
+            value[0] = 0x84;
+            value[1] = static_cast<uint8_t>(group >> 16);
+            value[2] = static_cast<uint8_t>(group >> 8);
+            value[3] = static_cast<uint8_t>(group);
+            length = 4;
+        }
+
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(&filter);
+        const uint8_t half = sizeof(TNvFilter) / 2;
+        memset(bytes, 0, sizeof(TNvFilter));
+        for( uint8_t position = 0; ( position < length ) && ( position < half ); ++position ) {
+            bytes[position] = value[position];
+            bytes[half + position] = 0xFF;
+        }
+    }
+
+} // namespace
+
+// control interface
+
+void PRMStubSetLatency(const enum PRMStubGroup group, const uint32_t latency) {
+    if( group < PRMSTUB_GROUPS ) {
+        Stub::Instance().Latency(group, latency);
+    }
+}
+
+void PRMStubSetNeedKeyOnECM(const bool enabled) {
+    Stub::Instance().NeedKeyOnECM(enabled);
+}
+
+void PRMStubSetFilters(const uint8_t count) {
+    Stub::Instance().Filters(count);
+}
+
+void PRMStubSetObserver(PRMStubObserver observer) {
+    Stub::Instance().Observer(observer);
+}
+
+bool PRMStubNeedKey(const TNvSession descramblingsession) {
+    return Stub::Instance().NeedKey(descramblingsession);
+}
+
+uint32_t PRMStubRenewal() {
+    return Stub::Instance().Renewal();
+}
+
+void PRMStubExpireKeys() {
+    Stub::Instance().ExpireKeys();
+}
+
+uint32_t PRMStubCount(const enum PRMStubCounter counter) {
+    return ( counter < PRMSTUB_COUNTERS ? Stub::Instance().Counter(counter) : 0 );
+}
+
+// platform
+
+int nagra_cma_platf_init() {
+    Stub::Instance().Delay(PRMSTUB_PLATFORM);
+    return NAGRA_CMA_PLATF_OK;
+}
+
+int nagra_cma_platf_term() {
+    Stub::Instance().Delay(PRMSTUB_PLATFORM);
+    return NAGRA_CMA_PLATF_OK;
+}
+
+int nagra_cma_platf_dsm_open(uint32_t /* TSID */) {
+    Stub::Instance().Delay(PRMSTUB_PLATFORM);
+    return NAGRA_CMA_PLATF_OK;
+}
+
+int nagra_cma_platf_dsm_close(uint32_t /* TSID */) {
+    Stub::Instance().Delay(PRMSTUB_PLATFORM);
+    return NAGRA_CMA_PLATF_OK;
+}
+
+int nagra_cma_platf_dsm_cmd(uint32_t /* TSID */, uint8_t* /* data */, size_t /* size */) {
+    Stub::Instance().Delay(PRMSTUB_PLATFORM);
+    Stub::Instance().Count(PRMSTUB_PLATFORMCOMMANDS);
+    return NAGRA_CMA_PLATF_OK;
+}
+
+// library
+
+bool nvInitialize() {
+    Stub::Instance().Events().Start();
+    return true;
+}
+
+void nvTerminate() {
+    Stub::Instance().Events().Stop();
+}
+
+// application sessions
+
+uint32_t nvAsmOpen(TNvSession* session, TNvBuffer* /* operatorvault */) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    *session = Stub::Instance().OpenApplication();
+    return NV_ASM_SUCCESS;
+}
+
+uint32_t nvAsmClose(TNvSession session) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    return Result(Stub::Instance().CloseApplication(session), NV_ASM_SUCCESS);
+}
+
+uint32_t nvAsmGetContext(TNvSession session, TNvHandle* context) {
+    return Result(Stub::Instance().GetContext(session, context), NV_ASM_SUCCESS);
+}
+
+uint32_t nvAsmSetContext(TNvSession session, void* context) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    return Result(Stub::Instance().SetContext(session, context), NV_ASM_SUCCESS);
+}
+
+uint32_t nvAsmSetOnRenewalListener(TNvSession session, bool (*listener)(TNvSession)) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    return Result(Stub::Instance().Listener(session, listener, nullptr), NV_ASM_SUCCESS);
+}
+
+uint32_t nvAsmSetOnNeedKeyListener(TNvSession session, bool (*listener)(TNvSession, TNvSession, TNvKeyStatus, TNvBuffer*, TNvStreamType)) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    return Result(Stub::Instance().Listener(session, nullptr, listener), NV_ASM_SUCCESS);
+}
+
+uint32_t nvAsmUseStorage(TNvSession /* session */, char* /* path */) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    return NV_ASM_SUCCESS;
+}
+
+uint32_t nvAsmGetProvisioningParameters(TNvSession session, TNvBuffer* parameters) {
+    Stub::Instance().Delay(PRMSTUB_ASM);
+    return Result(Export("provisioning:" + std::to_string(session), parameters), NV_ASM_SUCCESS);
+}
+
+// license delivery sessions
+
+uint32_t nvLdsOpen(TNvSession* session, TNvSession application) {
+    Stub::Instance().Delay(PRMSTUB_LDS);
+    *session = Stub::Instance().OpenDelivery(application);
+    return Result(*session != 0, NV_LDS_SUCCESS);
+}
+
+uint32_t nvLdsClose(TNvSession session) {
+    Stub::Instance().Delay(PRMSTUB_LDS);
+    return Result(Stub::Instance().CloseDelivery(session), NV_LDS_SUCCESS);
+}
+
+uint32_t nvLdsSetOnCompleteListener(TNvSession session, bool (*listener)(TNvSession)) {
+    Stub::Instance().Delay(PRMSTUB_LDS);
+    return Result(Stub::Instance().Listener(session, listener), NV_LDS_SUCCESS);
+}
+
+uint32_t nvLdsUsePrmContentMetadata(TNvSession session, const TNvBuffer* content, TNvStreamType /* type */) {
+    Stub::Instance().Delay(PRMSTUB_LDS);
+    return Result(Stub::Instance().Content(session, content), NV_LDS_SUCCESS);
+}
+
+uint32_t nvLdsExportMessage(TNvSession session, TNvBuffer* message) {
+    Stub::Instance().Delay(PRMSTUB_LDS);
+    const std::string challenge(Stub::Instance().Challenge(session));
+    return Result(( challenge.empty() == false ) && ( Export(challenge, message) == true ), NV_LDS_SUCCESS);
+}
+
+uint32_t nvLdsImportMessage(TNvSession session, TNvBuffer* /* message */) {
+    Stub::Instance().Delay(PRMSTUB_LDS);
+    Stub::Instance().Count(PRMSTUB_IMPORTS);
+    return Result(Stub::Instance().Import(session), NV_LDS_SUCCESS);
+}
+
+uint32_t nvLdsGetResults(TNvSession /* session */, TNvLdsStatus* status) {
+    *status = TNvLdsStatus();
+    status->status = 0; // the keys were delivered
+    return NV_LDS_SUCCESS;
+}
+
+// descrambling sessions
+
+uint32_t nvDsmOpen(TNvSession* session, TNvSession application, uint32_t /* TSID */, uint16_t /* Emi */) {
+    Stub::Instance().Delay(PRMSTUB_DSM);
+    *session = Stub::Instance().OpenDescrambling(application);
+    return Result(*session != 0, NV_DSM_SUCCESS);
+}
+
+uint32_t nvDsmClose(TNvSession session) {
+    Stub::Instance().Delay(PRMSTUB_DSM);
+    return Result(Stub::Instance().CloseDescrambling(session), NV_DSM_SUCCESS);
+}
+
+uint32_t nvDsmSetPrmContentMetadata(TNvSession session, TNvBuffer* /* ecm */, TNvStreamType /* type */) {
+    Stub::Instance().Delay(PRMSTUB_DSM);
+    Stub::Instance().Count(PRMSTUB_ECMS);
+    return Result(Stub::Instance().ECM(session), NV_DSM_SUCCESS);
+}
+
+// inband sessions
+
+uint32_t nvImsmOpen(TNvSession* session, TNvSession /* application */) {
+    Stub::Instance().Delay(PRMSTUB_IMSM);
+    *session = Stub::Instance().OpenOther();
+    return NV_IMSM_SUCCESS;
+}
+
+uint32_t nvImsmClose(TNvSession /* session */) {
+    Stub::Instance().Delay(PRMSTUB_IMSM);
+    Stub::Instance().CloseOther();
+    return NV_IMSM_SUCCESS;
+}
+
+uint32_t nvImsmGetFilters(TNvSession /* session */, TNvFilter* filters, uint8_t* count) {
+    Stub::Instance().Delay(PRMSTUB_IMSM);
+    uint32_t result = NV_IMSM_SUCCESS;
+    const uint8_t available = Stub::Instance().Filters();
+    if( filters == nullptr ) {
+        *count = available;
+    }
+    else if( *count >= available ) {
+        for( uint8_t index = 0; index < available; ++index ) {
+            Filter(filters[index], index);
+        }
+        *count = available;
+    }
+    else {
+        result = Failure;
+    }
+    return result;
+}
+
+uint32_t nvImsmDecryptEMM(TNvSession /* session */, TNvBuffer* /* emm */) {
+    Stub::Instance().Delay(PRMSTUB_IMSM);
+    Stub::Instance().Count(PRMSTUB_EMMS);
+    return NV_IMSM_SUCCESS;
+}
+
+// provisioning sessions
+
+uint32_t nvDpscOpen(TNvSession* session) {
+    Stub::Instance().Delay(PRMSTUB_DPSC);
+    *session = Stub::Instance().OpenOther();
+    return NV_DPSC_SUCCESS;
+}
+
+uint32_t nvDpscClose(TNvSession /* session */) {
+    Stub::Instance().Delay(PRMSTUB_DPSC);
+    Stub::Instance().CloseOther();
+    return NV_DPSC_SUCCESS;
+}
+
+uint32_t nvDpscSetClientData(TNvSession /* session */, TNvBuffer* /* data */) {
+    Stub::Instance().Delay(PRMSTUB_DPSC);
+    return NV_DPSC_SUCCESS;
+}
+
+uint32_t nvDpscExportMessage(TNvSession session, TNvBuffer* message) {
+    Stub::Instance().Delay(PRMSTUB_DPSC);
+    return Result(Export("provision:" + std::to_string(session), message), NV_DPSC_SUCCESS);
+}
+
+uint32_t nvDpscImportMessage(TNvSession /* session */, TNvBuffer* /* message */) {
+    Stub::Instance().Delay(PRMSTUB_DPSC);
+    return NV_DPSC_SUCCESS;
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <nagra/prm_asm.h>
+
+// Control interface of the stand-in PRM library (libnagra_cma_stub), for the benchmark and the load generator.
+//
+// The stub implements the nvAsm*, nvLds*, nvDsm*, nvImsm*, nvDpsc* and nagra_cma_platf_* calls the plugins use, every call
+// of a group takes the configured latency. The listeners are called from a thread of the stub, like the real library does:
+// - OnNeedKey for an ECM on a descrambling session without a key (once, until the key is delivered), or by PRMStubNeedKey()
+// - OnRenewal by PRMStubRenewal()
+// - OnComplete after every nvLdsImportMessage, which delivers the key to the descrambling session the exchange was for
+//
+// The latencies can also be set through the environment when the library is loaded, e.g. NAGRA_PRM_STUB_LATENCY="asm=50,lds=2000" (us).
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    enum PRMStubGroup {
+        PRMSTUB_ASM = 0,
+        PRMSTUB_DSM,
+        PRMSTUB_LDS,
+        PRMSTUB_IMSM,
+        PRMSTUB_DPSC,
+        PRMSTUB_PLATFORM,
+        PRMSTUB_GROUPS
+    };
+
+    enum PRMStubEvent {
+        PRMSTUB_NEEDKEY = 0, // session: the descrambling session
+        PRMSTUB_RENEWAL, // session: the application session
+        PRMSTUB_COMPLETED // session: the delivery session
+    };
+
+    enum PRMStubCounter {
+        PRMSTUB_ECMS = 0, // nvDsmSetPrmContentMetadata
+        PRMSTUB_EMMS, // nvImsmDecryptEMM
+        PRMSTUB_PLATFORMCOMMANDS, // nagra_cma_platf_dsm_cmd
+        PRMSTUB_NEEDKEYS, // OnNeedKey raised
+        PRMSTUB_RENEWALS, // OnRenewal raised
+        PRMSTUB_IMPORTS, // nvLdsImportMessage
+        PRMSTUB_SESSIONS, // currently open sessions, all kinds
+        PRMSTUB_COUNTERS
+    };
+
+    // nvImsmGetFilters() fills the filters in the layout MediaSystem/EmmPrefilter.h assumes. The first one passes the global EMMs
+    // (table_id 0x82), the second the unique EMMs (table_id 0x86) for PRMSTUB_UNIQUE_ADDRESS and every next one the shared EMMs
+    // (table_id 0x84) for the next group address, from PRMSTUB_GROUP_ADDRESS on. The address starts at section byte 3, big endian.
+    enum PRMStubAddress {
+        PRMSTUB_UNIQUE_ADDRESS = 0x4E564131, // 4 bytes
+        PRMSTUB_GROUP_ADDRESS = 0x00C0DE00 // 3 bytes
+    };
+
+    // called on the stub thread right before the listener of the plugin
+    typedef void (*PRMStubObserver)(const enum PRMStubEvent event, const TNvSession session);
+
+    // us, every call of the group sleeps this long
+    void PRMStubSetLatency(const enum PRMStubGroup group, const uint32_t latency);
+
+    // an ECM on a descrambling session without a key raises OnNeedKey (the default), if disabled only PRMStubNeedKey() does
+    void PRMStubSetNeedKeyOnECM(const bool enabled);
+
+    // the number of filters nvImsmGetFilters() returns, 4 by default (so 2 group addresses)
+    void PRMStubSetFilters(const uint8_t count);
+
+    void PRMStubSetObserver(PRMStubObserver observer);
+
+    // returns false if there is no such descrambling session
+    bool PRMStubNeedKey(const TNvSession descramblingsession);
+
+    // raises OnRenewal for every application session that has a listener, returns how many
+    uint32_t PRMStubRenewal();
+
+    // all descrambling sessions lose their key, so the next ECM raises OnNeedKey again
+    void PRMStubExpireKeys();
+
+    uint32_t PRMStubCount(const enum PRMStubCounter counter);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NagraSectionProducer <ring> <doorbell> [-z ring size] [-d seconds] [-e ECMs/s] [-m EMMs/s] [-f sections file] [-r sections/s]
+//
+// Creates a section ring and writes ECMs (table_id 0x80/0x81, changing every second) and EMMs (0x82-0x8F) into it at the
+// given rates, or the sections of a file (concatenated private sections, as filtered from the stream) over and over. The
+// system picks the ring up with a SECTIONRING Update naming the ring and the doorbell, see MediaRequest.h.
+
+#include "SectionProducer.h"
+
+#include "../Harness.h"
+
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace CDMi;
+
+namespace {
+
+    constexpr uint32_t Interval = 10; // ms
+
+    // split into sections by their section_length
+    std::vector<std::vector<uint8_t>> Load(const string& file) {
+        std::ifstream stream(file, std::ios::binary);
+        const std::vector<uint8_t> data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+        std::vector<std::vector<uint8_t>> sections;
+
+        size_t offset = 0;
+        while( ( data.size() - offset ) >= 3 ) {
+            const size_t length = ( ( ( data[offset + 1] & 0x0F ) << 8 ) | data[offset + 2] ) + 3;
+            if( ( length > ( data.size() - offset ) ) || ( length > SectionRing::MaxSectionSize ) ) {
+                printf("%s: section at offset %u is cut off or too big, ignoring the rest\n", file.c_str(), static_cast<uint32_t>(offset));
+                break;
+            }
+            sections.emplace_back(data.begin() + offset, data.begin() + offset + length);
+            offset += length;
+        }
+
+        return sections;
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    uint32_t size = 64 * 1024;
+    uint32_t duration = 60;
+    uint32_t ecmrate = 10;
+    uint32_t emmrate = 100;
+    uint32_t filerate = 100;
+    string file;
+
+    bool valid = true;
+    int option;
+    while( ( option = getopt(argc, argv, "z:d:e:m:f:r:") ) != -1 ) {
+        switch( option ) {
+        case 'z': size = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        case 'd': duration = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        case 'e': ecmrate = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        case 'm': emmrate = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        case 'f': file = optarg; break;
+        case 'r': filerate = static_cast<uint32_t>(strtoul(optarg, nullptr, 10)); break;
+        default: valid = false; break;
+        }
+    }
+
+    if( ( valid == false ) || ( ( argc - optind ) != 2 ) || ( size == 0 ) ) {
+        printf("usage: %s <ring> <doorbell> [-z ring size] [-d seconds] [-e ECMs/s] [-m EMMs/s] [-f sections file] [-r sections/s]\n", argv[0]);
+        return 1;
+    }
+
+    const std::vector<std::vector<uint8_t>> sections( file.empty() == false ? Load(file) : std::vector<std::vector<uint8_t>>() );
+
+    if( ( file.empty() == false ) && ( sections.empty() == true ) ) {
+        printf("no sections in %s\n", file.c_str());
+        return 1;
+    }
+
+    Test::SectionProducer producer(argv[optind], argv[optind + 1], size);
+
+    if( producer.IsValid() == false ) {
+        printf("could not create ring %s\n", argv[optind]);
+        return 1;
+    }
+
+    printf("writing to ring %s (%u bytes), doorbell %s, for %u s\n", argv[optind], size, argv[optind + 1], duration);
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint32_t ecms = 0, emms = 0, replayed = 0;
+    uint32_t written = 0, full = 0;
+
+    for( uint32_t tick = 1; tick <= ( ( duration * 1000 ) / Interval ); ++tick ) {
+        std::this_thread::sleep_until(start + std::chrono::milliseconds(static_cast<uint64_t>(tick) * Interval));
+
+        const uint64_t elapsed = static_cast<uint64_t>(tick) * Interval; // ms
+        std::vector<std::vector<uint8_t>> due;
+
+        if( sections.empty() == false ) {
+            for( ; replayed < ( ( elapsed * filerate ) / 1000 ); ++replayed ) {
+                due.push_back(sections[replayed % sections.size()]);
+            }
+        }
+        else {
+            for( ; ecms < ( ( elapsed * ecmrate ) / 1000 ); ++ecms ) {
+                const uint32_t second = static_cast<uint32_t>(elapsed / 1000);
+                due.push_back(Test::Section(0x80 | ( second & 1 ), 184, second));
+            }
+            for( ; emms < ( ( elapsed * emmrate ) / 1000 ); ++emms ) {
+                due.push_back(Test::Section(0x82 + ( emms % 14 ), 64 + ( ( emms * 7 ) % 120 ), emms));
+            }
+        }
+
+        for( const std::vector<uint8_t>& section : due ) {
+            if( producer.Write(section.data(), static_cast<uint16_t>(section.size())) == true ) {
+                ++written;
+            }
+            else {
+                ++full; // the consumer is not keeping up (or not there), like a demux we do not wait
+            }
+        }
+
+        if( ( elapsed % 1000 ) == 0 ) {
+            printf("%4u s: %8u sections written, %8u dropped, %6u bytes in the ring\n", static_cast<uint32_t>(elapsed / 1000), written, full, producer.Used());
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <core/core.h>
+
+#include "../../MediaSystem/SectionRing.h"
+
+namespace CDMi {
+namespace Test {
+
+    // The demux side of a SectionRing: creates the CyclicBuffer and writes every section as one record (big endian uint16
+    // length, then the section), ringing the doorbell after each.
+    class SectionProducer {
+    public:
+        SectionProducer(const SectionProducer&) = delete;
+        SectionProducer& operator=(const SectionProducer&) = delete;
+
+        SectionProducer(const string& ring, const string& doorbell, const uint32_t size)
+            : _ring(ring, Thunder::Core::File::CREATE | Thunder::Core::File::USER_READ | Thunder::Core::File::USER_WRITE | Thunder::Core::File::SHAREABLE, size, false)
+            , _doorbell(doorbell.c_str())
+            , _record() {
+        }
+        ~SectionProducer() = default;
+
+        bool IsValid() const {
+            return ( _ring.IsValid() == true );
+        }
+
+        // false if the ring has no room for it now (nothing is written then) or it is no section
+        bool Write(const uint8_t section[], const uint16_t length) {
+            bool result = false;
+
+            if( ( length <= SectionRing::MaxSectionSize ) && ( _ring.Free() >= ( static_cast<uint32_t>(length) + 2 ) ) ) {
+                // in one Write, the consumer takes a length it can not read completely for a ring out of sync
+                _record[0] = static_cast<uint8_t>(length >> 8);
+                _record[1] = static_cast<uint8_t>(length);
+                memcpy(&_record[2], section, length);
+                result = ( _ring.Write(_record, length + 2) == static_cast<uint32_t>(length + 2) );
+                _doorbell.Ring();
+            }
+
+            return result;
+        }
+
+        // anything, to get the consumer out of sync
+        bool WriteRaw(const uint8_t data[], const uint32_t length) {
+            const bool result = ( ( _ring.Free() >= length ) && ( _ring.Write(data, length) == length ) );
+            _doorbell.Ring();
+            return result;
+        }
+
+        uint32_t Used() const {
+            return _ring.Used();
+        }
+
+    private:
+        Thunder::Core::CyclicBuffer _ring;
+        Thunder::Core::DoorBell _doorbell;
+        uint8_t _record[SectionRing::MaxSectionSize + 2];
+    };
+
+} // namespace Test
+} // namespace CDMi
@@ -0,0 +1,274 @@
+/*
+ * Copyright 2018 Metrological
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// NagraSectionRingTest
+//
+// SectionRing against SectionProducer in one process: the record framing at the boundary sizes and around the end of the
+// ring, what was written before the consumer attached, getting back in sync after garbage, and detaching and attaching
+// again. Exits with the number of failed checks.
+
+#include "SectionProducer.h"
+
+#include "../../Report.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace CDMi;
+
+namespace {
+
+    uint32_t g_failures = 0;
+
+    #define CHECK(condition) \
+        do { \
+            if( ( condition ) == false ) { \
+                printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+                ++g_failures; \
+            } \
+        } while( false )
+
+    constexpr uint32_t Timeout = 2000; // ms
+
+    // a ring and doorbell of our own per test
+    class Names {
+    public:
+        Names(const Names&) = delete;
+        Names& operator=(const Names&) = delete;
+
+        explicit Names(const char test[])
+            : Ring("/tmp/NagraSectionRingTest." + std::to_string(getpid()) + "." + test)
+            , DoorBell(Ring + ".doorbell") {
+        }
+        ~Names() {
+            remove(Ring.c_str());
+            remove(DoorBell.c_str());
+        }
+
+        const string Ring;
+        const string DoorBell;
+    };
+
+    // what the ring handed to ingest, ingest runs on the ring thread
+    class Collector {
+    public:
+        Collector(const Collector&) = delete;
+        Collector& operator=(const Collector&) = delete;
+
+        Collector()
+            : _lock()
+            , _added()
+            , _sections() {
+        }
+        ~Collector() = default;
+
+        SectionRing::Ingest Ingest() {
+            return [this](const uint8_t section[], const uint16_t length) {
+                {
+                    std::lock_guard<std::mutex> guard(_lock);
+                    _sections.emplace_back(section, section + length);
+                }
+                _added.notify_all();
+            };
+        }
+
+        bool WaitFor(const size_t count) {
+            std::unique_lock<std::mutex> guard(_lock);
+            return ( _added.wait_for(guard, std::chrono::milliseconds(Timeout), [this, count]() { return ( _sections.size() >= count ); }) );
+        }
+
+        std::vector<std::vector<uint8_t>> Sections() {
+            std::lock_guard<std::mutex> guard(_lock);
+            return _sections;
+        }
+
+    private:
+        std::mutex _lock;
+        std::condition_variable _added;
+        std::vector<std::vector<uint8_t>> _sections;
+    };
+
+    std::vector<uint8_t> Pattern(const uint16_t length, const uint8_t seed) {
+        std::vector<uint8_t> section(length);
+        for( uint16_t index = 0; index < length; ++index ) {
+            section[index] = static_cast<uint8_t>(seed + index);
+        }
+        return section;
+    }
+
+    bool Write(Test::SectionProducer& producer, const std::vector<uint8_t>& section) {
+        return ( producer.Write(section.data(), static_cast<uint16_t>(section.size())) );
+    }
+
+    // the consumer flushed or drained everything
+    bool WaitForEmpty(const Test::SectionProducer& producer) {
+        const std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(Timeout);
+        while( ( producer.Used() != 0 ) && ( std::chrono::steady_clock::now() < deadline ) ) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return ( producer.Used() == 0 );
+    }
+
+    void Framing() {
+        static const uint16_t lengths[] = { 1, 2, 3, 183, 184, 1024, SectionRing::MaxSectionSize - 1, SectionRing::MaxSectionSize };
+
+        Names names("framing");
+        Test::SectionProducer producer(names.Ring, names.DoorBell, 64 * 1024);
+        Collector collector;
+        SectionRing ring(names.Ring, names.DoorBell, collector.Ingest());
+
+        CHECK(producer.IsValid() == true);
+        CHECK(ring.IsValid() == true);
+
+        std::vector<std::vector<uint8_t>> sent;
+        for( const uint16_t length : lengths ) {
+            sent.push_back(Pattern(length, static_cast<uint8_t>(sent.size())));
+            CHECK(Write(producer, sent.back()) == true);
+        }
+
+        const std::vector<uint8_t> toobig(SectionRing::MaxSectionSize + 1, 0);
+        CHECK(Write(producer, toobig) == false);
+
+        CHECK(collector.WaitFor(sent.size()) == true);
+        CHECK(collector.Sections() == sent);
+        CHECK(ring.Sections() == sent.size());
+    }
+
+    // records split over the end of the ring
+    void Wrap() {
+        constexpr uint32_t count = 200;
+
+        Names names("wrap");
+        Test::SectionProducer producer(names.Ring, names.DoorBell, 8 * 1024);
+        Collector collector;
+        SectionRing ring(names.Ring, names.DoorBell, collector.Ingest());
+
+        std::vector<std::vector<uint8_t>> sent;
+        for( uint32_t index = 0; index < count; ++index ) {
+            sent.push_back(Pattern(static_cast<uint16_t>(1000 + ( ( index * 331 ) % 2000 )), static_cast<uint8_t>(index)));
+            if( Write(producer, sent.back()) == false ) {
+                CHECK(collector.WaitFor(sent.size() - 1) == true); // full, wait for the consumer to catch up
+                CHECK(Write(producer, sent.back()) == true);
+            }
+        }
+
+        CHECK(collector.WaitFor(count) == true);
+        CHECK(collector.Sections() == sent);
+    }
+
+    void BeforeAttach() {
+        Names names("beforeattach");
+        Test::SectionProducer producer(names.Ring, names.DoorBell, 16 * 1024);
+
+        std::vector<std::vector<uint8_t>> sent;
+        for( uint8_t index = 0; index < 3; ++index ) {
+            sent.push_back(Pattern(184, index));
+            CHECK(Write(producer, sent.back()) == true);
+        }
+
+        Collector collector;
+        SectionRing ring(names.Ring, names.DoorBell, collector.Ingest());
+
+        CHECK(ring.Sections() == 3); // drained while attaching
+        CHECK(collector.Sections() == sent);
+        CHECK(producer.Used() == 0);
+    }
+
+    void OutOfSync() {
+        Names names("outofsync");
+        Test::SectionProducer producer(names.Ring, names.DoorBell, 16 * 1024);
+        Collector collector;
+        SectionRing ring(names.Ring, names.DoorBell, collector.Ingest());
+
+        // a length that no section has
+        const uint8_t toobig[] = { 0xFF, 0xFF, 0x80, 0x70, 0x01, 0x02, 0x03, 0x04 };
+        CHECK(producer.WriteRaw(toobig, sizeof(toobig)) == true);
+        CHECK(WaitForEmpty(producer) == true);
+
+        // a length beyond what was written, the producer never leaves a record half written
+        const uint8_t truncated[] = { 0x00, 0x64, 0x80, 0x70, 0x61, 0x01, 0x02, 0x03 };
+        CHECK(producer.WriteRaw(truncated, sizeof(truncated)) == true);
+        CHECK(WaitForEmpty(producer) == true);
+
+        CHECK(ring.Sections() == 0);
+        CHECK(collector.Sections().empty() == true);
+
+        // and back in business with the next record
+        std::vector<std::vector<uint8_t>> sent;
+        for( uint8_t index = 0; index < 3; ++index ) {
+            sent.push_back(Pattern(184, index));
+            CHECK(Write(producer, sent.back()) == true);
+        }
+
+        CHECK(collector.WaitFor(sent.size()) == true);
+        CHECK(collector.Sections() == sent);
+    }
+
+    void Detach() {
+        Names names("detach");
+        Test::SectionProducer producer(names.Ring, names.DoorBell, 16 * 1024);
+        Collector first;
+        std::unique_ptr<SectionRing> ring(new SectionRing(names.Ring, names.DoorBell, first.Ingest()));
+
+        CHECK(Write(producer, Pattern(184, 1)) == true);
+        CHECK(first.WaitFor(1) == true);
+
+        ring.reset(); // must return with the thread waiting for the doorbell
+
+        // written while nobody is there, for whoever attaches next
+        std::vector<std::vector<uint8_t>> sent;
+        for( uint8_t index = 0; index < 2; ++index ) {
+            sent.push_back(Pattern(184, 0x10 + index));
+            CHECK(Write(producer, sent.back()) == true);
+        }
+        CHECK(producer.Used() != 0);
+        CHECK(first.Sections().size() == 1);
+
+        Collector second;
+        ring.reset(new SectionRing(names.Ring, names.DoorBell, second.Ingest()));
+
+        CHECK(ring->Sections() == 2);
+        CHECK(second.Sections() == sent);
+
+        sent.push_back(Pattern(184, 0x20));
+        CHECK(Write(producer, sent.back()) == true);
+        CHECK(second.WaitFor(sent.size()) == true);
+        CHECK(second.Sections() == sent);
+
+        ring.reset();
+    }
+
+}
+
+int main() {
+    Framing();
+    Wrap();
+    BeforeAttach();
+    OutOfSync();
+    Detach();
+
+    Log::Flush();
+
+    printf("%u failed checks\n", g_failures);
+
+    return ( g_failures == 0 ? 0 : 1 );
+}